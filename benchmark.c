@@ -0,0 +1,452 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Programmer benchmark: measures what a programmer sustains with the probed chip and prints a profile. The
+ * profile can be saved and used for the duration estimate of --plan. Its format is
+ *
+ *   flashrom-profile 1
+ *   programmer <programmer name>
+ *   chip <chip name>
+ *   latency_us <round trip of a status register read in microseconds>
+ *   read <chunk size> <bytes per second>
+ *   ...
+ *   read_rate <bytes per second with the largest chunk size>
+ *   program_page_us <microseconds per page, including the transfer>
+ *   erase <block size> <microseconds>
+ *   ...
+ *
+ * Lines starting with # are comments. program_page_us and erase lines are only present if a scratch block was
+ * given, since measuring them destroys its contents. The scratch block is saved before and restored after.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include "flash.h"
+#include "chipdrivers.h"
+#include "programmer.h"
+
+#define PROFILE_MAGIC		"flashrom-profile 1"
+
+/* Number of status register reads averaged for the command latency. */
+#define BENCH_LATENCY_LOOPS	256
+/* Every chunk size is read until at least 16 chunks and BENCH_READ_MIN bytes, but at most BENCH_READ_MAX bytes,
+ * were transferred.
+ */
+#define BENCH_READ_MIN		4096
+#define BENCH_READ_MAX		(256 * 1024)
+#define BENCH_MAX_CHUNK		(64 * 1024)
+#define BENCH_DEFAULT_PAGE	256
+
+static double elapsed_us(const struct timeval *start)
+{
+	struct timeval end;
+
+	gettimeofday(&end, NULL);
+	return (end.tv_sec - start->tv_sec) * 1000000.0 + (end.tv_usec - start->tv_usec);
+}
+
+static uint8_t *bench_malloc(unsigned int len)
+{
+	uint8_t *buf = malloc(len);
+	if (!buf) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	return buf;
+}
+
+/* Returns the average round trip of the shortest command the chip understands in microseconds. SPI chips read
+ * their status register, others a single byte.
+ */
+static double measure_latency(struct flashctx *flash)
+{
+	struct timeval start;
+	uint8_t byte;
+	int i;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < BENCH_LATENCY_LOOPS; i++) {
+		if (flash->chip->bustype == BUS_SPI)
+			spi_read_status_register(flash);
+		else if (flash->chip->read(flash, &byte, 0, 1))
+			return -1;
+	}
+	return elapsed_us(&start) / BENCH_LATENCY_LOOPS;
+}
+
+/* Returns the read throughput in bytes per second when reading in chunks of chunk bytes, -1 on error. */
+static double measure_read(struct flashctx *flash, uint8_t *buf, unsigned int chunk)
+{
+	unsigned int size = flash->chip->total_size * 1024;
+	unsigned int total = min(size, min(BENCH_READ_MAX, max(chunk * 16, BENCH_READ_MIN)));
+	unsigned int off;
+	struct timeval start;
+	double us;
+
+	total -= total % chunk;
+	gettimeofday(&start, NULL);
+	for (off = 0; off < total; off += chunk) {
+		if (flash->chip->read(flash, buf + off, off, chunk))
+			return -1;
+	}
+	us = elapsed_us(&start);
+	return us > 0 ? total / us * 1000000.0 : 0;
+}
+
+/* Returns the largest read chunk worth measuring: the programmer's limit if it has one, otherwise 64 kB. */
+static unsigned int max_read_chunk(const struct flashctx *flash)
+{
+	unsigned int chunk = BENCH_MAX_CHUNK;
+
+	if (flash->chip->bustype == BUS_SPI && flash->mst->spi.max_data_read != MAX_DATA_UNSPECIFIED)
+		chunk = min(chunk, flash->mst->spi.max_data_read);
+	return min(chunk, flash->chip->total_size * 1024);
+}
+
+/* Finds the erase block of eraser k which contains addr. */
+static void eraser_block_at(const struct flashctx *flash, int k, unsigned int addr, unsigned int *start,
+			    unsigned int *len)
+{
+	const struct block_eraser *eraser = &flash->chip->block_erasers[k];
+	unsigned int i, pos = 0;
+
+	for (i = 0; i < NUM_ERASEREGIONS; i++) {
+		unsigned int size = eraser->eraseblocks[i].size;
+		unsigned int end = pos + size * eraser->eraseblocks[i].count;
+		if (size && addr < end) {
+			*start = pos + (addr - pos) / size * size;
+			*len = size;
+			return;
+		}
+		pos = end;
+	}
+	*start = *len = 0;
+}
+
+/* Erases [start, start + len) with eraser k and writes contents back, skipping bytes which stay erased. */
+static int restore_block(struct flashctx *flash, int k, unsigned int start, unsigned int len,
+			 const uint8_t *contents)
+{
+	unsigned int starthere = 0, lenhere;
+	uint8_t *erased = bench_malloc(len);
+	uint8_t *check = bench_malloc(len);
+	int ret = 1;
+
+	memset(erased, 0xff, len);
+	if (flash->chip->block_erasers[k].block_erase(flash, start, len))
+		goto out;
+	while ((lenhere = get_next_write(erased + starthere, contents + starthere, len - starthere, &starthere,
+					 flash->chip->gran))) {
+		if (flash->chip->write(flash, contents + starthere, start + starthere, lenhere))
+			goto out;
+		starthere += lenhere;
+	}
+	if (flash->chip->read(flash, check, start, len) || memcmp(check, contents, len))
+		goto out;
+	ret = 0;
+out:
+	free(erased);
+	free(check);
+	return ret;
+}
+
+/* Erases the block [start, start + len) with eraser k and measures the time to program it page by page. */
+static int measure_program(struct flashctx *flash, int k, unsigned int start, unsigned int len,
+			   struct flash_profile *profile)
+{
+	unsigned int page = flash->chip->page_size ? flash->chip->page_size : BENCH_DEFAULT_PAGE;
+	unsigned int i, pages = len / page;
+	uint8_t *pattern = bench_malloc(pages * page);
+	uint8_t *check = bench_malloc(pages * page);
+	struct timeval begin;
+	double us;
+	int ret = 1;
+
+	for (i = 0; i < pages * page; i++)
+		pattern[i] = (i & 0xff) ^ 0xa5;
+	/* Erase blocks of different erasers need not be nested, hence the block may not be erased anymore. */
+	if (flash->chip->block_erasers[k].block_erase(flash, start, len)) {
+		msg_cerr("Erasing the scratch block failed.\n");
+		goto out;
+	}
+	gettimeofday(&begin, NULL);
+	if (flash->chip->write(flash, pattern, start, pages * page)) {
+		msg_cerr("Writing the scratch block failed.\n");
+		goto out;
+	}
+	us = elapsed_us(&begin);
+	if (flash->chip->read(flash, check, start, pages * page) || memcmp(check, pattern, pages * page)) {
+		msg_cerr("The written scratch block does not read back correctly.\n");
+		goto out;
+	}
+	profile->program_page_us = us / pages;
+	msg_cinfo("Program of %u pages: %.0f us per page\n", pages, profile->program_page_us);
+	ret = 0;
+out:
+	free(pattern);
+	free(check);
+	return ret;
+}
+
+/* Measures the erase latency of every block eraser and the page program time within the scratch block at addr.
+ * The scratch block is the largest erase block containing addr which does not span the whole chip. Its
+ * contents are restored afterwards.
+ */
+static int measure_destructive(struct flashctx *flash, unsigned int addr, struct flash_profile *profile)
+{
+	unsigned int size = flash->chip->total_size * 1024;
+	unsigned int page = flash->chip->page_size ? flash->chip->page_size : BENCH_DEFAULT_PAGE;
+	unsigned int start[NUM_ERASEFUNCTIONS], len[NUM_ERASEFUNCTIONS];
+	unsigned int region_start = 0, region_len = 0;
+	int k, region_k = -1, program_k = -1, ret = 0;
+	uint8_t *backup;
+	struct timeval begin;
+	double us;
+
+	for (k = 0; k < NUM_ERASEFUNCTIONS; k++) {
+		len[k] = 0;
+		if (check_block_eraser(flash, k, 0))
+			continue;
+		eraser_block_at(flash, k, addr, &start[k], &len[k]);
+		if (len[k] >= size) {
+			msg_cinfo("Not measuring eraser %i, it would erase the whole chip.\n", k);
+			len[k] = 0;
+		} else if (len[k] > region_len) {
+			region_k = k;
+			region_start = start[k];
+			region_len = len[k];
+		}
+	}
+	if (region_k < 0) {
+		msg_cerr("No block eraser can erase the scratch block alone.\n");
+		return 1;
+	}
+	msg_cinfo("Using 0x%06x-0x%06x as scratch block.\n", region_start, region_start + region_len - 1);
+
+	backup = bench_malloc(region_len);
+	if (flash->chip->read(flash, backup, region_start, region_len)) {
+		msg_cerr("Reading the scratch block failed.\n");
+		free(backup);
+		return 1;
+	}
+
+	for (k = 0; k < NUM_ERASEFUNCTIONS; k++) {
+		if (!len[k])
+			continue;
+		/* Erase blocks of different erasers are not necessarily nested. */
+		if (start[k] < region_start || start[k] + len[k] > region_start + region_len) {
+			msg_cinfo("Not measuring eraser %i, its block exceeds the scratch block.\n", k);
+			continue;
+		}
+		gettimeofday(&begin, NULL);
+		if (flash->chip->block_erasers[k].block_erase(flash, start[k], len[k])) {
+			msg_cerr("Erasing 0x%06x-0x%06x with eraser %i failed.\n", start[k],
+				 start[k] + len[k] - 1, k);
+			ret = 1;
+			goto restore;
+		}
+		us = elapsed_us(&begin);
+		msg_cinfo("Erase of %u bytes with eraser %i: %.0f us\n", len[k], k, us);
+		profile->erase[profile->erase_count].size = len[k];
+		profile->erase[profile->erase_count].us = us;
+		profile->erase_count++;
+		if (program_k < 0 || len[k] < len[program_k])
+			program_k = k;
+	}
+
+	if (program_k >= 0 && flash->chip->write && len[program_k] >= page &&
+	    measure_program(flash, program_k, start[program_k], len[program_k], profile))
+		ret = 1;
+
+restore:
+	msg_cinfo("Restoring the scratch block... ");
+	if (restore_block(flash, region_k, region_start, region_len, backup)) {
+		msg_cinfo("FAILED!\n");
+		msg_cerr("The scratch block 0x%06x-0x%06x could not be restored. Its original contents are lost\n"
+			 "unless you have a backup. DO NOT REBOOT OR POWEROFF before writing it back!\n",
+			 region_start, region_start + region_len - 1);
+		ret = 1;
+	} else {
+		msg_cinfo("done.\n");
+	}
+	free(backup);
+	return ret;
+}
+
+static int save_profile(const struct flashctx *flash, const struct flash_profile *profile,
+			const double *rates, const unsigned int *chunks, unsigned int nchunks,
+			const char *filename)
+{
+	unsigned int i;
+	FILE *file;
+	int ret = 0;
+
+	file = fopen(filename, "w");
+	if (!file) {
+		msg_gerr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
+		return 1;
+	}
+	fprintf(file, "%s\nprogrammer %s\nchip %s\n", PROFILE_MAGIC,
+		programmer_table[flash->ctx->programmer].name, flash->chip->name);
+	fprintf(file, "latency_us %.1f\n", profile->latency_us);
+	for (i = 0; i < nchunks; i++)
+		fprintf(file, "read %u %.0f\n", chunks[i], rates[i]);
+	fprintf(file, "read_rate %.0f\n", profile->read_rate);
+	if (profile->program_page_us > 0)
+		fprintf(file, "program_page_us %.1f\n", profile->program_page_us);
+	for (i = 0; i < profile->erase_count; i++)
+		fprintf(file, "erase %u %.0f\n", profile->erase[i].size, profile->erase[i].us);
+	if (ferror(file))
+		ret = 1;
+	if (fclose(file))
+		ret = 1;
+	if (ret)
+		msg_gerr("Error: writing file \"%s\" failed: %s\n", filename, strerror(errno));
+	return ret;
+}
+
+/**
+ * @brief measure what the programmer sustains with this chip
+ *
+ * Measures the command latency and the read throughput across chunk sizes. If scratch is not negative, the
+ * erase latency of every block eraser and the page program time are measured within the erase block at
+ * scratch, which is restored afterwards.
+ *
+ * @param filename	save the profile there unless NULL
+ * @return		0 on success
+ */
+int benchmark_flash(struct flashctx *flash, int force, long scratch, const char *filename)
+{
+#ifdef __LIBPAYLOAD__
+	msg_gerr("Error: No file I/O support in libpayload\n");
+	return 1;
+#else
+	unsigned int size = flash->chip->total_size * 1024;
+	unsigned int maxchunk = max_read_chunk(flash);
+	unsigned int chunks[16], nchunks = 0, chunk;
+	double rates[16];
+	struct flash_profile profile = {0};
+	uint8_t *buf;
+	int ret = 0;
+
+	if (chip_safety_check(flash, force, 1, scratch >= 0, scratch >= 0, 0)) {
+		msg_cerr("Aborting.\n");
+		return 1;
+	}
+	if (scratch >= 0 && (unsigned long)scratch >= size) {
+		msg_cerr("Scratch address 0x%lx is beyond the end of the chip.\n", scratch);
+		return 1;
+	}
+	if (flash->chip->unlock)
+		flash->chip->unlock(flash);
+
+	profile.latency_us = measure_latency(flash);
+	if (profile.latency_us < 0) {
+		msg_cerr("Reading the chip failed.\n");
+		return 1;
+	}
+	msg_cinfo("Command latency: %.1f us\n", profile.latency_us);
+
+	buf = bench_malloc(min(size, BENCH_READ_MAX));
+	for (chunk = 1; ; chunk = min(chunk * 4, maxchunk)) {
+		rates[nchunks] = measure_read(flash, buf, chunk);
+		if (rates[nchunks] < 0) {
+			msg_cerr("Reading the chip in chunks of %u bytes failed.\n", chunk);
+			free(buf);
+			return 1;
+		}
+		msg_cinfo("Read in chunks of %u bytes: %.0f kB/s\n", chunk, rates[nchunks] / 1024);
+		chunks[nchunks++] = chunk;
+		if (chunk == maxchunk)
+			break;
+	}
+	free(buf);
+	profile.read_rate = rates[nchunks - 1];
+
+	if (scratch >= 0)
+		ret = measure_destructive(flash, scratch, &profile);
+
+	if (!ret && filename)
+		ret = save_profile(flash, &profile, rates, chunks, nchunks, filename);
+	return ret;
+#endif
+}
+
+/**
+ * @brief load a profile saved by benchmark_flash()
+ *
+ * @return	0 on success
+ */
+int load_profile(const char *filename, struct flash_profile *profile)
+{
+#ifdef __LIBPAYLOAD__
+	msg_gerr("Error: No file I/O support in libpayload\n");
+	return 1;
+#else
+	char line[256];
+	unsigned int lineno = 1;
+	FILE *file;
+	int ret = 0;
+
+	memset(profile, 0, sizeof(*profile));
+	file = fopen(filename, "r");
+	if (!file) {
+		msg_gerr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
+		return 1;
+	}
+	if (!fgets(line, sizeof(line), file) || strncmp(line, PROFILE_MAGIC, strlen(PROFILE_MAGIC))) {
+		msg_gerr("Error: \"%s\" is not a flashrom profile.\n", filename);
+		fclose(file);
+		return 1;
+	}
+	while (fgets(line, sizeof(line), file)) {
+		unsigned int size;
+		double value;
+
+		lineno++;
+		if (sscanf(line, "latency_us %lf", &value) == 1) {
+			profile->latency_us = value;
+		} else if (sscanf(line, "read_rate %lf", &value) == 1) {
+			profile->read_rate = value;
+		} else if (sscanf(line, "program_page_us %lf", &value) == 1) {
+			profile->program_page_us = value;
+		} else if (sscanf(line, "erase %u %lf", &size, &value) == 2) {
+			if (profile->erase_count == NUM_ERASEFUNCTIONS) {
+				msg_gerr("Error: Too many erase lines in \"%s\".\n", filename);
+				ret = 1;
+				break;
+			}
+			profile->erase[profile->erase_count].size = size;
+			profile->erase[profile->erase_count].us = value;
+			profile->erase_count++;
+		} else if (strncmp(line, "programmer ", 11) && strncmp(line, "chip ", 5) &&
+			   strncmp(line, "read ", 5) && line[0] != '#') {
+			msg_gerr("Error: Invalid line %u in \"%s\".\n", lineno, filename);
+			ret = 1;
+			break;
+		}
+	}
+	fclose(file);
+	return ret;
+#endif
+}
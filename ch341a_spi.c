@@ -22,6 +22,9 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
 #include <libusb.h>
 #include "flash.h"
 #include "programmer.h"
@@ -348,11 +351,15 @@ void ch341a_spi_delay(unsigned int usecs)
 	stored_delay_us += usecs;
 }
 
-static int ch341a_spi_spi_send_command(struct flashctx *flash, unsigned int writecnt, unsigned int readcnt, const unsigned char *writearr, unsigned char *readarr)
+static int ch341a_spi_spi_send_command_sg(struct flashctx *flash, const struct spi_command *cmd)
 {
 	if (handle == NULL)
 		return -1;
 
+	const unsigned int writecnt = spi_command_writecnt(cmd);
+	const unsigned int readcnt = cmd->readcnt;
+	unsigned char *readarr = cmd->readarr;
+
 	/* How many packets ... */
 	const size_t packets = (writecnt + readcnt + CH341_PACKET_LENGTH - 2) / (CH341_PACKET_LENGTH - 1);
 
@@ -366,6 +373,13 @@ static int ch341a_spi_spi_send_command(struct flashctx *flash, unsigned int writ
 	/* CS usage is optimized by doing both transitions in one packet.
 	 * Final transition to deselected state is in the pin disable. */
 	pluck_cs(ptr);
+
+	/* The write data is taken from writearr first and then from the write segments (if any), so that
+	 * payloads are swapped straight into the USB packets without an intermediate copy. */
+	const unsigned char *src = cmd->writearr;
+	unsigned int src_left = cmd->writecnt;
+	unsigned int seg = 0;
+
 	unsigned int write_left = writecnt;
 	unsigned int read_left = readcnt;
 	unsigned int p;
@@ -375,8 +389,15 @@ static int ch341a_spi_spi_send_command(struct flashctx *flash, unsigned int writ
 		ptr = wbuf[p+1];
 		*ptr++ = CH341A_CMD_SPI_STREAM;
 		unsigned int i;
-		for (i = 0; i < write_now; ++i)
-			*ptr++ = swap_byte(*writearr++);
+		for (i = 0; i < write_now; ++i) {
+			while (!src_left) {
+				src = cmd->writesegs[seg].buf;
+				src_left = cmd->writesegs[seg].len;
+				seg++;
+			}
+			*ptr++ = swap_byte(*src++);
+			src_left--;
+		}
 		if (read_now) {
 			memset(ptr, 0xFF, read_now);
 			read_left -= read_now;
@@ -397,6 +418,25 @@ static int ch341a_spi_spi_send_command(struct flashctx *flash, unsigned int writ
 	return 0;
 }
 
+static int ch341a_spi_spi_send_command(struct flashctx *flash, unsigned int writecnt, unsigned int readcnt, const unsigned char *writearr, unsigned char *readarr)
+{
+	const struct spi_command cmd = {
+		.writecnt	= writecnt,
+		.readcnt	= readcnt,
+		.writearr	= writearr,
+		.readarr	= readarr,
+	};
+
+	return ch341a_spi_spi_send_command_sg(flash, &cmd);
+}
+
+/* Each transaction costs at least one USB round trip (~1 ms). Reading the status register continuously for
+ * 128 B (4 packets) covers a typical page program at the CH341A's SPI clock. */
+static int ch341a_spi_poll_status(struct flashctx *flash, uint8_t mask, uint8_t value, unsigned int delay)
+{
+	return spi_poll_status_streamed(flash, mask, value, delay, 128);
+}
+
 static const struct spi_master spi_master_ch341a_spi = {
 	.type		= SPI_CONTROLLER_CH341A_SPI,
 	/* flashrom's current maximum is 256 B. CH341A was tested on Linux and Windows to accept atleast
@@ -406,6 +446,8 @@ static const struct spi_master spi_master_ch341a_spi = {
 	.max_data_write	= 4 * 1024,
 	.command	= ch341a_spi_spi_send_command,
 	.multicommand	= default_spi_send_multicommand,
+	.command_sg	= ch341a_spi_spi_send_command_sg,
+	.poll_status	= ch341a_spi_poll_status,
 	.read		= default_spi_read,
 	.write_256	= default_spi_write_256,
 	.write_aai	= default_spi_write_aai,
@@ -431,8 +473,57 @@ static int ch341a_spi_shutdown(void *data)
 	return 0;
 }
 
+/* Opens the num-th (starting at 0) device with the given IDs. */
+static struct libusb_device_handle *ch341a_open_device(uint16_t vid, uint16_t pid, unsigned int num)
+{
+	struct libusb_device **list;
+	ssize_t count = libusb_get_device_list(NULL, &list);
+	if (count < 0) {
+		msg_perr("Getting the USB device list failed (%s)!\n", libusb_error_name(count));
+		return NULL;
+	}
+
+	struct libusb_device_handle *dev_handle = NULL;
+	ssize_t i;
+	for (i = 0; i < count; i++) {
+		struct libusb_device_descriptor desc;
+		if (libusb_get_device_descriptor(list[i], &desc) != 0)
+			continue;
+		if ((desc.idVendor != vid) || (desc.idProduct != pid))
+			continue;
+		if (num-- > 0)
+			continue;
+		msg_pdbg("Using USB device %04x:%04x at address %d-%d.\n", vid, pid,
+			 libusb_get_bus_number(list[i]), libusb_get_device_address(list[i]));
+		int err = libusb_open(list[i], &dev_handle);
+		if (err != 0) {
+			msg_perr("Opening the USB device failed (%s)!\n", libusb_error_name(err));
+			dev_handle = NULL;
+		}
+		break;
+	}
+	libusb_free_device_list(list, 1);
+	return dev_handle;
+}
+
 int ch341a_spi_init(void)
 {
+	long usedevice = 0;
+	char *device = extract_programmer_param("device");
+	if (device) {
+		char *dev_suffix;
+		errno = 0;
+		usedevice = strtol(device, &dev_suffix, 10);
+		if (errno != 0 || device == dev_suffix || strlen(dev_suffix) > 0 ||
+		    usedevice < 0 || usedevice > UINT_MAX) {
+			msg_perr("Error: Invalid value for 'device': \"%s\".\n", device);
+			free(device);
+			return -1;
+		}
+		msg_pinfo("Using device %li.\n", usedevice);
+	}
+	free(device);
+
 	if (handle != NULL) {
 		msg_cerr("%s: handle already set! Please report a bug at flashrom@flashrom.org\n", __func__);
 		return -1;
@@ -448,7 +539,7 @@ int ch341a_spi_init(void)
 
 	uint16_t vid = devs_ch341a_spi[0].vendor_id;
 	uint16_t pid = devs_ch341a_spi[0].device_id;
-	handle = libusb_open_device_with_vid_pid(NULL, vid, pid);
+	handle = ch341a_open_device(vid, pid, (unsigned int)usedevice);
 	if (handle == NULL) {
 		msg_perr("Couldn't open device %04x:%04x.\n", vid, pid);
 		return -1;
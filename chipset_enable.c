@@ -548,6 +548,8 @@ idsel_garbage_out:
 	}
 	max_rom_decode.fwh = min(max_decode_fwh_idsel, max_decode_fwh_decode);
 	msg_pdbg("Maximum FWH chip size: 0x%x bytes\n", max_rom_decode.fwh);
+	/* The decode enables apply to a SPI chip as well. */
+	ichspi_bios_decode = max_decode_fwh_decode;
 
 	return 0;
 }
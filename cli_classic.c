@@ -26,10 +26,46 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <getopt.h>
 #include "flash.h"
 #include "flashchips.h"
 #include "programmer.h"
+#if !IS_WINDOWS
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+/* Long options without a short equivalent. */
+enum {
+	OPTION_GANG = 0x0100,
+	OPTION_DAEMON,
+	OPTION_REVALIDATE,
+	OPTION_REFERENCE,
+	OPTION_MANIFEST,
+	OPTION_SHA256,
+	OPTION_CHECK_MANIFEST,
+	OPTION_SPARSE,
+	OPTION_REGIONS_ONLY,
+	OPTION_JOURNAL,
+	OPTION_PLAN,
+	OPTION_RUN_PLAN,
+	OPTION_BENCHMARK,
+	OPTION_SCRATCH,
+	OPTION_PROFILE,
+	OPTION_TUNE_SPI,
+	OPTION_LOOP,
+	OPTION_DELTA,
+	OPTION_MAKE_DELTA,
+	OPTION_NEW_IMAGE,
+	OPTION_FMAP,
+	OPTION_FMAP_FILE,
+	OPTION_IFD,
+	OPTION_IFD_FILE,
+};
+
+/* Maximum number of programmers that can be driven in one gang. */
+#define GANG_MAX 32
 
 static void cli_classic_usage(const char *name)
 {
@@ -41,8 +77,16 @@ static void cli_classic_usage(const char *name)
 	       "-z|"
 #endif
 	       "-p <programmername>[:<parameters>] [-c <chipname>]\n"
-	       "[-E|(-r|-w|-v) <file>] [-l <layoutfile> [-i <imagename>]...] [-n] [-f]]\n"
-	       "[-V[V[V]]] [-o <logfile>]\n\n", name);
+	       "[-E|(-r|-w|-v) <file>]\n"
+	       "[(-l <layoutfile>|--fmap|--fmap-file <file>|--ifd|--ifd-file <file>)\n"
+	       "[-i <imagename>]... [--regions-only]]\n"
+	       "[-n] [-f]]\n"
+	       "[-V[V[V]]] [-o <logfile>] [--gang]\n"
+	       "[--sparse] [--manifest <file> [--sha256]] [--check-manifest <file>] [--reference <file>]\n"
+	       "[--journal <file>] [--plan <file>|--run-plan <file>] [--profile <file>]\n"
+	       "[--benchmark [--scratch <address>]] [--tune-spi]\n"
+	       "[--daemon <socket> [--revalidate <seconds>]] [--loop] [--delta <file>]\n"
+	       "[--make-delta <file> --reference <file> --new-image <file>]\n\n", name);
 
 	printf(" -h | --help                        print this help text\n"
 	       " -R | --version                     print version (release)\n"
@@ -55,8 +99,46 @@ static void cli_classic_usage(const char *name)
 	       " -f | --force                       force specific operations (see man page)\n"
 	       " -n | --noverify                    don't auto-verify\n"
 	       " -l | --layout <layoutfile>         read ROM layout from <layoutfile>\n"
-	       " -i | --image <name>                only flash image <name> from flash layout\n"
+	       "      --fmap                        read ROM layout from the FMAP on the chip\n"
+	       "      --fmap-file <file>            read ROM layout from the FMAP in <file>\n"
+	       "      --ifd                         read ROM layout from the Intel flash\n"
+	       "                                    descriptor on the chip\n"
+	       "      --ifd-file <file>             read ROM layout from the Intel flash\n"
+	       "                                    descriptor in <file>\n"
+	       " -i | --image <name>                only read/write/verify image <name> from flash\n"
+	       "                                    layout\n"
+	       "      --regions-only                image files contain only the regions given\n"
+	       "                                    with -i\n"
 	       " -o | --output <logfile>            log output to <logfile>\n"
+	       "      --gang                        run the operation on all programmers given with\n"
+	       "                                    multiple -p options in parallel\n"
+	       "      --sparse                      leave erased blocks of image files as holes\n"
+	       "      --manifest <file>             also save a manifest of block hashes to <file>\n"
+	       "                                    when reading\n"
+	       "      --sha256                      add SHA-256 hashes to the manifest\n"
+	       "      --check-manifest <file>       check flash against the manifest <file>\n"
+	       "      --reference <file>            assume the chip contains <file> instead of\n"
+	       "                                    reading it before a write (see man page)\n"
+	       "      --journal <file>              record the progress of a write in <file> and\n"
+	       "                                    resume an interrupted one from it\n"
+	       "      --plan <file>                 save the erase/write plan and an estimate of\n"
+	       "                                    the duration instead of writing\n"
+	       "      --run-plan <file>             write by executing a plan saved with --plan\n"
+	       "      --benchmark                   measure the performance of the programmer\n"
+	       "      --scratch <address>           also measure erase and program times in the\n"
+	       "                                    erase block at <address>, then restore it\n"
+	       "      --profile <file>              save the --benchmark results to <file>, or\n"
+	       "                                    base the --plan estimate on them\n"
+	       "      --tune-spi                    use the fastest SPI clock which reads reliably\n"
+	       "      --daemon <socket>             keep the programmer open and serve requests\n"
+	       "                                    on the UNIX socket <socket> (see man page)\n"
+	       "      --revalidate <seconds>        compare a sample of the chip against the\n"
+	       "                                    daemon's shadow image every <seconds>\n"
+	       "      --loop                        write every chip inserted into the socket\n"
+	       "                                    until interrupted (see man page)\n"
+	       "      --delta <file>                update the chip with the delta image <file>\n"
+	       "      --make-delta <file>           save the blocks in which --new-image differs\n"
+	       "                                    from --reference as delta image <file>\n"
 	       " -L | --list-supported              print supported devices\n"
 #if CONFIG_PRINT_WIKI == 1
 	       " -z | --list-supported-wiki         print supported devices in wiki syntax\n"
@@ -77,6 +159,104 @@ static void cli_classic_abort_usage(void)
 	exit(1);
 }
 
+/* Parses a -p argument of the form <name>[:<parameters>]. Returns 0 on success. */
+static int parse_programmer_arg(const char *arg, enum programmer *prog, char **pparam)
+{
+	const char *name;
+	int namelen;
+
+	*pparam = NULL;
+	for (*prog = 0; *prog < PROGRAMMER_INVALID; (*prog)++) {
+		name = programmer_table[*prog].name;
+		namelen = strlen(name);
+		if (strncmp(arg, name, namelen) == 0) {
+			switch (arg[namelen]) {
+			case ':':
+				*pparam = strdup(arg + namelen + 1);
+				if (!strlen(*pparam)) {
+					free(*pparam);
+					*pparam = NULL;
+				}
+				break;
+			case '\0':
+				break;
+			default:
+				/* The continue refers to the
+				 * for loop. It is here to be
+				 * able to differentiate between
+				 * foo and foobar.
+				 */
+				continue;
+			}
+			break;
+		}
+	}
+	if (*prog == PROGRAMMER_INVALID) {
+		fprintf(stderr, "Error: Unknown programmer \"%s\". Valid choices are:\n", arg);
+		list_programmers_linebreak(0, 80, 0);
+		msg_ginfo(".\n");
+		return 1;
+	}
+	return 0;
+}
+
+#if !IS_WINDOWS
+/* Gang mode: programmer state is global, hence every gang member runs in a child process of its own. The
+ * children write from the image buffer preloaded by the parent, which fork() shares copy-on-write, and report
+ * their result via their exit status. */
+static pid_t gang_pids[GANG_MAX];
+
+/* Returns the index of the gang member in the child processes and -1 in the parent. */
+static int gang_fork(int count)
+{
+	int i;
+
+	/* Do not let the children inherit pending output. */
+	fflush(NULL);
+	for (i = 0; i < count; i++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			msg_gerr("Error: Starting gang member #%i failed: %s\n", i, strerror(errno));
+			break;
+		}
+		if (pid == 0)
+			return i;
+		gang_pids[i] = pid;
+	}
+	for (; i < count; i++)
+		gang_pids[i] = -1;
+	return -1;
+}
+
+/* Waits for all gang members and prints their results. Returns 0 if all of them succeeded. */
+static int gang_wait(int count, const enum programmer *progs, char *const *pparams)
+{
+	int ok[GANG_MAX];
+	int i, status, failed = 0;
+
+	for (i = 0; i < count; i++) {
+		pid_t pid = -1;
+		ok[i] = 0;
+		if (gang_pids[i] > 0) {
+			do {
+				pid = waitpid(gang_pids[i], &status, 0);
+			} while (pid < 0 && errno == EINTR);
+		}
+		if (pid == gang_pids[i] && pid > 0)
+			ok[i] = WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+		if (!ok[i])
+			failed++;
+	}
+
+	msg_ginfo("Gang results:\n");
+	for (i = 0; i < count; i++)
+		msg_ginfo("  #%i %s%s%s: %s\n", i, programmer_table[progs[i]].name, pparams[i] ? ":" : "",
+			  pparams[i] ? pparams[i] : "", ok[i] ? "OK" : "FAILED");
+	msg_ginfo("%i of %i gang members succeeded.\n", count - failed, count);
+	return failed ? 1 : 0;
+}
+#endif
+
 static int check_filename(char *filename, char *type)
 {
 	if (!filename || (filename[0] == '\0')) {
@@ -92,11 +272,11 @@ static int check_filename(char *filename, char *type)
 int main(int argc, char *argv[])
 {
 	const struct flashchip *chip = NULL;
+	struct flashrom_context *ctx;
 	/* Probe for up to eight flash chips. */
 	struct flashctx flashes[8] = {{0}};
 	struct flashctx *fill_flash;
-	const char *name;
-	int namelen, opt, i, j;
+	int opt, i, j;
 	int startchip = -1, chipcount = 0, option_index = 0, force = 0;
 #if CONFIG_PRINT_WIKI == 1
 	int list_supported_wiki = 0;
@@ -104,6 +284,11 @@ int main(int argc, char *argv[])
 	int read_it = 0, write_it = 0, erase_it = 0, verify_it = 0;
 	int dont_verify_it = 0, list_supported = 0, operation_specified = 0;
 	enum programmer prog = PROGRAMMER_INVALID;
+	enum programmer progs[GANG_MAX];
+	char *pparams[GANG_MAX] = { NULL };
+	int prog_count = 0, gang = 0;
+	char *daemon_socket = NULL;
+	int revalidate = 0;
 	int ret = 0;
 
 	static const char optstring[] = "r:Rw:v:nVEfc:l:i:p:Lzho:";
@@ -124,16 +309,62 @@ int main(int argc, char *argv[])
 		{"help",		0, NULL, 'h'},
 		{"version",		0, NULL, 'R'},
 		{"output",		1, NULL, 'o'},
+		{"gang",		0, NULL, OPTION_GANG},
+		{"daemon",		1, NULL, OPTION_DAEMON},
+		{"revalidate",		1, NULL, OPTION_REVALIDATE},
+		{"reference",		1, NULL, OPTION_REFERENCE},
+		{"sparse",		0, NULL, OPTION_SPARSE},
+		{"regions-only",	0, NULL, OPTION_REGIONS_ONLY},
+		{"manifest",		1, NULL, OPTION_MANIFEST},
+		{"sha256",		0, NULL, OPTION_SHA256},
+		{"check-manifest",	1, NULL, OPTION_CHECK_MANIFEST},
+		{"journal",		1, NULL, OPTION_JOURNAL},
+		{"plan",		1, NULL, OPTION_PLAN},
+		{"run-plan",		1, NULL, OPTION_RUN_PLAN},
+		{"benchmark",		0, NULL, OPTION_BENCHMARK},
+		{"scratch",		1, NULL, OPTION_SCRATCH},
+		{"profile",		1, NULL, OPTION_PROFILE},
+		{"tune-spi",		0, NULL, OPTION_TUNE_SPI},
+		{"loop",		0, NULL, OPTION_LOOP},
+		{"delta",		1, NULL, OPTION_DELTA},
+		{"make-delta",		1, NULL, OPTION_MAKE_DELTA},
+		{"new-image",		1, NULL, OPTION_NEW_IMAGE},
+		{"fmap",		0, NULL, OPTION_FMAP},
+		{"fmap-file",		1, NULL, OPTION_FMAP_FILE},
+		{"ifd",			0, NULL, OPTION_IFD},
+		{"ifd-file",		1, NULL, OPTION_IFD_FILE},
 		{NULL,			0, NULL, 0},
 	};
 
 	char *filename = NULL;
+	char *referencefile = NULL;
+	char *journalfile = NULL;
+	char *planfile = NULL;
+	int run_plan_it = 0;
+	char *profilefile = NULL;
+	int benchmark_it = 0;
+	long scratch = -1;
+	int tune_spi = 0;
+	int loop_it = 0;
+	char *deltafile = NULL;
+	char *newimagefile = NULL;
+	int make_delta_it = 0;
+	char *fmapfile = NULL;
+	int fmap_it = 0;
+	char *ifdfile = NULL;
+	int ifd_it = 0;
+	bool layout_given = false;
+	char *manifestfile = NULL;
+	int check_manifest_it = 0, manifest_sha256 = 0;
 	char *layoutfile = NULL;
 #ifndef STANDALONE
 	char *logfile = NULL;
 #endif /* !STANDALONE */
 	char *tempstr = NULL;
 	char *pparam = NULL;
+#if !IS_WINDOWS
+	char gang_prefix[16];
+#endif
 
 	print_version();
 	print_banner();
@@ -141,6 +372,12 @@ int main(int argc, char *argv[])
 	if (selfcheck())
 		exit(1);
 
+	ctx = flashrom_context_new();
+	if (!ctx) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(1);
+	}
+
 	setbuf(stdout, NULL);
 	/* FIXME: Delay all operation_specified checks until after command
 	 * line parsing to allow --help overriding everything else.
@@ -212,11 +449,34 @@ int main(int argc, char *argv[])
 					"more than once. Aborting.\n");
 				cli_classic_abort_usage();
 			}
+			if (layout_given) {
+				fprintf(stderr, "Error: Only one layout source (--layout, --fmap, --ifd) can be used.\n");
+				cli_classic_abort_usage();
+			}
 			layoutfile = strdup(optarg);
+			layout_given = true;
+			break;
+		case OPTION_FMAP:
+		case OPTION_FMAP_FILE:
+		case OPTION_IFD:
+		case OPTION_IFD_FILE:
+			if (layout_given) {
+				fprintf(stderr, "Error: Only one layout source (--layout, --fmap, --ifd) can be used.\n");
+				cli_classic_abort_usage();
+			}
+			if (opt == OPTION_FMAP_FILE)
+				fmapfile = strdup(optarg);
+			else if (opt == OPTION_IFD_FILE)
+				ifdfile = strdup(optarg);
+			else if (opt == OPTION_IFD)
+				ifd_it = 1;
+			else
+				fmap_it = 1;
+			layout_given = true;
 			break;
 		case 'i':
 			tempstr = strdup(optarg);
-			if (register_include_arg(tempstr)) {
+			if (register_include_arg(ctx->layout, tempstr)) {
 				free(tempstr);
 				cli_classic_abort_usage();
 			}
@@ -244,47 +504,119 @@ int main(int argc, char *argv[])
 #endif
 			break;
 		case 'p':
-			if (prog != PROGRAMMER_INVALID) {
-				fprintf(stderr, "Error: --programmer specified "
-					"more than once. You can separate "
-					"multiple\nparameters for a programmer "
-					"with \",\". Please see the man page "
-					"for details.\n");
+			if (prog_count >= GANG_MAX) {
+				fprintf(stderr, "Error: --programmer specified more than %i times. Aborting.\n",
+					GANG_MAX);
 				cli_classic_abort_usage();
 			}
-			for (prog = 0; prog < PROGRAMMER_INVALID; prog++) {
-				name = programmer_table[prog].name;
-				namelen = strlen(name);
-				if (strncmp(optarg, name, namelen) == 0) {
-					switch (optarg[namelen]) {
-					case ':':
-						pparam = strdup(optarg + namelen + 1);
-						if (!strlen(pparam)) {
-							free(pparam);
-							pparam = NULL;
-						}
-						break;
-					case '\0':
-						break;
-					default:
-						/* The continue refers to the
-						 * for loop. It is here to be
-						 * able to differentiate between
-						 * foo and foobar.
-						 */
-						continue;
-					}
-					break;
-				}
+			if (parse_programmer_arg(optarg, &progs[prog_count], &pparams[prog_count]))
+				cli_classic_abort_usage();
+			prog_count++;
+			break;
+		case OPTION_GANG:
+#if IS_WINDOWS
+			fprintf(stderr, "Error: Gang mode is not supported on Windows. Aborting.\n");
+			cli_classic_abort_usage();
+#endif
+			gang = 1;
+			break;
+		case OPTION_DAEMON:
+#if IS_WINDOWS
+			fprintf(stderr, "Error: Daemon mode is not supported on Windows. Aborting.\n");
+			cli_classic_abort_usage();
+#endif
+			if (++operation_specified > 1) {
+				fprintf(stderr, "More than one operation "
+					"specified. Aborting.\n");
+				cli_classic_abort_usage();
 			}
-			if (prog == PROGRAMMER_INVALID) {
-				fprintf(stderr, "Error: Unknown programmer \"%s\". Valid choices are:\n",
-					optarg);
-				list_programmers_linebreak(0, 80, 0);
-				msg_ginfo(".\n");
+			daemon_socket = strdup(optarg);
+			break;
+		case OPTION_REGIONS_ONLY:
+			ctx->regions_only = true;
+			break;
+		case OPTION_SPARSE:
+			if (set_sparse_images(true))
+				cli_classic_abort_usage();
+			break;
+		case OPTION_MANIFEST:
+			manifestfile = strdup(optarg);
+			break;
+		case OPTION_SHA256:
+			manifest_sha256 = 1;
+			break;
+		case OPTION_CHECK_MANIFEST:
+			if (++operation_specified > 1) {
+				fprintf(stderr, "More than one operation "
+					"specified. Aborting.\n");
+				cli_classic_abort_usage();
+			}
+			check_manifest_it = 1;
+			manifestfile = strdup(optarg);
+			break;
+		case OPTION_REFERENCE:
+			referencefile = strdup(optarg);
+			break;
+		case OPTION_JOURNAL:
+			journalfile = strdup(optarg);
+			break;
+		case OPTION_PLAN:
+		case OPTION_RUN_PLAN:
+			if (planfile) {
+				fprintf(stderr, "Error: --plan or --run-plan specified more than once. Aborting.\n");
 				cli_classic_abort_usage();
 			}
+			planfile = strdup(optarg);
+			run_plan_it = opt == OPTION_RUN_PLAN;
 			break;
+		case OPTION_BENCHMARK:
+			if (++operation_specified > 1) {
+				fprintf(stderr, "More than one operation "
+					"specified. Aborting.\n");
+				cli_classic_abort_usage();
+			}
+			benchmark_it = 1;
+			break;
+		case OPTION_SCRATCH: {
+			char *endptr;
+			scratch = strtol(optarg, &endptr, 0);
+			if (*optarg == '\0' || *endptr != '\0' || scratch < 0) {
+				fprintf(stderr, "Error: Invalid scratch address \"%s\".\n", optarg);
+				cli_classic_abort_usage();
+			}
+			break;
+		}
+		case OPTION_PROFILE:
+			profilefile = strdup(optarg);
+			break;
+		case OPTION_TUNE_SPI:
+			tune_spi = 1;
+			break;
+		case OPTION_LOOP:
+			loop_it = 1;
+			break;
+		case OPTION_DELTA:
+		case OPTION_MAKE_DELTA:
+			if (++operation_specified > 1) {
+				fprintf(stderr, "More than one operation "
+					"specified. Aborting.\n");
+				cli_classic_abort_usage();
+			}
+			deltafile = strdup(optarg);
+			make_delta_it = opt == OPTION_MAKE_DELTA;
+			break;
+		case OPTION_NEW_IMAGE:
+			newimagefile = strdup(optarg);
+			break;
+		case OPTION_REVALIDATE: {
+			char *endptr;
+			revalidate = strtol(optarg, &endptr, 0);
+			if (*optarg == '\0' || *endptr != '\0' || revalidate < 0) {
+				fprintf(stderr, "Error: Invalid re-validation interval \"%s\".\n", optarg);
+				cli_classic_abort_usage();
+			}
+			break;
+		}
 		case 'R':
 			/* print_version() is always called during startup. */
 			if (++operation_specified > 1) {
@@ -326,12 +658,131 @@ int main(int argc, char *argv[])
 		cli_classic_abort_usage();
 	}
 
+	if (prog_count > 1 && !gang) {
+		fprintf(stderr, "Error: --programmer specified "
+			"more than once. You can separate "
+			"multiple\nparameters for a programmer "
+			"with \",\". Please see the man page "
+			"for details.\n");
+		cli_classic_abort_usage();
+	}
+	if (manifestfile && !read_it && !check_manifest_it) {
+		fprintf(stderr, "Error: --manifest is only supported for read operations.\n");
+		cli_classic_abort_usage();
+	}
+	if (manifest_sha256 && (!manifestfile || check_manifest_it)) {
+		fprintf(stderr, "Error: --sha256 needs --manifest.\n");
+		cli_classic_abort_usage();
+	}
+	if (referencefile && !write_it && !make_delta_it) {
+		fprintf(stderr, "Error: --reference is only supported for write operations.\n");
+		cli_classic_abort_usage();
+	}
+	if (journalfile && !write_it) {
+		fprintf(stderr, "Error: --journal is only supported for write operations.\n");
+		cli_classic_abort_usage();
+	}
+	if (planfile && !write_it) {
+		fprintf(stderr, "Error: --plan and --run-plan are only supported for write operations.\n");
+		cli_classic_abort_usage();
+	}
+	if (planfile && (journalfile || gang)) {
+		fprintf(stderr, "Error: --plan and --run-plan can not be combined with --journal or --gang.\n");
+		cli_classic_abort_usage();
+	}
+	if (run_plan_it && referencefile) {
+		fprintf(stderr, "Error: --run-plan does not look at the chip contents, --reference is useless.\n");
+		cli_classic_abort_usage();
+	}
+	if (scratch >= 0 && !benchmark_it) {
+		fprintf(stderr, "Error: --scratch is only supported with --benchmark.\n");
+		cli_classic_abort_usage();
+	}
+	if (profilefile && !benchmark_it && (!planfile || run_plan_it)) {
+		fprintf(stderr, "Error: --profile is only supported with --benchmark or --plan.\n");
+		cli_classic_abort_usage();
+	}
+	if (benchmark_it && (gang || layout_given)) {
+		fprintf(stderr, "Error: --benchmark can not be combined with --gang or a layout.\n");
+		cli_classic_abort_usage();
+	}
+	if (make_delta_it && (!referencefile || !newimagefile)) {
+		fprintf(stderr, "Error: --make-delta needs the base image given with --reference and the new image "
+			"given with --new-image.\n");
+		cli_classic_abort_usage();
+	}
+	if (newimagefile && !make_delta_it) {
+		fprintf(stderr, "Error: --new-image is only supported with --make-delta.\n");
+		cli_classic_abort_usage();
+	}
+	if (deltafile && !make_delta_it && (layout_given || gang)) {
+		fprintf(stderr, "Error: --delta can not be combined with --gang or a layout.\n");
+		cli_classic_abort_usage();
+	}
+	if (loop_it && !write_it) {
+		fprintf(stderr, "Error: --loop is only supported for write operations.\n");
+		cli_classic_abort_usage();
+	}
+	if (loop_it && (gang || journalfile || planfile || referencefile)) {
+		fprintf(stderr, "Error: --loop can not be combined with --gang, --journal, --plan, --run-plan or "
+			"--reference.\n");
+		cli_classic_abort_usage();
+	}
+	if (tune_spi && gang) {
+		fprintf(stderr, "Error: --tune-spi and --gang can not be combined.\n");
+		cli_classic_abort_usage();
+	}
+	if (journalfile && gang) {
+		fprintf(stderr, "Error: --journal and --gang can not be combined.\n");
+		cli_classic_abort_usage();
+	}
+	if (revalidate && !daemon_socket) {
+		fprintf(stderr, "Error: --revalidate is only supported in daemon mode.\n");
+		cli_classic_abort_usage();
+	}
+	if (gang && daemon_socket) {
+		fprintf(stderr, "Error: --gang and --daemon can not be combined.\n");
+		cli_classic_abort_usage();
+	}
+	if (gang && prog_count < 2) {
+		fprintf(stderr, "Error: --gang needs at least two --programmer options.\n");
+		cli_classic_abort_usage();
+	}
+	if (prog_count) {
+		prog = progs[0];
+		pparam = pparams[0];
+	}
+
 	if ((read_it | write_it | verify_it) && check_filename(filename, "image")) {
 		cli_classic_abort_usage();
 	}
+	if (manifestfile && check_filename(manifestfile, "manifest")) {
+		cli_classic_abort_usage();
+	}
+	if (referencefile && check_filename(referencefile, "reference")) {
+		cli_classic_abort_usage();
+	}
+	if (journalfile && check_filename(journalfile, "journal")) {
+		cli_classic_abort_usage();
+	}
+	if (planfile && check_filename(planfile, "plan")) {
+		cli_classic_abort_usage();
+	}
+	if (profilefile && check_filename(profilefile, "profile")) {
+		cli_classic_abort_usage();
+	}
+	if (deltafile && check_filename(deltafile, "delta")) {
+		cli_classic_abort_usage();
+	}
 	if (layoutfile && check_filename(layoutfile, "layout")) {
 		cli_classic_abort_usage();
 	}
+	if (fmapfile && check_filename(fmapfile, "FMAP")) {
+		cli_classic_abort_usage();
+	}
+	if (ifdfile && check_filename(ifdfile, "flash descriptor")) {
+		cli_classic_abort_usage();
+	}
 
 #ifndef STANDALONE
 	if (logfile && check_filename(logfile, "log"))
@@ -353,6 +804,12 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	/* Creating a delta image does not involve any chip. */
+	if (make_delta_it) {
+		ret = make_delta(referencefile, newimagefile, deltafile);
+		goto out;
+	}
+
 #ifndef STANDALONE
 	start_logging();
 #endif /* !STANDALONE */
@@ -364,17 +821,46 @@ int main(int argc, char *argv[])
 	}
 	msg_gdbg("\n");
 
-	if (layoutfile && read_romlayout(layoutfile)) {
+	if (layoutfile && read_romlayout(ctx->layout, layoutfile)) {
+		ret = 1;
+		goto out;
+	}
+	if (fmapfile && fmap_read_from_file(ctx->layout, fmapfile)) {
 		ret = 1;
 		goto out;
 	}
-	if (layoutfile != NULL && !write_it) {
-		msg_gerr("Layout files are currently supported for write operations only.\n");
+	if (ifdfile && ifd_read_from_file(ctx->layout, ifdfile)) {
+		ret = 1;
+		goto out;
+	}
+	if (layout_given && erase_it) {
+		msg_gerr("Layouts are currently not supported for erase operations.\n");
 		ret = 1;
 		goto out;
 	}
 
-	if (process_include_args()) {
+	/* A layout on the chip can only be read once the chip is found, the regions are processed then. */
+	if (!fmap_it && !ifd_it && process_include_args(ctx->layout)) {
+		ret = 1;
+		goto out;
+	}
+	if (ctx->regions_only && !layout_has_included_regions(ctx->layout)) {
+		msg_gerr("--regions-only needs regions selected with -i.\n");
+		ret = 1;
+		goto out;
+	}
+	if (planfile && layout_given) {
+		msg_gerr("Plans describe the whole chip and can not be combined with a layout.\n");
+		ret = 1;
+		goto out;
+	}
+	if (journalfile && layout_given) {
+		msg_gerr("Journals describe the whole chip and can not be combined with a layout.\n");
+		ret = 1;
+		goto out;
+	}
+	if (manifestfile && !check_manifest_it && layout_has_included_regions(ctx->layout)) {
+		msg_gerr("Manifests describe the whole chip and can not be combined with -i.\n");
 		ret = 1;
 		goto out;
 	}
@@ -395,8 +881,8 @@ int main(int argc, char *argv[])
 	if (prog == PROGRAMMER_INVALID) {
 		if (CONFIG_DEFAULT_PROGRAMMER != PROGRAMMER_INVALID) {
 			prog = CONFIG_DEFAULT_PROGRAMMER;
-			/* We need to strdup here because we free(pparam) unconditionally later. */
-			pparam = strdup(CONFIG_DEFAULT_PROGRAMMER_ARGS);
+			/* We need to strdup here because we free(pparams) unconditionally later. */
+			pparam = pparams[0] = strdup(CONFIG_DEFAULT_PROGRAMMER_ARGS);
 			msg_pinfo("Using default programmer \"%s\" with arguments \"%s\".\n",
 				  programmer_table[CONFIG_DEFAULT_PROGRAMMER].name, pparam);
 		} else {
@@ -416,19 +902,71 @@ int main(int argc, char *argv[])
 	/* FIXME: Delay calibration should happen in programmer code. */
 	myusec_calibrate_delay();
 
-	if (programmer_init(prog, pparam)) {
+#if !IS_WINDOWS
+	if (gang) {
+		/* The image is read only once and shared by all gang members. */
+		if ((write_it || verify_it) && preload_image_file(filename)) {
+			ret = 1;
+			goto out;
+		}
+		i = gang_fork(prog_count);
+		if (i < 0) {
+			ret = gang_wait(prog_count, progs, pparams);
+			goto out;
+		}
+		prog = progs[i];
+		pparam = pparams[i];
+		snprintf(gang_prefix, sizeof(gang_prefix), "[#%i] ", i);
+		set_msg_prefix(gang_prefix);
+		if (read_it) {
+			/* Every gang member reads into a file of its own: <file>.<member>. */
+			tempstr = malloc(strlen(filename) + 12);
+			if (!tempstr) {
+				msg_gerr("Out of memory!\n");
+				exit(1);
+			}
+			sprintf(tempstr, "%s.%i", filename, i);
+			free(filename);
+			filename = tempstr;
+			if (manifestfile) {
+				tempstr = malloc(strlen(manifestfile) + 12);
+				if (!tempstr) {
+					msg_gerr("Out of memory!\n");
+					exit(1);
+				}
+				sprintf(tempstr, "%s.%i", manifestfile, i);
+				free(manifestfile);
+				manifestfile = tempstr;
+			}
+		}
+	}
+#endif
+
+	if (read_it && manifestfile) {
+		ctx->manifest = manifestfile;
+		ctx->manifest_sha256 = manifest_sha256;
+	}
+	ctx->journal = journalfile;
+	if (run_plan_it)
+		ctx->run_plan = planfile;
+	else
+		ctx->plan = planfile;
+	if (!benchmark_it)
+		ctx->profile = profilefile;
+
+	if (programmer_init(ctx, prog, pparam)) {
 		msg_perr("Error: Programmer initialization failed.\n");
 		ret = 1;
 		goto out_shutdown;
 	}
-	tempstr = flashbuses_to_text(get_buses_supported());
+	tempstr = flashbuses_to_text(get_buses_supported(ctx));
 	msg_pdbg("The following protocols are supported: %s.\n", tempstr);
 	free(tempstr);
 
-	for (j = 0; j < registered_master_count; j++) {
+	for (j = 0; j < ctx->registered_master_count; j++) {
 		startchip = 0;
 		while (chipcount < ARRAY_SIZE(flashes)) {
-			startchip = probe_flash(&registered_masters[j], startchip, &flashes[chipcount], 0);
+			startchip = probe_flash(ctx, &ctx->registered_masters[j], startchip, &flashes[chipcount], 0);
 			if (startchip == -1)
 				break;
 			chipcount++;
@@ -455,8 +993,8 @@ int main(int argc, char *argv[])
 			int compatible_masters = 0;
 			msg_cinfo("Force read (-f -r -c) requested, pretending the chip is there:\n");
 			/* This loop just counts compatible controllers. */
-			for (j = 0; j < registered_master_count; j++) {
-				mst = &registered_masters[j];
+			for (j = 0; j < ctx->registered_master_count; j++) {
+				mst = &ctx->registered_masters[j];
 				/* chip is still set from the chip_to_probe earlier in this function. */
 				if (mst->buses_supported & chip->bustype)
 					compatible_masters++;
@@ -469,9 +1007,9 @@ int main(int argc, char *argv[])
 			if (compatible_masters > 1)
 				msg_cinfo("More than one compatible controller found for the requested flash "
 					  "chip, using the first one.\n");
-			for (j = 0; j < registered_master_count; j++) {
-				mst = &registered_masters[j];
-				startchip = probe_flash(mst, 0, &flashes[0], 1);
+			for (j = 0; j < ctx->registered_master_count; j++) {
+				mst = &ctx->registered_masters[j];
+				startchip = probe_flash(ctx, mst, 0, &flashes[0], 1);
 				if (startchip != -1)
 					break;
 			}
@@ -522,7 +1060,8 @@ int main(int argc, char *argv[])
 		goto out_shutdown;
 	}
 
-	if (!(read_it | write_it | verify_it | erase_it)) {
+	if (!(read_it | write_it | verify_it | erase_it | check_manifest_it | benchmark_it) && !daemon_socket &&
+	    !deltafile) {
 		msg_ginfo("No operations were specified.\n");
 		goto out_shutdown;
 	}
@@ -542,19 +1081,56 @@ int main(int argc, char *argv[])
 	 * Give the chip time to settle.
 	 */
 	programmer_delay(100000);
-	ret |= doit(fill_flash, force, filename, read_it, write_it, erase_it, verify_it);
+	if (tune_spi && spi_autotune(fill_flash)) {
+		unmap_flash(fill_flash);
+		ret = 1;
+		goto out_shutdown;
+	}
+	if ((fmap_it && fmap_read_from_flash(ctx->layout, fill_flash)) ||
+	    (ifd_it && ifd_read_from_flash(ctx->layout, fill_flash)) ||
+	    ((fmap_it || ifd_it) && process_include_args(ctx->layout))) {
+		unmap_flash(fill_flash);
+		ret = 1;
+		goto out_shutdown;
+	}
+#if !IS_WINDOWS
+	if (daemon_socket)
+		ret |= serve_daemon(fill_flash, force, daemon_socket, revalidate, !dont_verify_it);
+	else
+#endif
+	if (check_manifest_it)
+		ret |= check_manifest(fill_flash, force, manifestfile);
+	else if (loop_it)
+		ret |= serve_loop(fill_flash, force, filename, verify_it);
+	else if (deltafile)
+		ret |= apply_delta(fill_flash, force, deltafile, !dont_verify_it);
+	else if (benchmark_it)
+		ret |= benchmark_flash(fill_flash, force, scratch, profilefile);
+	else
+		ret |= doit(fill_flash, force, filename, referencefile, read_it, write_it, erase_it, verify_it);
 
 	unmap_flash(fill_flash);
 out_shutdown:
-	programmer_shutdown();
+	programmer_shutdown(ctx);
 out:
 	for (i = 0; i < chipcount; i++)
 		free(flashes[i].chip);
 
-	layout_cleanup();
+	flashrom_context_free(ctx);
 	free(filename);
 	free(layoutfile);
-	free(pparam);
+	free(fmapfile);
+	free(ifdfile);
+	free(referencefile);
+	free(journalfile);
+	free(planfile);
+	free(profilefile);
+	free(deltafile);
+	free(newimagefile);
+	free(manifestfile);
+	free(daemon_socket);
+	for (i = 0; i < GANG_MAX; i++)
+		free(pparams[i]);
 	/* clean up global variables */
 	free((char *)chip_to_probe); /* Silence! Freeing is not modifying contents. */
 	chip_to_probe = NULL;
@@ -0,0 +1,362 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Daemon mode: the programmer is initialized and the chip probed once, then requests are accepted on a UNIX
+ * domain socket until a client asks the daemon to quit. Every request is a single line of text:
+ *
+ *   read <file>       read the chip and save it to <file>
+ *   write <file>      write <file> to the chip (taking -l/-i into account) and verify it unless -n was given
+ *   verify <file>     verify the chip against <file>
+ *   revalidate        compare a sample of the chip against the shadow image now
+ *   quit              shut the programmer down and exit
+ *
+ * Every request is answered with a line starting with "OK" or "ERROR". File names are interpreted by the
+ * daemon, hence they should be absolute.
+ *
+ * The daemon keeps a shadow image of the chip contents which is updated on every successful write. Writes
+ * compute their erase/write plan against the shadow image instead of reading the whole chip first. Since
+ * something else (e.g. the host firmware) may modify the chip behind our back, the shadow image can be
+ * re-validated periodically by reading a few randomly chosen blocks; the whole chip is read again if any of
+ * them differs.
+ */
+
+#include "platform.h"
+
+#if !IS_WINDOWS
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "flash.h"
+#include "programmer.h"
+
+/* Size and number of the blocks compared during a sampled re-validation of the shadow image. */
+#define DAEMON_SAMPLE_SIZE	4096
+#define DAEMON_SAMPLE_COUNT	8
+#define DAEMON_MAX_REQUEST	4096
+
+struct daemon_state {
+	struct flashctx *flash;
+	unsigned long size;
+	uint8_t *shadow;
+	bool shadow_valid;
+	int verify_it;
+	int revalidate;		/* Seconds between sampled re-validations, 0 disables them. */
+	time_t last_validated;
+};
+
+static volatile sig_atomic_t daemon_stop = 0;
+
+static void daemon_signal(int sig)
+{
+	daemon_stop = 1;
+}
+
+/* Reads the whole chip into the shadow image. */
+static int shadow_refresh(struct daemon_state *d)
+{
+	msg_cinfo("Reading flash chip contents... ");
+	d->shadow_valid = false;
+	if (d->flash->chip->read(d->flash, d->shadow, 0, d->size)) {
+		msg_cinfo("FAILED.\n");
+		return 1;
+	}
+	msg_cinfo("done.\n");
+	d->shadow_valid = true;
+	d->last_validated = time(NULL);
+	return 0;
+}
+
+/* Compares randomly chosen blocks of the chip against the shadow image. The whole chip is read again if any of
+ * them differs or cannot be read. */
+static int shadow_sample(struct daemon_state *d)
+{
+	if (!d->shadow_valid)
+		return shadow_refresh(d);
+
+	msg_cdbg("Re-validating shadow image... ");
+	if (sample_range(d->flash, d->shadow, DAEMON_SAMPLE_COUNT, DAEMON_SAMPLE_SIZE)) {
+		msg_cinfo("Flash contents differ from the shadow image.\n");
+		return shadow_refresh(d);
+	}
+	msg_cdbg("done.\n");
+	d->last_validated = time(NULL);
+	return 0;
+}
+
+/* Makes sure the shadow image can be trusted before it is used as the base of a write. */
+static int shadow_check(struct daemon_state *d)
+{
+	if (!d->shadow_valid)
+		return shadow_refresh(d);
+	if (d->revalidate && time(NULL) - d->last_validated >= d->revalidate)
+		return shadow_sample(d);
+	return 0;
+}
+
+static uint8_t *daemon_load_image(struct daemon_state *d, const char *filename)
+{
+	uint8_t *newcontents = malloc(d->size);
+	if (!newcontents) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	/* Assume best case: All bits should be 1. */
+	memset(newcontents, 0xff, d->size);
+	if (read_image_file(d->flash, newcontents, filename) ||
+	    check_board_image(d->flash, newcontents, d->size)) {
+		free(newcontents);
+		return NULL;
+	}
+	return newcontents;
+}
+
+static int daemon_read(struct daemon_state *d, const char *filename)
+{
+	if (shadow_refresh(d))
+		return 1;
+	return write_buf_to_file(d->shadow, d->size, filename);
+}
+
+static int daemon_write(struct daemon_state *d, const char *filename)
+{
+	uint8_t *newcontents;
+	int ret;
+
+	if (shadow_check(d))
+		return 1;
+	newcontents = daemon_load_image(d, filename);
+	if (!newcontents)
+		return 1;
+
+	/* update_flash() leaves oldcontents alone, hence the shadow image can serve as the old contents. */
+	ret = update_flash(d->flash, 1, d->shadow, newcontents, 1, d->verify_it);
+	if (ret)
+		d->shadow_valid = false;
+	else
+		memcpy(d->shadow, newcontents, d->size);
+	free(newcontents);
+	return ret;
+}
+
+static int daemon_verify(struct daemon_state *d, const char *filename)
+{
+	uint8_t *newcontents;
+	int ret;
+
+	newcontents = daemon_load_image(d, filename);
+	if (!newcontents)
+		return 1;
+	/* A verification has to look at the chip, which refreshes the shadow image as a side effect. */
+	ret = shadow_refresh(d) || update_flash(d->flash, 1, d->shadow, newcontents, 0, 1);
+	free(newcontents);
+	return ret;
+}
+
+/* Handles a single request. Returns 0 on success, 1 on failure and -1 if the daemon should exit. */
+static int daemon_request(struct daemon_state *d, char *line)
+{
+	char *cmd, *arg;
+
+	cmd = strtok(line, " \t\r");
+	arg = strtok(NULL, "\r");
+	if (!cmd)
+		return 1;
+	msg_ginfo("Request: %s%s%s\n", cmd, arg ? " " : "", arg ? arg : "");
+
+	if (!strcmp(cmd, "quit"))
+		return -1;
+	if (!strcmp(cmd, "revalidate"))
+		return shadow_sample(d);
+	if (!arg || !strlen(arg)) {
+		msg_gerr("Request \"%s\" needs a file name.\n", cmd);
+		return 1;
+	}
+	if (!strcmp(cmd, "read"))
+		return daemon_read(d, arg);
+	if (!strcmp(cmd, "write"))
+		return daemon_write(d, arg);
+	if (!strcmp(cmd, "verify"))
+		return daemon_verify(d, arg);
+	msg_gerr("Unknown request \"%s\".\n", cmd);
+	return 1;
+}
+
+/* Serves the requests of one client until it disconnects. Returns -1 if the daemon should exit. */
+static int daemon_client(struct daemon_state *d, int fd)
+{
+	char buf[DAEMON_MAX_REQUEST];
+	size_t fill = 0;
+	ssize_t n;
+	char *eol;
+	int ret;
+
+	while (!daemon_stop) {
+		eol = memchr(buf, '\n', fill);
+		if (!eol) {
+			if (fill == sizeof(buf)) {
+				msg_gerr("Request too long, dropping client.\n");
+				return 0;
+			}
+			n = read(fd, buf + fill, sizeof(buf) - fill);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return 0;
+			fill += n;
+			continue;
+		}
+		*eol = '\0';
+		ret = daemon_request(d, buf);
+		if (write(fd, ret > 0 ? "ERROR\n" : "OK\n", ret > 0 ? 6 : 3) < 0)
+			msg_gdbg("Could not answer client: %s\n", strerror(errno));
+		if (ret < 0)
+			return -1;
+		fill -= eol + 1 - buf;
+		memmove(buf, eol + 1, fill);
+	}
+	return 0;
+}
+
+static int daemon_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		msg_gerr("Socket path \"%s\" is too long.\n", path);
+		return -1;
+	}
+	/* Remove a stale socket of a previous instance, but nothing else. */
+	if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		msg_gerr("Could not create socket: %s\n", strerror(errno));
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 4)) {
+		msg_gerr("Could not listen on \"%s\": %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Runs the daemon on the socket at path until a client sends "quit" or a SIGINT/SIGTERM arrives. The chip has
+ * to be probed and mapped already. revalidate is the interval of the sampled re-validation in seconds, 0
+ * disables it.
+ */
+int serve_daemon(struct flashctx *flash, int force, const char *path, int revalidate, int verify_it)
+{
+	struct daemon_state d = {
+		.flash = flash,
+		.size = flash->chip->total_size * 1024,
+		.verify_it = verify_it,
+		.revalidate = revalidate,
+	};
+	struct sigaction sa;
+	struct pollfd pfd;
+	int fd, timeout, ret = 0;
+
+	if (chip_safety_check(flash, force, 1, 1, 0, 1)) {
+		msg_cerr("Aborting.\n");
+		return 1;
+	}
+	if (normalize_romentries(flash->ctx->layout, flash)) {
+		msg_cerr("Requested regions can not be handled. Aborting.\n");
+		return 1;
+	}
+	if (flash->chip->unlock)
+		flash->chip->unlock(flash);
+
+	d.shadow = malloc(d.size);
+	if (!d.shadow) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	if (shadow_refresh(&d)) {
+		free(d.shadow);
+		return 1;
+	}
+
+	fd = daemon_listen(path);
+	if (fd < 0) {
+		free(d.shadow);
+		return 1;
+	}
+
+	/* No SA_RESTART: a signal has to interrupt poll() so that the programmer is shut down properly. */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = daemon_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	msg_ginfo("Waiting for requests on %s.\n", path);
+	while (!daemon_stop) {
+		timeout = -1;
+		if (d.revalidate && d.shadow_valid)
+			timeout = max(0, d.last_validated + d.revalidate - time(NULL)) * 1000;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		ret = poll(&pfd, 1, timeout);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			msg_gerr("Waiting for requests failed: %s\n", strerror(errno));
+			ret = 1;
+			break;
+		}
+		ret = 0;
+		if (!(pfd.revents & POLLIN)) {
+			/* Idle for a whole re-validation interval. */
+			shadow_sample(&d);
+			continue;
+		}
+		int client = accept(fd, NULL, NULL);
+		if (client < 0)
+			continue;
+		if (daemon_client(&d, client) < 0)
+			daemon_stop = 1;
+		close(client);
+	}
+
+	msg_ginfo("Daemon exiting.\n");
+	close(fd);
+	unlink(path);
+	free(d.shadow);
+	return ret;
+}
+
+#endif /* !IS_WINDOWS */
@@ -0,0 +1,164 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Production loop: the programmer stays initialized and the image loaded while chips are swapped in a socket.
+ * The chip is probed a few times per second. Whenever a chip of the probed model shows up, it is written and
+ * verified, and the result and duration are logged. Then the loop waits for the chip to be removed. A chip has
+ * to answer (or stay silent) for several polls in a row before it counts as inserted (or removed), which
+ * rides out the bouncing contacts of a socket being closed or opened.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "flash.h"
+#include "programmer.h"
+
+/* Interval between two probes in microseconds. */
+#define LOOP_POLL_US		200000
+/* Number of consecutive polls with the same result needed to accept an insertion or removal. */
+#define LOOP_SETTLE_POLLS	3
+
+static volatile sig_atomic_t loop_stop = 0;
+
+static void loop_signal(int sig)
+{
+	loop_stop = 1;
+}
+
+static double loop_elapsed(const struct timeval *start)
+{
+	struct timeval end;
+
+	gettimeofday(&end, NULL);
+	return (end.tv_sec - start->tv_sec) + (end.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/* Probes until the presence of the chip matched present for LOOP_SETTLE_POLLS polls in a row. Returns 1 if the
+ * loop was stopped meanwhile.
+ */
+static int wait_for_chip(struct flashctx *flash, bool present)
+{
+	int settled = 0;
+
+	while (!loop_stop) {
+		if ((flash->chip->probe(flash) == 1) == present) {
+			if (++settled == LOOP_SETTLE_POLLS)
+				return 0;
+		} else {
+			settled = 0;
+		}
+		internal_sleep(LOOP_POLL_US);
+	}
+	return 1;
+}
+
+/* Writes and verifies one unit. image holds the image as loaded from the file, it is not modified. */
+static int flash_unit(struct flashctx *flash, const uint8_t *image, uint8_t *oldcontents, uint8_t *newcontents,
+		      int verify_it)
+{
+	unsigned long size = flash->chip->total_size * 1024;
+
+	if (flash->chip->unlock)
+		flash->chip->unlock(flash);
+	msg_cinfo("Reading old flash chip contents... ");
+	if (flash->chip->read(flash, oldcontents, 0, size)) {
+		msg_cinfo("FAILED.\n");
+		return 1;
+	}
+	msg_cinfo("done.\n");
+	/* update_flash() merges the regions outside the layout into newcontents. */
+	memcpy(newcontents, image, size);
+	return update_flash(flash, 1, oldcontents, newcontents, 1, verify_it);
+}
+
+/**
+ * @brief write filename to every chip inserted into the socket until SIGINT or SIGTERM arrives
+ *
+ * The chip present at the start is written first. The chip has to be probed and mapped already.
+ *
+ * @return	0 if the last unit passed
+ */
+int serve_loop(struct flashctx *flash, int force, const char *filename, int verify_it)
+{
+	unsigned long size = flash->chip->total_size * 1024;
+	unsigned int units = 0, failed = 0;
+	uint8_t *image, *oldcontents, *newcontents;
+	struct timeval start;
+	double elapsed, total = 0;
+	int ret = 1;
+
+	if (chip_safety_check(flash, force, 0, 1, 0, verify_it)) {
+		msg_cerr("Aborting.\n");
+		return 1;
+	}
+	if (normalize_romentries(flash->ctx->layout, flash)) {
+		msg_cerr("Requested regions can not be handled. Aborting.\n");
+		return 1;
+	}
+
+	image = malloc(size);
+	oldcontents = malloc(size);
+	newcontents = malloc(size);
+	if (!image || !oldcontents || !newcontents) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	/* The image is loaded and checked only once for all units. */
+	memset(image, 0xff, size);
+	if (read_image_file(flash, image, filename) || check_board_image(flash, image, size))
+		goto out;
+
+	signal(SIGINT, loop_signal);
+	signal(SIGTERM, loop_signal);
+
+	while (!loop_stop) {
+		units++;
+		msg_ginfo("Unit %u: writing %s.\n", units, filename);
+		gettimeofday(&start, NULL);
+		ret = flash_unit(flash, image, oldcontents, newcontents, verify_it);
+		elapsed = loop_elapsed(&start);
+		total += elapsed;
+		if (ret)
+			failed++;
+		msg_ginfo("Unit %u: %s in %.1f s (%u passed, %u failed).\n", units, ret ? "FAILED" : "PASSED",
+			  elapsed, units - failed, failed);
+
+		msg_ginfo("Waiting for the chip to be removed...\n");
+		if (wait_for_chip(flash, false))
+			break;
+		msg_ginfo("Waiting for the next chip...\n");
+		if (wait_for_chip(flash, true))
+			break;
+	}
+
+	msg_ginfo("%u unit%s: %u passed, %u failed", units, units == 1 ? "" : "s", units - failed, failed);
+	if (units)
+		msg_ginfo(", %.1f s per unit on average", total / units);
+	msg_ginfo(".\n");
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+out:
+	free(image);
+	free(oldcontents);
+	free(newcontents);
+	return ret;
+}
@@ -70,17 +70,33 @@ void start_logging(void)
 }
 #endif /* !STANDALONE */
 
+/* Prepended to every output line if set, e.g. to tell apart the output of several gang members. */
+static const char *msg_prefix = NULL;
+static int screen_line_start = 1;
+#ifndef STANDALONE
+static int logfile_line_start = 1;
+#endif
+
+void set_msg_prefix(const char *prefix)
+{
+	msg_prefix = prefix;
+}
+
 /* Please note that level is the verbosity, not the importance of the message. */
 int print(enum msglevel level, const char *fmt, ...)
 {
 	va_list ap;
 	int ret = 0;
 	FILE *output_type = stdout;
+	const int ends_line = fmt[0] != '\0' && fmt[strlen(fmt) - 1] == '\n';
 
 	if (level < MSG_INFO)
 		output_type = stderr;
 
 	if (level <= verbose_screen) {
+		if (msg_prefix && screen_line_start)
+			fputs(msg_prefix, output_type);
+		screen_line_start = ends_line;
 		va_start(ap, fmt);
 		ret = vfprintf(output_type, fmt, ap);
 		va_end(ap);
@@ -91,6 +107,9 @@ int print(enum msglevel level, const char *fmt, ...)
 	}
 #ifndef STANDALONE
 	if ((level <= verbose_logfile) && logfile) {
+		if (msg_prefix && logfile_line_start)
+			fputs(msg_prefix, logfile);
+		logfile_line_start = ends_line;
 		va_start(ap, fmt);
 		ret = vfprintf(logfile, fmt, ap);
 		va_end(ap);
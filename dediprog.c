@@ -407,22 +407,69 @@ static void fill_rw_cmd_payload(uint8_t *data_packet, unsigned int count, uint8_
 	}
 }
 
-/* Bulk read interface, will read multiple 512 byte chunks aligned to 512 bytes.
+/* State of a bulk read. It has to stay at the same address until the read is finished because the libusb
+ * callbacks report into it. */
+struct dediprog_bulk_read {
+	struct dediprog_transfer_status status;
+	struct libusb_transfer *transfers[DEDIPROG_ASYNC_TRANSFERS];
+	uint8_t *buf;
+	unsigned int count;
+};
+
+/* Queues bulk transfers until the ring buffer is full. */
+static int dediprog_bulk_read_queue(struct dediprog_bulk_read *rd)
+{
+	/* chunksize must be 512, other sizes will NOT work at all. */
+	const unsigned int chunksize = 512;
+	struct libusb_transfer *transfer;
+	int ret;
+
+	while ((rd->status.queued_idx < rd->count) &&
+	       (rd->status.queued_idx - rd->status.finished_idx) < DEDIPROG_ASYNC_TRANSFERS) {
+		transfer = rd->transfers[rd->status.queued_idx % DEDIPROG_ASYNC_TRANSFERS];
+		libusb_fill_bulk_transfer(transfer, dediprog_handle, 0x80 | dediprog_in_endpoint,
+				(unsigned char *)rd->buf + rd->status.queued_idx * chunksize, chunksize,
+				dediprog_bulk_read_cb, &rd->status, DEFAULT_TIMEOUT);
+		transfer->flags |= LIBUSB_TRANSFER_SHORT_NOT_OK;
+		ret = libusb_submit_transfer(transfer);
+		if (ret < 0) {
+			msg_perr("Submitting SPI bulk read %i failed: %s!\n",
+				 rd->status.queued_idx, libusb_error_name(ret));
+			return 1;
+		}
+		++rd->status.queued_idx;
+	}
+	return 0;
+}
+
+/* Waits for all outstanding transfers and frees them. */
+static void dediprog_bulk_read_cleanup(struct dediprog_bulk_read *rd)
+{
+	unsigned int i;
+
+	dediprog_bulk_read_poll(&rd->status, 1);
+	for (i = 0; i < DEDIPROG_ASYNC_TRANSFERS; ++i) {
+		if (rd->transfers[i])
+			libusb_free_transfer(rd->transfers[i]);
+		rd->transfers[i] = NULL;
+	}
+}
+
+/* Starts a bulk read of multiple 512 byte chunks aligned to 512 bytes and queues the first chunks without
+ * waiting for them. dediprog_bulk_read_finish() has to be called for every successfully started read.
  * @start	start address
  * @len		length
  * @return	0 on success, 1 on failure
  */
-static int dediprog_spi_bulk_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+static int dediprog_bulk_read_start(struct dediprog_bulk_read *rd, uint8_t *buf, unsigned int start,
+				    unsigned int len)
 {
-	int err = 1;
-
 	/* chunksize must be 512, other sizes will NOT work at all. */
 	const unsigned int chunksize = 512;
-	const unsigned int count = len / chunksize;
 
-	struct dediprog_transfer_status status = { 0, 0, 0 };
-	struct libusb_transfer *transfers[DEDIPROG_ASYNC_TRANSFERS] = { NULL, };
-	struct libusb_transfer *transfer;
+	memset(rd, 0, sizeof(*rd));
+	rd->buf = buf;
+	rd->count = len / chunksize;
 
 	if ((start % chunksize) || (len % chunksize)) {
 		msg_perr("%s: Unaligned start=%i, len=%i! Please report a bug at flashrom@flashrom.org\n",
@@ -436,7 +483,7 @@ static int dediprog_spi_bulk_read(struct flashctx *flash, uint8_t *buf, unsigned
 	/* Command packet size of protocols: new 10 B, old 5 B. */
 	uint8_t data_packet[is_new_prot() ? 10 : 5];
 	unsigned int value, idx;
-	fill_rw_cmd_payload(data_packet, count, READ_MODE_STD, &value, &idx, start);
+	fill_rw_cmd_payload(data_packet, rd->count, READ_MODE_STD, &value, &idx, start);
 
 	int ret = dediprog_write(CMD_READ, value, idx, data_packet, sizeof(data_packet));
 	if (ret != sizeof(data_packet)) {
@@ -452,49 +499,114 @@ static int dediprog_spi_bulk_read(struct flashctx *flash, uint8_t *buf, unsigned
 
 	/* Allocate bulk transfers. */
 	unsigned int i;
-	for (i = 0; i < min(DEDIPROG_ASYNC_TRANSFERS, count); ++i) {
-		transfers[i] = libusb_alloc_transfer(0);
-		if (!transfers[i]) {
+	for (i = 0; i < min(DEDIPROG_ASYNC_TRANSFERS, rd->count); ++i) {
+		rd->transfers[i] = libusb_alloc_transfer(0);
+		if (!rd->transfers[i]) {
 			msg_perr("Allocating libusb transfer %i failed: %s!\n", i, libusb_error_name(ret));
 			goto err_free;
  		}
  	}
 
-	/* Now transfer requested chunks using libusb's asynchronous interface. */
-	while (!status.error && (status.queued_idx < count)) {
-		while ((status.queued_idx - status.finished_idx) < DEDIPROG_ASYNC_TRANSFERS) {
-			transfer = transfers[status.queued_idx % DEDIPROG_ASYNC_TRANSFERS];
-			libusb_fill_bulk_transfer(transfer, dediprog_handle, 0x80 | dediprog_in_endpoint,
-					(unsigned char *)buf + status.queued_idx * chunksize, chunksize,
-					dediprog_bulk_read_cb, &status, DEFAULT_TIMEOUT);
-			transfer->flags |= LIBUSB_TRANSFER_SHORT_NOT_OK;
-			ret = libusb_submit_transfer(transfer);
-			if (ret < 0) {
-				msg_perr("Submitting SPI bulk read %i failed: %s!\n",
-					 status.queued_idx, libusb_error_name(ret));
-				goto err_free;
-			}
-			++status.queued_idx;
-		}
-		if (dediprog_bulk_read_poll(&status, 0))
+	if (dediprog_bulk_read_queue(rd))
+		goto err_free;
+	return 0;
+
+err_free:
+	dediprog_bulk_read_cleanup(rd);
+	return 1;
+}
+
+/* Transfers the remaining chunks of a started bulk read using libusb's asynchronous interface.
+ * @return	0 on success, 1 on failure
+ */
+static int dediprog_bulk_read_finish(struct dediprog_bulk_read *rd)
+{
+	int err = 1;
+
+	while (!rd->status.error && (rd->status.queued_idx < rd->count)) {
+		if (dediprog_bulk_read_queue(rd))
+			goto err_free;
+		if (dediprog_bulk_read_poll(&rd->status, 0))
 			goto err_free;
 	}
 	/* Wait for transfers to finish. */
-	if (dediprog_bulk_read_poll(&status, 1))
+	if (dediprog_bulk_read_poll(&rd->status, 1))
 		goto err_free;
 	/* Check if everything has been transmitted. */
-	if ((status.finished_idx < count) || status.error)
+	if ((rd->status.finished_idx < rd->count) || rd->status.error)
 		goto err_free;
 
 	err = 0;
 
 err_free:
-	dediprog_bulk_read_poll(&status, 1);
-	for (i = 0; i < DEDIPROG_ASYNC_TRANSFERS; ++i)
-		if (transfers[i]) libusb_free_transfer(transfers[i]);
+	dediprog_bulk_read_cleanup(rd);
 	return err;
 }
 
+/* Bulk read interface, will read multiple 512 byte chunks aligned to 512 bytes.
+ * @start	start address
+ * @len		length
+ * @return	0 on success, 1 on failure
+ */
+static int dediprog_spi_bulk_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	struct dediprog_bulk_read rd;
+
+	if (dediprog_bulk_read_start(&rd, buf, start, len))
+		return 1;
+	return dediprog_bulk_read_finish(&rd);
+}
+
+/* The asynchronous bulk read in flight (if xfer is set). */
+static struct {
+	struct spi_xfer *xfer;
+	struct dediprog_bulk_read rd;
+} dediprog_async;
+
+/* Waits for the asynchronous bulk read in flight (if any) and completes it. */
+static void dediprog_async_drain(void)
+{
+	struct spi_xfer *const xfer = dediprog_async.xfer;
+
+	if (!xfer)
+		return;
+	dediprog_async.xfer = NULL;
+	if (dediprog_bulk_read_finish(&dediprog_async.rd)) {
+		dediprog_set_leds(LED_ERROR);
+		spi_xfer_complete(xfer, 1);
+		return;
+	}
+	dediprog_set_leds(LED_PASS);
+	spi_xfer_complete(xfer, 0);
+}
+
+/* Aligned reads are started as bulk reads and finished in dediprog_spi_wait(), everything else is run
+ * synchronously. */
+static int dediprog_spi_submit(struct flashctx *flash, struct spi_xfer *xfer)
+{
+	dediprog_async_drain();
+
+	if (!xfer->len || (xfer->start % 512) || (xfer->len % 512)) {
+		spi_xfer_run(flash, xfer);
+		return 0;
+	}
+
+	dediprog_set_leds(LED_BUSY);
+	if (dediprog_bulk_read_start(&dediprog_async.rd, xfer->readbuf, xfer->start, xfer->len)) {
+		dediprog_set_leds(LED_ERROR);
+		return 1;
+	}
+	dediprog_async.xfer = xfer;
+	return 0;
+}
+
+static int dediprog_spi_wait(struct flashctx *flash, struct spi_xfer *xfer)
+{
+	if (dediprog_async.xfer == xfer)
+		dediprog_async_drain();
+	return xfer->result;
+}
+
 static int dediprog_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
 {
 	int ret;
@@ -503,6 +615,7 @@ static int dediprog_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int
 	unsigned int residue = start % chunksize ? chunksize - start % chunksize : 0;
 	unsigned int bulklen;
 
+	dediprog_async_drain();
 	dediprog_set_leds(LED_BUSY);
 
 	if (residue) {
@@ -608,6 +721,7 @@ static int dediprog_spi_write(struct flashctx *flash, const uint8_t *buf,
 	unsigned int residue = start % chunksize ? chunksize - start % chunksize : 0;
 	unsigned int bulklen;
 
+	dediprog_async_drain();
 	dediprog_set_leds(LED_BUSY);
 
 	if (chunksize != 256) {
@@ -671,6 +785,7 @@ static int dediprog_spi_send_command(struct flashctx *flash,
 	int ret;
 
 	msg_pspew("%s, writecnt=%i, readcnt=%i\n", __func__, writecnt, readcnt);
+	dediprog_async_drain();
 	if (writecnt > flash->mst->spi.max_data_write) {
 		msg_perr("Invalid writecnt=%i, aborting.\n", writecnt);
 		return 1;
@@ -912,6 +1027,8 @@ static const struct spi_master spi_master_dediprog = {
 	.max_data_write	= 16,
 	.command	= dediprog_spi_send_command,
 	.multicommand	= default_spi_send_multicommand,
+	.submit		= dediprog_spi_submit,
+	.wait		= dediprog_spi_wait,
 	.read		= dediprog_spi_read,
 	.write_256	= dediprog_spi_write_256,
 	.write_aai	= dediprog_spi_write_aai,
@@ -919,6 +1036,7 @@ static const struct spi_master spi_master_dediprog = {
 
 static int dediprog_shutdown(void *data)
 {
+	dediprog_async_drain();
 	dediprog_firmwareversion = FIRMWARE_VERSION(0, 0, 0);
 	dediprog_devicetype = DEV_UNKNOWN;
 
@@ -0,0 +1,449 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Delta images: the blocks in which a new image differs from a base image, for updating chips which hold the
+ * base image without shipping the whole new image. The format is
+ *
+ *   flashrom-delta 2
+ *   size <image size in bytes>
+ *   base <sha256 of the base image>
+ *   target <sha256 of the new image>
+ *   block <start> <length> <raw|zlib> <stored length>
+ *   hash <sha256 of the base data> <sha256 of the new data>
+ *   ...
+ *   <stored length bytes of new data, compressed with zlib if so noted>
+ *   ...
+ *
+ * with one hash line for every DELTA_BLOCK of a block and a newline after its data. Before anything is written,
+ * every DELTA_BLOCK of the changed blocks has to hold its base data, its new data or be erased. The latter two
+ * are left by an interrupted update, which can then simply be applied again, as long as the chip erases in
+ * blocks no larger than DELTA_BLOCK. Otherwise nothing is written at all. The unchanged rest of the chip is
+ * checked with the checksums of the whole images.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#if HAVE_ZLIB == 1
+#include <zlib.h>
+#endif
+#include "flash.h"
+
+#define DELTA_MAGIC		"flashrom-delta 2"
+/* Granularity of the comparison and of the checksums, the smallest erase block of most chips. Adjacent changed
+ * blocks are merged into one record of at most DELTA_MAX_RECORD bytes.
+ */
+#define DELTA_BLOCK		4096
+#define DELTA_MAX_RECORD	(64 * 1024)
+
+struct delta_record {
+	unsigned int start;
+	unsigned int len;
+	/* Checksums of every DELTA_BLOCK of the record. */
+	char (*base)[65];
+	char (*target)[65];
+	uint8_t *data;
+};
+
+static void *delta_malloc(size_t len)
+{
+	void *buf = malloc(len ? len : 1);
+	if (!buf) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	return buf;
+}
+
+/* Loads a whole image file. Returns NULL on error. */
+static uint8_t *load_image(const char *filename, unsigned long *size)
+{
+	uint8_t *buf;
+
+	if (get_image_file_size(filename, size))
+		return NULL;
+	buf = delta_malloc(*size);
+	if (read_buf_from_file(buf, *size, filename)) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/* Writes one record, compressed if zlib is available and compression pays off. */
+static void write_record(FILE *file, const uint8_t *base, const uint8_t *target, unsigned int start,
+			unsigned int len)
+{
+	const uint8_t *data = target + start;
+	const char *method = "raw";
+	unsigned long stored = len;
+	unsigned int pos;
+	char basehash[65], targethash[65];
+#if HAVE_ZLIB == 1
+	unsigned long bound = compressBound(len);
+	uint8_t *packed = delta_malloc(bound);
+
+	if (compress2(packed, &bound, data, len, Z_BEST_COMPRESSION) == Z_OK && bound < len) {
+		data = packed;
+		stored = bound;
+		method = "zlib";
+	}
+#endif
+	fprintf(file, "block 0x%06x 0x%x %s %lu\n", start, len, method, stored);
+	for (pos = start; pos < start + len; pos += DELTA_BLOCK) {
+		sha256_hex(base + pos, min(DELTA_BLOCK, start + len - pos), basehash);
+		sha256_hex(target + pos, min(DELTA_BLOCK, start + len - pos), targethash);
+		fprintf(file, "hash %s %s\n", basehash, targethash);
+	}
+	fwrite(data, 1, stored, file);
+	fputc('\n', file);
+#if HAVE_ZLIB == 1
+	free(packed);
+#endif
+}
+
+/**
+ * @brief save the blocks in which newfile differs from basefile as delta image
+ *
+ * No chip is involved. Both images have to be of the same size.
+ *
+ * @return	0 on success
+ */
+int make_delta(const char *basefile, const char *newfile, const char *filename)
+{
+#ifdef __LIBPAYLOAD__
+	msg_gerr("Error: No file I/O support in libpayload\n");
+	return 1;
+#else
+	unsigned long size, newsize;
+	unsigned int pos, start, records = 0, changed = 0;
+	uint8_t *base, *target = NULL;
+	char digest[65];
+	FILE *file = NULL;
+	int ret = 1;
+
+	base = load_image(basefile, &size);
+	if (!base)
+		return 1;
+	target = load_image(newfile, &newsize);
+	if (!target)
+		goto out;
+	if (size != newsize) {
+		msg_gerr("Error: The base image (%lu B) and the new image (%lu B) differ in size.\n", size, newsize);
+		goto out;
+	}
+
+	file = fopen(filename, "wb");
+	if (!file) {
+		msg_gerr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
+		goto out;
+	}
+	fprintf(file, "%s\nsize %lu\n", DELTA_MAGIC, size);
+	sha256_hex(base, size, digest);
+	fprintf(file, "base %s\n", digest);
+	sha256_hex(target, size, digest);
+	fprintf(file, "target %s\n", digest);
+
+	for (pos = 0; pos < size; ) {
+		if (!memcmp(base + pos, target + pos, min(DELTA_BLOCK, size - pos))) {
+			pos += DELTA_BLOCK;
+			continue;
+		}
+		start = pos;
+		while (pos < size && pos - start < DELTA_MAX_RECORD &&
+		       memcmp(base + pos, target + pos, min(DELTA_BLOCK, size - pos)))
+			pos += DELTA_BLOCK;
+		pos = min(pos, size);
+		write_record(file, base, target, start, pos - start);
+		records++;
+		changed += pos - start;
+	}
+	ret = 0;
+	if (ferror(file))
+		ret = 1;
+	if (fclose(file))
+		ret = 1;
+	if (ret)
+		msg_gerr("Error: writing file \"%s\" failed: %s\n", filename, strerror(errno));
+	else
+		msg_ginfo("Delta image with %u block%s (%u of %lu bytes changed) saved to %s.\n", records,
+			  records == 1 ? "" : "s", changed, size, filename);
+out:
+	free(base);
+	free(target);
+	return ret;
+#endif
+}
+
+/* Reads the data of a record and decompresses it if needed. */
+static int read_record_data(FILE *file, struct delta_record *rec, const char *method, unsigned long stored)
+{
+	uint8_t *buf = delta_malloc(stored);
+
+	rec->data = delta_malloc(rec->len);
+	if (fread(buf, 1, stored, file) != stored || fgetc(file) != '\n')
+		goto fail;
+	if (!strcmp(method, "raw")) {
+		if (stored != rec->len)
+			goto fail;
+		memcpy(rec->data, buf, stored);
+#if HAVE_ZLIB == 1
+	} else if (!strcmp(method, "zlib")) {
+		unsigned long len = rec->len;
+		if (uncompress(rec->data, &len, buf, stored) != Z_OK || len != rec->len)
+			goto fail;
+#endif
+	} else {
+		msg_gerr("Error: Unsupported compression \"%s\".\n", method);
+		goto fail;
+	}
+	free(buf);
+	return 0;
+fail:
+	free(buf);
+	return 1;
+}
+
+static void free_records(struct delta_record *recs, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		free(recs[i].base);
+		free(recs[i].target);
+		free(recs[i].data);
+	}
+	free(recs);
+}
+
+/* Number of checksums of a record. */
+static unsigned int record_blocks(const struct delta_record *rec)
+{
+	return (rec->len + DELTA_BLOCK - 1) / DELTA_BLOCK;
+}
+
+/* Reads the hash lines of a record. */
+static int read_record_hashes(FILE *file, struct delta_record *rec)
+{
+	unsigned int i, blocks = record_blocks(rec);
+	char line[160];
+
+	rec->base = delta_malloc(blocks * sizeof(*rec->base));
+	rec->target = delta_malloc(blocks * sizeof(*rec->target));
+	for (i = 0; i < blocks; i++) {
+		if (!fgets(line, sizeof(line), file) ||
+		    sscanf(line, "hash %64s %64s", rec->base[i], rec->target[i]) != 2)
+			return 1;
+	}
+	return 0;
+}
+
+/* Loads all records of a delta image for a chip of size bytes and the checksums of the whole base and new
+ * images. Returns NULL on error.
+ */
+static struct delta_record *load_delta(const char *filename, unsigned int size, unsigned int *count,
+				       char base[65], char target[65])
+{
+	struct delta_record *recs = delta_malloc(sizeof(*recs));
+	unsigned int alloc = 1, filesize;
+	unsigned long stored;
+	char line[512], method[16];
+	FILE *file;
+
+	*count = 0;
+	base[0] = target[0] = '\0';
+	file = fopen(filename, "rb");
+	if (!file) {
+		msg_gerr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
+		return NULL;
+	}
+	if (!fgets(line, sizeof(line), file) || strncmp(line, DELTA_MAGIC, strlen(DELTA_MAGIC)) ||
+	    !fgets(line, sizeof(line), file) || sscanf(line, "size %u", &filesize) != 1) {
+		msg_gerr("Error: \"%s\" is not a flashrom delta image.\n", filename);
+		goto fail;
+	}
+	if (filesize != size) {
+		msg_gerr("Error: Delta image size (%u B) doesn't match the flash chip's size (%u B)!\n",
+			 filesize, size);
+		goto fail;
+	}
+	while (fgets(line, sizeof(line), file)) {
+		struct delta_record *rec;
+
+		if (sscanf(line, "base %64s", base) == 1 || sscanf(line, "target %64s", target) == 1)
+			continue;
+		if (*count == alloc) {
+			alloc *= 2;
+			recs = realloc(recs, alloc * sizeof(*recs));
+			if (!recs) {
+				msg_gerr("Out of memory!\n");
+				exit(1);
+			}
+		}
+		rec = &recs[*count];
+		rec->base = rec->target = NULL;
+		rec->data = NULL;
+		if (sscanf(line, "block %x %x %15s %lu", &rec->start, &rec->len, method, &stored) != 4 ||
+		    !rec->len || rec->start % DELTA_BLOCK || rec->start > size || rec->len > size - rec->start ||
+		    stored > 2 * rec->len + 64) {
+			msg_gerr("Error: Invalid block in \"%s\".\n", filename);
+			goto fail;
+		}
+		(*count)++;
+		if (read_record_hashes(file, rec) || read_record_data(file, rec, method, stored)) {
+			msg_gerr("Error: Corrupt data of block 0x%06x in \"%s\".\n", rec->start, filename);
+			goto fail;
+		}
+	}
+	fclose(file);
+	if (strlen(base) != 64 || strlen(target) != 64) {
+		msg_gerr("Error: \"%s\" lacks the checksums of the images.\n", filename);
+		free_records(recs, *count);
+		return NULL;
+	}
+	return recs;
+fail:
+	fclose(file);
+	free_records(recs, *count);
+	return NULL;
+}
+
+static bool delta_block_erased(const uint8_t *buf, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] != 0xff)
+			return false;
+	}
+	return true;
+}
+
+/* Checks every DELTA_BLOCK of the records against the chip contents in buf. Counts the blocks still holding the
+ * base data in *pending and those which do not in *done. Returns 1 if a block holds anything else.
+ */
+static int check_delta_blocks(const struct delta_record *recs, unsigned int count, const uint8_t *buf,
+			      unsigned int *pending, unsigned int *done)
+{
+	unsigned int i, j, start, len;
+	char digest[65];
+
+	*pending = *done = 0;
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < record_blocks(&recs[i]); j++) {
+			start = recs[i].start + j * DELTA_BLOCK;
+			len = min(DELTA_BLOCK, recs[i].start + recs[i].len - start);
+			sha256_hex(buf + start, len, digest);
+			if (!strcmp(digest, recs[i].base[j])) {
+				(*pending)++;
+				continue;
+			}
+			/* Left by an interrupted update. */
+			if (!strcmp(digest, recs[i].target[j]) || delta_block_erased(buf + start, len)) {
+				(*done)++;
+				continue;
+			}
+			msg_cerr("Block 0x%06x-0x%06x holds neither the base nor the new data of the delta image.\n"
+				 "The chip does not contain the base image, aborting.\n", start, start + len - 1);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief apply a delta image saved by make_delta() to the chip
+ *
+ * The chip is read and checked against the delta image as described at the top, then written like any other
+ * image, i.e. only the erase blocks which differ are erased and written.
+ *
+ * @return	0 on success
+ */
+int apply_delta(struct flashctx *flash, int force, const char *filename, int verify_it)
+{
+#ifdef __LIBPAYLOAD__
+	msg_gerr("Error: No file I/O support in libpayload\n");
+	return 1;
+#else
+	unsigned int size = flash->chip->total_size * 1024;
+	unsigned int i, count, pending, done;
+	struct delta_record *recs;
+	uint8_t *oldcontents = NULL, *newcontents = NULL;
+	char base[65], target[65], digest[65];
+	int ret = 1;
+
+	if (chip_safety_check(flash, force, 0, 1, 0, verify_it)) {
+		msg_cerr("Aborting.\n");
+		return 1;
+	}
+	if (flash->chip->unlock)
+		flash->chip->unlock(flash);
+
+	recs = load_delta(filename, size, &count, base, target);
+	if (!recs)
+		return 1;
+
+	oldcontents = delta_malloc(size);
+	msg_cinfo("Reading old flash chip contents... ");
+	if (flash->chip->read(flash, oldcontents, 0, size)) {
+		msg_cinfo("FAILED.\n");
+		goto out;
+	}
+	msg_cinfo("done.\n");
+	sha256_hex(oldcontents, size, digest);
+	if (!strcmp(digest, target)) {
+		msg_cinfo("The chip already contains the new image.\n");
+		ret = 0;
+		goto out;
+	}
+	if (check_delta_blocks(recs, count, oldcontents, &pending, &done))
+		goto out;
+	if (!done && strcmp(digest, base)) {
+		msg_cerr("The changed blocks hold their base data, but the chip does not contain the base image.\n"
+			 "Aborting.\n");
+		goto out;
+	}
+
+	newcontents = delta_malloc(size);
+	memcpy(newcontents, oldcontents, size);
+	for (i = 0; i < count; i++)
+		memcpy(newcontents + recs[i].start, recs[i].data, recs[i].len);
+	/* Also covers the unchanged rest of the chip if an interrupted update left some blocks behind. */
+	sha256_hex(newcontents, size, digest);
+	if (strcmp(digest, target)) {
+		msg_cerr("Applying the delta image to the chip contents does not result in the new image.\n"
+			 "The chip does not contain the base image, aborting.\n");
+		goto out;
+	}
+	if (done)
+		msg_cinfo("%u of %u blocks were changed by an interrupted update already, continuing it.\n", done,
+			  done + pending);
+
+	ret = update_flash(flash, 1, oldcontents, newcontents, 1, verify_it);
+	if (!ret && verify_it)
+		msg_cinfo("The chip contains the new image (SHA-256 %s).\n", target);
+out:
+	free(oldcontents);
+	free(newcontents);
+	free_records(recs, count);
+	return ret;
+#endif
+}
@@ -31,6 +31,7 @@
 #include <strings.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -45,6 +46,11 @@
 /* Strings longer than 4096 in DMI are just insane. */
 #define DMI_MAX_ANSWER_LEN 4096
 
+/* Linux exports the SMBIOS entry point and the table it points to in this directory. */
+#define DMI_SYSFS_TABLES "/sys/firmware/dmi/tables"
+/* Neither file is anywhere near this size on real systems. */
+#define DMI_MAX_TABLE_LEN (1024 * 1024)
+
 int has_dmi_support = 0;
 
 static struct {
@@ -93,7 +99,7 @@ static const struct {
 	{0x19, 0, "Multi-system"}, /* used by Supermicro (X7DWT) */
 };
 
-#if CONFIG_INTERNAL_DMI == 1
+#if CONFIG_INTERNAL_DMI == 1 || IS_LINUX
 static bool dmi_checksum(const uint8_t * const buf, size_t len)
 {
 	uint8_t sum = 0;
@@ -164,25 +170,32 @@ static void dmi_chassis_type(uint8_t code)
 	}
 }
 
-static void dmi_table(uint32_t base, uint16_t len, uint16_t num)
+static uint16_t dmi_le16(const uint8_t *buf)
 {
-	int i = 0, j = 0;
+	return buf[0] | buf[1] << 8;
+}
 
-	uint8_t *dmi_table_mem = physmap_ro("DMI Table", base, len);
-	if (dmi_table_mem == NULL) {
-		msg_perr("Unable to access DMI Table\n");
-		return;
-	}
+static uint32_t dmi_le32(const uint8_t *buf)
+{
+	return dmi_le16(buf) | (uint32_t)dmi_le16(buf + 2) << 16;
+}
+
+/* Decodes the num structures of the table at dmi_table_mem. If num is 0 the table is decoded up to its
+ * end-of-table structure (SMBIOS 3 entry points do not tell the number of structures).
+ */
+static void dmi_table_decode(const uint8_t *dmi_table_mem, size_t len, uint16_t num)
+{
+	int i = 0, j = 0;
 
-	uint8_t *data = dmi_table_mem;
-	uint8_t *limit = dmi_table_mem + len;
+	const uint8_t *data = dmi_table_mem;
+	const uint8_t *limit = dmi_table_mem + len;
 
 	/* SMBIOS structure header is always 4 B long and contains:
 	 *  - uint8_t type;	// see dmi_chassis_types's type
 	 *  - uint8_t length;	// data section w/ header w/o strings
 	 *  - uint16_t handle;
 	 */
-	while (i < num && data + 4 < limit) {
+	while ((!num || i < num) && data + 4 < limit) {
 		/* - If a short entry is found (less than 4 bytes), not only it
 		 *   is invalid, but we cannot reliably locate the next entry.
 		 * - If the length value indicates that this structure spreads
@@ -195,6 +208,10 @@ static void dmi_table(uint32_t base, uint16_t len, uint16_t num)
 			break;
 		}
 
+		/* End-of-table structure. */
+		if (data[0] == 127)
+			break;
+
 		if(data[0] == 3) {
 			if (data + 5 < limit)
 				dmi_chassis_type(data[5]);
@@ -210,7 +227,7 @@ static void dmi_table(uint32_t base, uint16_t len, uint16_t num)
 
 				if (data[1] <= offset || data + offset >= limit) {
 					msg_perr("DMI table is broken (offset out of bounds)!\n");
-					goto out;
+					return;
 				}
 
 				dmi_strings[j].value = dmi_string((const char *)(data + data[1]), data[offset],
@@ -226,7 +243,96 @@ static void dmi_table(uint32_t base, uint16_t len, uint16_t num)
 		data += 2;
 		i++;
 	}
+}
+
+#if IS_LINUX
+/* Reads a whole file of the sysfs DMI directory. Returns NULL if it does not exist or can not be read. */
+static uint8_t *dmi_read_file(const char *dir, const char *name, size_t *len)
+{
+	char path[1024];
+	uint8_t *buf;
+	FILE *file;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	file = fopen(path, "rb");
+	if (!file) {
+		if (errno != ENOENT)
+			msg_pdbg("Could not open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	buf = malloc(DMI_MAX_TABLE_LEN);
+	if (!buf) {
+		msg_perr("Out of memory!\n");
+		fclose(file);
+		return NULL;
+	}
+	/* sysfs does not report the real size of these files, hence just read what is there. */
+	*len = fread(buf, 1, DMI_MAX_TABLE_LEN, file);
+	if (ferror(file) || !*len) {
+		msg_pdbg("Could not read %s.\n", path);
+		free(buf);
+		buf = NULL;
+	}
+	fclose(file);
+	return buf;
+}
+
+/* Decodes the SMBIOS tables exported by the kernel in dir (DMI_SYSFS_TABLES or a directory holding copies of
+ * the smbios_entry_point and DMI files). Avoids physical memory access and works on EFI systems, which do not
+ * have the legacy entry point in the BIOS area.
+ */
+static int dmi_fill_sysfs(const char *dir)
+{
+	size_t eplen, len;
+	uint8_t *ep, *table;
+	uint16_t num;
+	int ret = 1;
+
+	ep = dmi_read_file(dir, "smbios_entry_point", &eplen);
+	if (!ep)
+		return 1;
+	table = dmi_read_file(dir, "DMI", &len);
+	if (!table) {
+		free(ep);
+		return 1;
+	}
+
+	if (eplen >= 0x18 && !memcmp(ep, "_SM3_", 5) && ep[6] <= eplen && dmi_checksum(ep, ep[6])) {
+		/* 64-bit entry point: only the maximum table size is known. */
+		len = min(len, dmi_le32(ep + 0x0C));
+		num = 0;
+	} else if (eplen >= 0x1F && !memcmp(ep, "_SM_", 4) && ep[5] <= eplen && dmi_checksum(ep, ep[5]) &&
+		   !memcmp(ep + 0x10, "_DMI_", 5) && dmi_checksum(ep + 0x10, 0x0F)) {
+		len = min(len, dmi_le16(ep + 0x16));
+		num = dmi_le16(ep + 0x1C);
+	} else if (eplen >= 0x0F && !memcmp(ep, "_DMI_", 5) && dmi_checksum(ep, 0x0F)) {
+		len = min(len, dmi_le16(ep + 0x06));
+		num = dmi_le16(ep + 0x0C);
+	} else {
+		msg_pdbg("%s/smbios_entry_point is not a valid SMBIOS entry point.\n", dir);
+		goto out;
+	}
+
+	msg_pdbg("Using SMBIOS tables in %s.\n", dir);
+	dmi_table_decode(table, len, num);
+	ret = 0;
 out:
+	free(table);
+	free(ep);
+	return ret;
+}
+#endif
+#endif /* CONFIG_INTERNAL_DMI == 1 || IS_LINUX */
+
+#if CONFIG_INTERNAL_DMI == 1
+static void dmi_table(uint32_t base, uint16_t len, uint16_t num)
+{
+	uint8_t *dmi_table_mem = physmap_ro("DMI Table", base, len);
+	if (dmi_table_mem == NULL) {
+		msg_perr("Unable to access DMI Table\n");
+		return;
+	}
+	dmi_table_decode(dmi_table_mem, len, num);
 	physunmap(dmi_table_mem, len);
 }
 
@@ -255,13 +361,20 @@ static int legacy_decode(uint8_t *buf)
 	return 0;
 }
 
-int dmi_fill(void)
+static int dmi_fill(const char *sysfs_dir)
 {
 	size_t fp;
 	uint8_t *dmi_mem;
 	int ret = 1;
 
 	msg_pdbg("Using Internal DMI decoder.\n");
+#if IS_LINUX
+	/* Tables given explicitly are used or nothing, never those of the machine we run on. */
+	if (sysfs_dir)
+		return dmi_fill_sysfs(sysfs_dir);
+	if (!dmi_fill_sysfs(DMI_SYSFS_TABLES))
+		return 0;
+#endif
 	/* There are two ways specified to gain access to the SMBIOS table:
 	 * - EFI's configuration table contains a pointer to the SMBIOS table. On linux it can be obtained from
 	 *   sysfs. EFI's SMBIOS GUID is: {0xeb9d2d31,0x2d88,0x11d3,0x9a,0x16,0x0,0x90,0x27,0x3f,0xc1,0x4d}
@@ -346,11 +459,21 @@ static char *get_dmi_string(const char *string_name)
 	return result;
 }
 
-int dmi_fill(void)
+static int dmi_fill(const char *sysfs_dir)
 {
 	int i;
 	char *chassis_type;
 
+#if IS_LINUX
+	/* Tables given explicitly are used or nothing, never those of the machine we run on. */
+	if (sysfs_dir)
+		return dmi_fill_sysfs(sysfs_dir);
+	/* Decoding the tables exported by the kernel saves forking dmidecode for every string. */
+	if (!dmi_fill_sysfs(DMI_SYSFS_TABLES)) {
+		msg_pdbg("Using Internal DMI decoder.\n");
+		return 0;
+	}
+#endif
 	msg_pdbg("Using External DMI decoder.\n");
 	for (i = 0; i < ARRAY_SIZE(dmi_strings); i++) {
 		dmi_strings[i].value = get_dmi_string(dmi_strings[i].keyword);
@@ -386,17 +509,31 @@ static int dmi_shutdown(void *data)
 	return 0;
 }
 
-void dmi_init(void)
+/* sysfs_dir overrides the directory the SMBIOS tables are read from on Linux, NULL selects the default.
+ * Returns 1 if the tables in sysfs_dir can not be used, missing DMI info is not an error otherwise.
+ */
+int dmi_init(const char *sysfs_dir)
 {
+#if !IS_LINUX
+	if (sysfs_dir) {
+		msg_perr("Error: Reading SMBIOS tables from a directory is only supported on Linux.\n");
+		return 1;
+	}
+#endif
 	/* Register shutdown function before we allocate anything. */
 	if (register_shutdown(dmi_shutdown, NULL)) {
 		msg_pwarn("Warning: Could not register DMI shutdown function - continuing without DMI info.\n");
-		return;
+		return 0;
 	}
 
 	/* dmi_fill fills the dmi_strings array, and if possible sets the global is_laptop variable. */
-	if (dmi_fill() != 0)
-		return;
+	if (dmi_fill(sysfs_dir) != 0) {
+		if (sysfs_dir) {
+			msg_perr("Error: No valid SMBIOS tables in %s.\n", sysfs_dir);
+			return 1;
+		}
+		return 0;
+	}
 
 	switch (is_laptop) {
 	case 1:
@@ -413,6 +550,7 @@ void dmi_init(void)
 		msg_pdbg("DMI string %s: \"%s\"\n", dmi_strings[i].keyword,
 			 (dmi_strings[i].value == NULL) ? "" : dmi_strings[i].value);
 	}
+	return 0;
 }
 
 /**
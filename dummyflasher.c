@@ -64,6 +64,8 @@ unsigned char spi_ignorelist[256];
 int spi_blacklist_size = 0;
 int spi_ignorelist_size = 0;
 static uint8_t emu_status = 0;
+/* Reads return corrupted data if the SPI clock is faster than this, 0 means never. */
+static unsigned int emu_stable_spi_speed = 0;
 
 /* A legit complete SFDP table based on the MX25L6436E (rev. 1.8) datasheet. */
 static const uint8_t sfdp_table[] = {
@@ -95,11 +97,14 @@ static const uint8_t sfdp_table[] = {
 #endif
 
 static unsigned int spi_write_256_chunksize = 256;
+static unsigned int dummy_spi_speed = 0;
 
 static int dummy_spi_send_command(struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
 				  const unsigned char *writearr, unsigned char *readarr);
 static int dummy_spi_write_256(struct flashctx *flash, const uint8_t *buf,
 			       unsigned int start, unsigned int len);
+static int dummy_spi_poll_status(struct flashctx *flash, uint8_t mask, uint8_t value, unsigned int delay);
+static int dummy_spi_set_speed(const struct flashctx *flash, unsigned int *hz);
 static void dummy_chip_writeb(const struct flashctx *flash, uint8_t val, chipaddr addr);
 static void dummy_chip_writew(const struct flashctx *flash, uint16_t val, chipaddr addr);
 static void dummy_chip_writel(const struct flashctx *flash, uint32_t val, chipaddr addr);
@@ -115,6 +120,8 @@ static const struct spi_master spi_master_dummyflasher = {
 	.max_data_write	= MAX_DATA_UNSPECIFIED,
 	.command	= dummy_spi_send_command,
 	.multicommand	= default_spi_send_multicommand,
+	.poll_status	= dummy_spi_poll_status,
+	.set_speed	= dummy_spi_set_speed,
 	.read		= default_spi_read,
 	.write_256	= dummy_spi_write_256,
 	.write_aai	= default_spi_write_aai,
@@ -140,7 +147,7 @@ static int dummy_shutdown(void *data)
 	if (emu_chip != EMULATE_NONE) {
 		if (emu_persistent_image) {
 			msg_pdbg("Writing %s\n", emu_persistent_image);
-			write_buf_to_file(flashchip_contents, emu_chip_size, emu_persistent_image);
+			write_buf_to_raw_file(flashchip_contents, emu_chip_size, emu_persistent_image);
 			free(emu_persistent_image);
 			emu_persistent_image = NULL;
 		}
@@ -362,6 +369,19 @@ int dummy_init(void)
 		msg_pdbg("Initial status register is set to 0x%02x.\n",
 			 emu_status);
 	}
+
+	tmp = extract_programmer_param("spi_stable_speed");
+	if (tmp) {
+		char *endptr;
+		errno = 0;
+		emu_stable_spi_speed = strtoul(tmp, &endptr, 0);
+		if (errno != 0 || tmp == endptr || *endptr != '\0') {
+			msg_perr("Error: Invalid spi_stable_speed \"%s\".\n", tmp);
+			free(tmp);
+			return 1;
+		}
+		free(tmp);
+	}
 #endif
 
 	msg_pdbg("Filling fake flash chip with 0xff, size %i\n", emu_chip_size);
@@ -381,8 +401,8 @@ int dummy_init(void)
 		if (image_stat.st_size == emu_chip_size) {
 			msg_pdbg("matches.\n");
 			msg_pdbg("Reading %s\n", emu_persistent_image);
-			read_buf_from_file(flashchip_contents, emu_chip_size,
-					   emu_persistent_image);
+			read_buf_from_raw_file(flashchip_contents, emu_chip_size,
+					       emu_persistent_image);
 		} else {
 			msg_pdbg("doesn't match.\n");
 		}
@@ -607,6 +627,9 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 		offs %= emu_chip_size;
 		if (readcnt > 0)
 			memcpy(readarr, flashchip_contents + offs, readcnt);
+		/* Emulate a clock too fast for the wiring: one bit of every read flips. */
+		if (readcnt > 0 && emu_stable_spi_speed && dummy_spi_speed > emu_stable_spi_speed)
+			readarr[readcnt / 2] ^= 0x10;
 		break;
 	case JEDEC_BYTE_PROGRAM:
 		offs = writearr[1] << 16 | writearr[2] << 8 | writearr[3];
@@ -831,3 +854,15 @@ static int dummy_spi_write_256(struct flashctx *flash, const uint8_t *buf, unsig
 	return spi_write_chunked(flash, buf, start, len,
 				 spi_write_256_chunksize);
 }
+
+static int dummy_spi_poll_status(struct flashctx *flash, uint8_t mask, uint8_t value, unsigned int delay)
+{
+	return spi_poll_status_streamed(flash, mask, value, delay, 16);
+}
+
+static int dummy_spi_set_speed(const struct flashctx *flash, unsigned int *hz)
+{
+	dummy_spi_speed = *hz;
+	msg_pdbg2("SPI clock set to %u Hz.\n", *hz);
+	return 0;
+}
@@ -145,6 +145,8 @@ enum test_state {
 #define TEST_BAD_PREW	(struct tested){ .probe = BAD, .read = BAD, .erase = BAD, .write = BAD }
 
 struct flashctx;
+struct flashrom_context;
+struct flashrom_layout;
 typedef int (erasefunc_t)(struct flashctx *flash, unsigned int addr, unsigned int blocklen);
 
 struct flashchip {
@@ -222,6 +224,8 @@ struct flashctx {
 	uintptr_t physical_registers;
 	chipaddr virtual_registers;
 	struct registered_master *mst;
+	/* The context this chip was probed in. */
+	struct flashrom_context *ctx;
 };
 
 /* Timing used in probe routines. ZERO is -2 to differentiate between an unset
@@ -271,19 +275,40 @@ int map_flash(struct flashctx *flash);
 void unmap_flash(struct flashctx *flash);
 int read_memmapped(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len);
 int erase_flash(struct flashctx *flash);
-int probe_flash(struct registered_master *mst, int startchip, struct flashctx *fill_flash, int force);
+int probe_flash(struct flashrom_context *ctx, struct registered_master *mst, int startchip, struct flashctx *fill_flash,
+		int force);
 int read_flash_to_file(struct flashctx *flash, const char *filename);
 char *extract_param(const char *const *haystack, const char *needle, const char *delim);
 int verify_range(struct flashctx *flash, const uint8_t *cmpbuf, unsigned int start, unsigned int len);
+int check_erased_range(struct flashctx *flash, unsigned int start, unsigned int len);
+int sample_range(struct flashctx *flash, const uint8_t *image, unsigned int count, unsigned int blocksize);
+int check_block_eraser(const struct flashctx *flash, int k, int log);
+int first_block_eraser(const struct flashctx *flash);
+int finest_block_eraser(const struct flashctx *flash);
+unsigned int count_eraseblocks(const struct flashctx *flash, int k);
 int need_erase(const uint8_t *have, const uint8_t *want, unsigned int len, enum write_granularity gran);
+unsigned int get_next_write(const uint8_t *have, const uint8_t *want, unsigned int len, unsigned int *first_start,
+			    enum write_granularity gran);
 void print_version(void);
 void print_buildinfo(void);
 void print_banner(void);
 void list_programmers_linebreak(int startcol, int cols, int paren);
 int selfcheck(void);
-int doit(struct flashctx *flash, int force, const char *filename, int read_it, int write_it, int erase_it, int verify_it);
+int chip_safety_check(const struct flashctx *flash, int force, int read_it, int write_it, int erase_it,
+		      int verify_it);
+int check_board_image(const struct flashctx *flash, uint8_t *buf, unsigned long size);
+int update_flash(struct flashctx *flash, int read_all_first, uint8_t *oldcontents, uint8_t *newcontents,
+		 int write_it, int verify_it);
+int doit(struct flashctx *flash, int force, const char *filename, const char *referencefile, int read_it,
+	 int write_it, int erase_it, int verify_it);
 int read_buf_from_file(unsigned char *buf, unsigned long size, const char *filename);
 int write_buf_to_file(const unsigned char *buf, unsigned long size, const char *filename);
+int read_image_file(struct flashctx *flash, uint8_t *newcontents, const char *filename);
+int read_buf_from_raw_file(unsigned char *buf, unsigned long size, const char *filename);
+int write_buf_to_raw_file(const unsigned char *buf, unsigned long size, const char *filename);
+int preload_image_file(const char *filename);
+int set_sparse_images(bool enable);
+int get_image_file_size(const char *filename, unsigned long *size);
 
 /* Something happened that shouldn't happen, but we can go on. */
 #define ERROR_NONFATAL 0x100
@@ -302,6 +327,12 @@ int write_buf_to_file(const unsigned char *buf, unsigned long size, const char *
 char *flashbuses_to_text(enum chipbustype bustype);
 void print_chip_support_status(const struct flashchip *chip);
 
+/* cli_daemon.c */
+int serve_daemon(struct flashctx *flash, int force, const char *path, int revalidate, int verify_it);
+
+/* cli_loop.c */
+int serve_loop(struct flashctx *flash, int force, const char *filename, int verify_it);
+
 /* cli_output.c */
 extern int verbose_screen;
 extern int verbose_logfile;
@@ -318,6 +349,7 @@ enum msglevel {
 	MSG_DEBUG2	= 4,
 	MSG_SPEW	= 5,
 };
+void set_msg_prefix(const char *prefix);
 /* Let gcc and clang check for correct printf-style format strings. */
 int print(enum msglevel level, const char *fmt, ...)
 #ifdef __MINGW32__
@@ -344,24 +376,97 @@ __attribute__((format(printf, 2, 3)));
 #define msg_pspew(...)	print(MSG_SPEW, __VA_ARGS__)	/* programmer debug spew  */
 #define msg_cspew(...)	print(MSG_SPEW, __VA_ARGS__)	/* chip debug spew  */
 
+/* manifest.c */
+uint32_t crc32c(uint32_t crc, const uint8_t *buf, size_t len);
+void sha256(const uint8_t *buf, size_t len, uint8_t digest[32]);
+void sha256_hex(const uint8_t *buf, size_t len, char hex[65]);
+struct manifest_stream;
+struct manifest_stream *manifest_stream_open(const struct flashctx *flash, const char *filename, bool with_sha256);
+void manifest_stream_feed(struct manifest_stream *ms, const uint8_t *buf, unsigned int len);
+int manifest_stream_close(struct manifest_stream *ms);
+int write_manifest(struct flashctx *flash, const uint8_t *image, const char *filename, bool with_sha256);
+int check_manifest(struct flashctx *flash, int force, const char *filename);
+
+/* journal.c */
+int journal_resume(struct flashctx *flash, const char *filename, const uint8_t *newcontents, uint8_t *oldcontents);
+int journal_create(struct flashctx *flash, const char *filename, const uint8_t *oldcontents,
+		   const uint8_t *newcontents);
+void journal_block_busy(struct flashctx *flash, unsigned int start, unsigned int len);
+void journal_block_done(struct flashctx *flash, unsigned int start, unsigned int len);
+bool journal_block_unknown(struct flashctx *flash, unsigned int start, unsigned int len);
+void journal_close(struct flashctx *flash, bool complete);
+
+/* plan.c */
+int write_plan(struct flashctx *flash, const uint8_t *oldcontents, const uint8_t *newcontents,
+	       const char *filename);
+int run_plan(struct flashctx *flash, const uint8_t *newcontents, const char *filename);
+
+/* delta.c */
+int make_delta(const char *basefile, const char *newfile, const char *filename);
+int apply_delta(struct flashctx *flash, int force, const char *filename, int verify_it);
+
+/* benchmark.c */
+struct flash_profile {
+	double latency_us;
+	double read_rate;		/* Bytes per second. */
+	double program_page_us;		/* Including the transfer, 0 if unknown. */
+	unsigned int erase_count;
+	struct {
+		unsigned int size;
+		double us;
+	} erase[NUM_ERASEFUNCTIONS];
+};
+int benchmark_flash(struct flashctx *flash, int force, long scratch, const char *filename);
+int load_profile(const char *filename, struct flash_profile *profile);
+
+/* fmap.c */
+int fmap_read_from_file(struct flashrom_layout *layout, const char *filename);
+int fmap_read_from_flash(struct flashrom_layout *layout, struct flashctx *flash);
+
+/* ifd.c */
+int ifd_read_from_file(struct flashrom_layout *layout, const char *filename);
+int ifd_read_from_flash(struct flashrom_layout *layout, struct flashctx *flash);
+
 /* layout.c */
-int register_include_arg(char *name);
-int process_include_args(void);
-int read_romlayout(const char *name);
-int normalize_romentries(const struct flashctx *flash);
-int build_new_image(struct flashctx *flash, bool oldcontents_valid, uint8_t *oldcontents, uint8_t *newcontents);
-void layout_cleanup(void);
+struct flashrom_layout *layout_new(void);
+void layout_free(struct flashrom_layout *layout);
+int register_include_arg(struct flashrom_layout *layout, char *name);
+int process_include_args(struct flashrom_layout *layout);
+int read_romlayout(struct flashrom_layout *layout, const char *name);
+void layout_add_entry(struct flashrom_layout *layout, chipoff_t start, chipoff_t end, const char *name);
+bool layout_has_included_regions(const struct flashrom_layout *layout);
+bool next_included_range(const struct flashrom_layout *layout, unsigned int size, unsigned int start,
+			 unsigned int *rstart, unsigned int *rlen);
+bool range_is_included(const struct flashrom_layout *layout, unsigned int start, unsigned int len);
+unsigned int included_regions_size(const struct flashrom_layout *layout, unsigned int size);
+int normalize_romentries(const struct flashrom_layout *layout, const struct flashctx *flash);
+int build_new_image(const struct flashrom_layout *layout, struct flashctx *flash, bool oldcontents_valid,
+		    uint8_t *oldcontents, uint8_t *newcontents);
+void layout_cleanup(struct flashrom_layout *layout);
 
 /* spi.c */
+struct spi_segment {
+	unsigned int len;
+	const unsigned char *buf;
+};
 struct spi_command {
 	unsigned int writecnt;
 	unsigned int readcnt;
 	const unsigned char *writearr;
 	unsigned char *readarr;
+	/* Optional data sent right after writearr while CS# stays asserted, e.g. the payload of a page
+	 * program command. This allows callers to avoid copying payloads behind the opcode/address header.
+	 * Masters without a .command_sg hook get a flattened copy of such commands. */
+	unsigned int writesegcnt;
+	const struct spi_segment *writesegs;
 };
 int spi_send_command(struct flashctx *flash, unsigned int writecnt, unsigned int readcnt, const unsigned char *writearr, unsigned char *readarr);
 int spi_send_multicommand(struct flashctx *flash, struct spi_command *cmds);
+unsigned int spi_command_writecnt(const struct spi_command *cmd);
+void spi_command_gather(const struct spi_command *cmd, unsigned char *dest);
+int spi_send_flattened_command(struct flashctx *flash, const struct spi_command *cmd);
+int spi_poll_status(struct flashctx *flash, uint8_t mask, uint8_t value, unsigned int delay);
 uint32_t spi_get_valid_read_addr(struct flashctx *flash);
 
-enum chipbustype get_buses_supported(void);
+enum chipbustype get_buses_supported(const struct flashrom_context *ctx);
 #endif				/* !__FLASH_H__ */
@@ -33,19 +33,24 @@
 #include <errno.h>
 #include <ctype.h>
 #include <getopt.h>
+#include <time.h>
 #if HAVE_UTSNAME == 1
 #include <sys/utsname.h>
 #endif
 #include "flash.h"
 #include "flashchips.h"
+#include "chipdrivers.h"
 #include "programmer.h"
 #include "hwaccess.h"
 
 const char flashrom_version[] = FLASHROM_VERSION;
 const char *chip_to_probe = NULL;
 
-static enum programmer programmer = PROGRAMMER_INVALID;
-static const char *programmer_param = NULL;
+/* The context whose programmer is currently initialized (if any). Programmer drivers have no context argument,
+ * so this binding stays process-global: only one programmer can be initialized at a time per process (gang
+ * mode forks one process per programmer). Everything else lives in the context.
+ */
+static struct flashrom_context *active_ctx = NULL;
 
 /*
  * Programmers supporting multiple buses can have differing size limits on
@@ -405,21 +410,12 @@ const struct programmer_entry programmer_table[] = {
 	{0}, /* This entry corresponds to PROGRAMMER_INVALID. */
 };
 
-#define SHUTDOWN_MAXFN 32
-static int shutdown_fn_count = 0;
-struct shutdown_func_data {
-	int (*func) (void *data);
-	void *data;
-} static shutdown_fn[SHUTDOWN_MAXFN];
-/* Initialize to 0 to make sure nobody registers a shutdown function before
- * programmer init.
- */
-static int may_register_shutdown = 0;
-
-/* Did we change something or was every erase/write skipped (if any)? */
-static bool all_skipped = true;
+/* Number and size of the blocks compared to validate a reference image against the chip. */
+#define REFERENCE_SAMPLE_COUNT	16
+#define REFERENCE_SAMPLE_SIZE	4096
 
-static int check_block_eraser(const struct flashctx *flash, int k, int log);
+/* How often the blocks which failed verification are erased and written again before giving up. */
+#define REPAIR_RETRIES		3
 
 int shutdown_free(void *data)
 {
@@ -437,24 +433,62 @@ int shutdown_free(void *data)
  */
 int register_shutdown(int (*function) (void *data), void *data)
 {
-	if (shutdown_fn_count >= SHUTDOWN_MAXFN) {
-		msg_perr("Tried to register more than %i shutdown functions.\n",
-			 SHUTDOWN_MAXFN);
-		return 1;
-	}
-	if (!may_register_shutdown) {
+	struct flashrom_context *ctx = active_ctx;
+
+	if (!ctx || !ctx->may_register_shutdown) {
 		msg_perr("Tried to register a shutdown function before "
 			 "programmer init.\n");
 		return 1;
 	}
-	shutdown_fn[shutdown_fn_count].func = function;
-	shutdown_fn[shutdown_fn_count].data = data;
-	shutdown_fn_count++;
+	if (ctx->shutdown_fn_count >= SHUTDOWN_MAXFN) {
+		msg_perr("Tried to register more than %i shutdown functions.\n",
+			 SHUTDOWN_MAXFN);
+		return 1;
+	}
+	ctx->shutdown_fn[ctx->shutdown_fn_count].func = function;
+	ctx->shutdown_fn[ctx->shutdown_fn_count].data = data;
+	ctx->shutdown_fn_count++;
 
 	return 0;
 }
 
-int programmer_init(enum programmer prog, const char *param)
+/* Allocates a new context without an initialized programmer. Returns NULL if out of memory. */
+struct flashrom_context *flashrom_context_new(void)
+{
+	struct flashrom_context *ctx = calloc(1, sizeof(*ctx));
+
+	if (!ctx)
+		return NULL;
+	ctx->programmer = PROGRAMMER_INVALID;
+	ctx->all_skipped = true;
+	ctx->spi_tune_step = -1;
+	ctx->layout = layout_new();
+	if (!ctx->layout) {
+		free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+/* Shuts down the programmer of ctx (if initialized) and frees it. */
+void flashrom_context_free(struct flashrom_context *ctx)
+{
+	if (!ctx)
+		return;
+	if (ctx == active_ctx)
+		programmer_shutdown(ctx);
+	layout_free(ctx->layout);
+	free(ctx);
+}
+
+/* Returns the context whose programmer is being or has been initialized, NULL if there is none. Drivers
+ * register their masters and shutdown functions there. */
+struct flashrom_context *get_active_context(void)
+{
+	return active_ctx;
+}
+
+int programmer_init(struct flashrom_context *ctx, enum programmer prog, const char *param)
 {
 	int ret;
 
@@ -462,7 +496,12 @@ int programmer_init(enum programmer prog, const char *param)
 		msg_perr("Invalid programmer specified!\n");
 		return -1;
 	}
-	programmer = prog;
+	if (active_ctx) {
+		msg_perr("Another programmer is still initialized, shut it down first!\n");
+		return -1;
+	}
+	active_ctx = ctx;
+	ctx->programmer = prog;
 	/* Initialize all programmer specific data. */
 	/* Default to unlimited decode sizes. */
 	max_rom_decode = (const struct decode_sizes) {
@@ -474,25 +513,25 @@ int programmer_init(enum programmer prog, const char *param)
 	/* Default to top aligned flash at 4 GB. */
 	flashbase = 0;
 	/* Registering shutdown functions is now allowed. */
-	may_register_shutdown = 1;
+	ctx->may_register_shutdown = 1;
 	/* Default to allowing writes. Broken programmers set this to 0. */
 	programmer_may_write = 1;
 
-	programmer_param = param;
-	msg_pdbg("Initializing %s programmer\n", programmer_table[programmer].name);
-	ret = programmer_table[programmer].init();
-	if (programmer_param && strlen(programmer_param)) {
+	ctx->programmer_param = param;
+	msg_pdbg("Initializing %s programmer\n", programmer_table[prog].name);
+	ret = programmer_table[prog].init();
+	if (ctx->programmer_param && strlen(ctx->programmer_param)) {
 		if (ret != 0) {
 			/* It is quite possible that any unhandled programmer parameter would have been valid,
 			 * but an error in actual programmer init happened before the parameter was evaluated.
 			 */
 			msg_pwarn("Unhandled programmer parameters (possibly due to another failure): %s\n",
-				  programmer_param);
+				  ctx->programmer_param);
 		} else {
 			/* Actual programmer init was successful, but the user specified an invalid or unusable
 			 * (for the current programmer configuration) parameter.
 			 */
-			msg_perr("Unhandled programmer parameters: %s\n", programmer_param);
+			msg_perr("Unhandled programmer parameters: %s\n", ctx->programmer_param);
 			msg_perr("Aborting.\n");
 			ret = ERROR_FATAL;
 		}
@@ -505,26 +544,34 @@ int programmer_init(enum programmer prog, const char *param)
  * require a call to programmer_init() (afterwards).
  *
  * @return The OR-ed result values of all shutdown functions (i.e. 0 on success). */
-int programmer_shutdown(void)
+int programmer_shutdown(struct flashrom_context *ctx)
 {
 	int ret = 0;
 
 	/* Registering shutdown functions is no longer allowed. */
-	may_register_shutdown = 0;
-	while (shutdown_fn_count > 0) {
-		int i = --shutdown_fn_count;
-		ret |= shutdown_fn[i].func(shutdown_fn[i].data);
+	ctx->may_register_shutdown = 0;
+	while (ctx->shutdown_fn_count > 0) {
+		int i = --ctx->shutdown_fn_count;
+		ret |= ctx->shutdown_fn[i].func(ctx->shutdown_fn[i].data);
 	}
 
-	programmer_param = NULL;
-	registered_master_count = 0;
+	ctx->programmer_param = NULL;
+	ctx->registered_master_count = 0;
+	if (active_ctx == ctx)
+		active_ctx = NULL;
 
 	return ret;
 }
 
 void *programmer_map_flash_region(const char *descr, uintptr_t phys_addr, size_t len)
 {
-	void *ret = programmer_table[programmer].map_flash_region(descr, phys_addr, len);
+	void *ret;
+
+	/* Without an initialized programmer there is nothing to map through. */
+	if (!active_ctx)
+		ret = fallback_map(descr, phys_addr, len);
+	else
+		ret = programmer_table[active_ctx->programmer].map_flash_region(descr, phys_addr, len);
 	msg_gspew("%s: mapping %s from 0x%0*" PRIxPTR " to 0x%0*" PRIxPTR "\n",
 		  __func__, descr, PRIxPTR_WIDTH, phys_addr, PRIxPTR_WIDTH, (uintptr_t) ret);
 	return ret;
@@ -532,7 +579,10 @@ void *programmer_map_flash_region(const char *descr, uintptr_t phys_addr, size_t
 
 void programmer_unmap_flash_region(void *virt_addr, size_t len)
 {
-	programmer_table[programmer].unmap_flash_region(virt_addr, len);
+	if (!active_ctx)
+		fallback_unmap(virt_addr, len);
+	else
+		programmer_table[active_ctx->programmer].unmap_flash_region(virt_addr, len);
 	msg_gspew("%s: unmapped 0x%0*" PRIxPTR "\n", __func__, PRIxPTR_WIDTH, (uintptr_t)virt_addr);
 }
 
@@ -579,8 +629,12 @@ void chip_readn(const struct flashctx *flash, uint8_t *buf, chipaddr addr,
 
 void programmer_delay(unsigned int usecs)
 {
-	if (usecs > 0)
-		programmer_table[programmer].delay(usecs);
+	if (usecs == 0)
+		return;
+	if (active_ctx)
+		programmer_table[active_ctx->programmer].delay(usecs);
+	else
+		internal_delay(usecs);
 }
 
 int read_memmapped(struct flashctx *flash, uint8_t *buf, unsigned int start,
@@ -655,7 +709,9 @@ char *extract_param(const char *const *haystack, const char *needle, const char
 
 char *extract_programmer_param(const char *param_name)
 {
-	return extract_param(&programmer_param, param_name, ",");
+	if (!active_ctx)
+		return NULL;
+	return extract_param(&active_ctx->programmer_param, param_name, ",");
 }
 
 /* Returns the number of well-defined erasers for a chip. */
@@ -753,6 +809,54 @@ out_free:
 	return ret;
 }
 
+/**
+ * @brief compare randomly chosen blocks of the chip against an image that is supposed to match it
+ *
+ * This is a cheap plausibility check of a known image against the chip: reading a handful of blocks instead of
+ * the whole chip catches a different or modified part with high probability.
+ *
+ * @flash	the flash chip to be checked
+ * @image	buffer containing the expected contents of the whole chip
+ * @count	number of blocks to compare
+ * @blocksize	size of each block
+ * @return	0 if all blocks match, 1 if any of them differs or can not be read
+ */
+int sample_range(struct flashctx *flash, const uint8_t *image, unsigned int count, unsigned int blocksize)
+{
+	static int seeded = 0;
+	unsigned int size = flash->chip->total_size * 1024;
+	unsigned int len = min(size, blocksize);
+	unsigned int blocks = size / len;
+	unsigned int i, start;
+	int ret = 0;
+
+	uint8_t *readbuf = malloc(len);
+	if (!readbuf) {
+		msg_gerr("Could not allocate memory!\n");
+		return 1;
+	}
+	if (!seeded) {
+		srand(time(NULL));
+		seeded = 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		start = (rand() % blocks) * len;
+		if (flash->chip->read(flash, readbuf, start, len)) {
+			msg_cdbg("Reading 0x%06x-0x%06x failed.\n", start, start + len - 1);
+			ret = 1;
+			break;
+		}
+		if (memcmp(readbuf, image + start, len)) {
+			msg_cdbg("Contents of 0x%06x-0x%06x differ.\n", start, start + len - 1);
+			ret = 1;
+			break;
+		}
+	}
+	free(readbuf);
+	return ret;
+}
+
 /* Helper function for need_erase() that focuses on granularities of gran bytes. */
 static int need_erase_gran_bytes(const uint8_t *have, const uint8_t *want, unsigned int len, unsigned int gran)
 {
@@ -859,7 +963,7 @@ int need_erase(const uint8_t *have, const uint8_t *want, unsigned int len, enum
  * in relation to the max write length of the programmer and the max write
  * length of the chip.
  */
-static unsigned int get_next_write(const uint8_t *have, const uint8_t *want, unsigned int len,
+unsigned int get_next_write(const uint8_t *have, const uint8_t *want, unsigned int len,
 			  unsigned int *first_start,
 			  enum write_granularity gran)
 {
@@ -1160,7 +1264,8 @@ int map_flash(struct flashctx *flash)
 	return 0;
 }
 
-int probe_flash(struct registered_master *mst, int startchip, struct flashctx *flash, int force)
+int probe_flash(struct flashrom_context *ctx, struct registered_master *mst, int startchip, struct flashctx *flash,
+		int force)
 {
 	const struct flashchip *chip;
 	enum chipbustype buses_common;
@@ -1186,6 +1291,7 @@ int probe_flash(struct registered_master *mst, int startchip, struct flashctx *f
 		}
 		memcpy(flash->chip, chip, sizeof(struct flashchip));
 		flash->mst = mst;
+		flash->ctx = ctx;
 
 		if (map_flash(flash) != 0)
 			return -1;
@@ -1251,12 +1357,12 @@ notfound:
 		  flash->chip->vendor, flash->chip->name, flash->chip->total_size, tmp);
 	free(tmp);
 #if CONFIG_INTERNAL == 1
-	if (programmer_table[programmer].map_flash_region == physmap)
+	if (programmer_table[ctx->programmer].map_flash_region == physmap)
 		msg_cinfo("mapped at physical address 0x%0*" PRIxPTR ".\n",
 			  PRIxPTR_WIDTH, flash->physical_memory);
 	else
 #endif
-		msg_cinfo("on %s.\n", programmer_table[programmer].name);
+		msg_cinfo("on %s.\n", programmer_table[ctx->programmer].name);
 
 	/* Flash registers may more likely not be mapped if the chip was forced.
 	 * Lock info may be stored in registers, so avoid lock info printing. */
@@ -1271,132 +1377,680 @@ notfound:
 	return chip - flashchips;
 }
 
-int read_buf_from_file(unsigned char *buf, unsigned long size,
-		       const char *filename)
+/*
+ * In sparse mode, image files do not store file system blocks which are completely erased (0xff) but leave holes
+ * in their place, which saves space and copy time for mostly empty images. A hole by itself reads as 0x00 and
+ * tools like truncate create holes which are meant to be just that, so the image data is followed by a trailer
+ * which lists the holes and the byte they stand for:
+ *
+ *   fill 0xff
+ *   hole <start> <len>
+ *   ...
+ *   flashrom-sparse 1 size <size>
+ *
+ * The last line has a fixed length, so it can be found from the end of the file. Files without it are rejected
+ * in sparse mode. Where the file system stored a hole as data anyway, the trailer still says what it stands for.
+ */
+#define SPARSE_MAGIC		"flashrom-sparse 1"
+#define SPARSE_FOOTER_FMT	SPARSE_MAGIC " size 0x%08lx\n"
+#define SPARSE_FOOTER_LEN	(sizeof(SPARSE_MAGIC) - 1 + sizeof(" size 0x") - 1 + 8 + 1)
+#define SPARSE_BLOCK_SIZE	4096
+#define SPARSE_FILL		0xff
+
+static bool sparse_images = false;
+
+int set_sparse_images(bool enable)
+{
+#ifdef __LIBPAYLOAD__
+	if (enable) {
+		msg_gerr("Error: Sparse image files are not supported on this platform.\n");
+		return 1;
+	}
+#endif
+	sparse_images = enable;
+	return 0;
+}
+
+#ifndef __LIBPAYLOAD__
+static bool is_erased(const unsigned char *buf, unsigned long len)
+{
+	while (len--)
+		if (*buf++ != SPARSE_FILL)
+			return false;
+	return true;
+}
+
+/* Parses the trailer of a sparse image. Sets *size to the size of the image data and, unless buf is NULL, fills
+ * the holes listed in the trailer in the *size bytes at buf. Returns 0 on success.
+ */
+static int sparse_trailer(FILE *image, const char *filename, unsigned long *size, unsigned char *buf)
+{
+	char footer[SPARSE_FOOTER_LEN + 1], line[64];
+	unsigned long filesize, start, len;
+	unsigned int fill = 0x100;
+	struct stat image_stat;
+
+	if (fstat(fileno(image), &image_stat) || image_stat.st_size < SPARSE_FOOTER_LEN)
+		goto invalid;
+	filesize = image_stat.st_size - SPARSE_FOOTER_LEN;
+	if (fseek(image, filesize, SEEK_SET) || fread(footer, 1, SPARSE_FOOTER_LEN, image) != SPARSE_FOOTER_LEN)
+		goto invalid;
+	footer[SPARSE_FOOTER_LEN] = '\0';
+	if (strncmp(footer, SPARSE_MAGIC " size 0x", SPARSE_FOOTER_LEN - 9) ||
+	    footer[SPARSE_FOOTER_LEN - 1] != '\n' || sscanf(footer + SPARSE_FOOTER_LEN - 9, "%8lx", size) != 1 ||
+	    *size > filesize)
+		goto invalid;
+	if (!buf)
+		return 0;
+
+	if (fseek(image, *size, SEEK_SET))
+		goto invalid;
+	while ((unsigned long)ftell(image) < filesize) {
+		if (!fgets(line, sizeof(line), image) || !strchr(line, '\n'))
+			goto invalid;
+		if (sscanf(line, "fill 0x%x", &fill) == 1 && fill <= 0xff)
+			continue;
+		if (sscanf(line, "hole 0x%lx 0x%lx", &start, &len) != 2 || fill > 0xff || start > *size ||
+		    len > *size - start)
+			goto invalid;
+		memset(buf + start, fill, len);
+	}
+	return 0;
+invalid:
+	msg_gerr("Error: \"%s\" is not a sparse image written by flashrom --sparse.\n", filename);
+	return 1;
+}
+
+/* Sets *size to the size of the image in the open file image. */
+static int image_file_size(FILE *image, const char *filename, bool sparse, unsigned long *size)
+{
+	struct stat image_stat;
+	int ret;
+
+	if (sparse) {
+		ret = sparse_trailer(image, filename, size, NULL);
+		rewind(image);
+		return ret;
+	}
+	if (fstat(fileno(image), &image_stat) != 0) {
+		msg_gerr("Error: getting metadata of file \"%s\" failed: %s\n", filename, strerror(errno));
+		return 1;
+	}
+	*size = image_stat.st_size;
+	return 0;
+}
+
+/* Reads the size bytes of the image in the open file image into buf. */
+static int read_image_contents(FILE *image, const char *filename, unsigned char *buf, unsigned long size,
+			       bool sparse)
+{
+	unsigned long numbytes = fread(buf, 1, size, image);
+
+	if (numbytes != size) {
+		msg_gerr("Error: Failed to read complete file. Got %ld bytes, "
+			 "wanted %ld!\n", numbytes, size);
+		return 1;
+	}
+	if (sparse)
+		return sparse_trailer(image, filename, &numbytes, buf);
+	return 0;
+}
+#endif
+
+/* Sets *size to the size of the image in filename, without a sparse trailer. */
+int get_image_file_size(const char *filename, unsigned long *size)
 {
 #ifdef __LIBPAYLOAD__
 	msg_gerr("Error: No file I/O support in libpayload\n");
 	return 1;
 #else
-	int ret = 0;
-
 	FILE *image;
+	int ret;
+
 	if ((image = fopen(filename, "rb")) == NULL) {
 		msg_gerr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
 		return 1;
 	}
+	ret = image_file_size(image, filename, sparse_images, size);
+	(void)fclose(image);
+	return ret;
+#endif
+}
 
-	struct stat image_stat;
-	if (fstat(fileno(image), &image_stat) != 0) {
-		msg_gerr("Error: getting metadata of file \"%s\" failed: %s\n", filename, strerror(errno));
-		ret = 1;
-		goto out;
+/* Contents of an image file read by preload_image_file(). */
+static unsigned char *preloaded_image = NULL;
+static unsigned long preloaded_image_size = 0;
+static char *preloaded_image_name = NULL;
+
+/* Reads filename into memory once so that later read_buf_from_file() calls for the same file are served from
+ * there. A gang member takes the buffer over with take_preloaded_image() instead, so that a forked child only
+ * gets its own copy of the pages it writes to. */
+int preload_image_file(const char *filename)
+{
+#ifdef __LIBPAYLOAD__
+	msg_gerr("Error: No file I/O support in libpayload\n");
+	return 1;
+#else
+	int ret = 1;
+
+	FILE *image;
+	if ((image = fopen(filename, "rb")) == NULL) {
+		msg_gerr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
+		return 1;
 	}
-	if (image_stat.st_size != size) {
-		msg_gerr("Error: Image size (%jd B) doesn't match the flash chip's size (%lu B)!\n",
-			 (intmax_t)image_stat.st_size, size);
-		ret = 1;
+
+	free(preloaded_image);
+	free(preloaded_image_name);
+	preloaded_image = NULL;
+	preloaded_image_name = NULL;
+	if (image_file_size(image, filename, sparse_images, &preloaded_image_size))
 		goto out;
+	preloaded_image = malloc(preloaded_image_size ? preloaded_image_size : 1);
+	preloaded_image_name = strdup(filename);
+	if (!preloaded_image || !preloaded_image_name) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
 	}
 
-	unsigned long numbytes = fread(buf, 1, size, image);
-	if (numbytes != size) {
-		msg_gerr("Error: Failed to read complete file. Got %ld bytes, "
-			 "wanted %ld!\n", numbytes, size);
-		ret = 1;
+	if (read_image_contents(image, filename, preloaded_image, preloaded_image_size, sparse_images)) {
+		free(preloaded_image);
+		preloaded_image = NULL;
+		goto out;
 	}
+	ret = 0;
 out:
 	(void)fclose(image);
 	return ret;
 #endif
 }
 
-int write_buf_to_file(const unsigned char *buf, unsigned long size, const char *filename)
+/* Hands the preloaded image of filename over to the caller, who has to free() it. Returns NULL if filename was
+ * not preloaded or its size is not size. */
+static uint8_t *take_preloaded_image(const char *filename, unsigned long size)
+{
+	uint8_t *buf;
+
+	if (!preloaded_image || strcmp(filename, preloaded_image_name) || preloaded_image_size != size)
+		return NULL;
+	buf = preloaded_image;
+	free(preloaded_image_name);
+	preloaded_image = NULL;
+	preloaded_image_name = NULL;
+	return buf;
+}
+
+static int read_file(unsigned char *buf, unsigned long size, const char *filename, bool sparse)
 {
 #ifdef __LIBPAYLOAD__
 	msg_gerr("Error: No file I/O support in libpayload\n");
 	return 1;
 #else
-	FILE *image;
+	unsigned long filesize;
 	int ret = 0;
 
+	if (preloaded_image && !strcmp(filename, preloaded_image_name)) {
+		if (preloaded_image_size != size) {
+			msg_gerr("Error: Image size (%lu B) doesn't match the flash chip's size (%lu B)!\n",
+				 preloaded_image_size, size);
+			return 1;
+		}
+		memcpy(buf, preloaded_image, size);
+		return 0;
+	}
+
+	FILE *image;
+	if ((image = fopen(filename, "rb")) == NULL) {
+		msg_gerr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
+		return 1;
+	}
+
+	if (image_file_size(image, filename, sparse, &filesize)) {
+		ret = 1;
+		goto out;
+	}
+	if (filesize != size) {
+		msg_gerr("Error: Image size (%lu B) doesn't match the flash chip's size (%lu B)!\n",
+			 filesize, size);
+		ret = 1;
+		goto out;
+	}
+
+	ret = read_image_contents(image, filename, buf, size, sparse);
+out:
+	(void)fclose(image);
+	return ret;
+#endif
+}
+
+#ifndef __LIBPAYLOAD__
+struct sparse_hole {
+	unsigned long start;
+	unsigned long len;
+};
+
+/* An image file being written sequentially, possibly one chunk at a time. */
+struct image_out {
+	FILE *file;
+	const char *name;
+	bool sparse;
+	/* Only regular files get holes, everything else is written completely, but with a trailer if sparse. */
+	bool holes_allowed;
+	struct sparse_hole *holes;
+	unsigned int hole_count;
+	unsigned int hole_alloc;
+};
+
+static int image_out_open(struct image_out *out, const char *filename, bool sparse)
+{
+	struct stat image_stat;
+
 	if (!filename) {
 		msg_gerr("No filename specified.\n");
 		return 1;
 	}
-	if ((image = fopen(filename, "wb")) == NULL) {
+	if ((out->file = fopen(filename, "wb")) == NULL) {
 		msg_gerr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
 		return 1;
 	}
+	out->name = filename;
+	out->sparse = sparse;
+	out->holes_allowed = sparse && !fstat(fileno(out->file), &image_stat) && S_ISREG(image_stat.st_mode);
+	out->holes = NULL;
+	out->hole_count = 0;
+	out->hole_alloc = 0;
+	return 0;
+}
 
-	unsigned long numbytes = fwrite(buf, 1, size, image);
-	if (numbytes != size) {
-		msg_gerr("Error: file %s could not be written completely.\n", filename);
+static void image_out_add_hole(struct image_out *out, unsigned long start, unsigned long len)
+{
+	struct sparse_hole *last = out->hole_count ? &out->holes[out->hole_count - 1] : NULL;
+
+	if (last && last->start + last->len == start) {
+		last->len += len;
+		return;
+	}
+	if (out->hole_count == out->hole_alloc) {
+		out->hole_alloc = out->hole_alloc ? out->hole_alloc * 2 : 64;
+		out->holes = realloc(out->holes, out->hole_alloc * sizeof(*out->holes));
+		if (!out->holes) {
+			msg_gerr("Out of memory!\n");
+			exit(1);
+		}
+	}
+	out->holes[out->hole_count].start = start;
+	out->holes[out->hole_count++].len = len;
+}
+
+static int image_out_write_at(struct image_out *out, const unsigned char *buf, unsigned long start,
+			      unsigned long len)
+{
+	return fseek(out->file, start, SEEK_SET) || fwrite(buf, 1, len, out->file) != len;
+}
+
+/* Writes len bytes at offset start of a sparse image, leaving erased file system blocks as holes. */
+static int image_out_write_sparse(struct image_out *out, const unsigned char *buf, unsigned long start,
+				  unsigned long len)
+{
+	unsigned long pos, end = start + len, run = start, blk;
+
+	for (pos = start; pos < end; pos += blk) {
+		blk = min(SPARSE_BLOCK_SIZE - pos % SPARSE_BLOCK_SIZE, end - pos);
+		if (blk != SPARSE_BLOCK_SIZE || !is_erased(buf + pos - start, blk))
+			continue;
+		if (run < pos && image_out_write_at(out, buf + run - start, run, pos - run))
+			return 1;
+		image_out_add_hole(out, pos, blk);
+		run = pos + blk;
+	}
+	if (run < end && image_out_write_at(out, buf + run - start, run, end - run))
+		return 1;
+	return 0;
+}
+
+/* Appends len bytes to the image; start is the offset of buf in the image. */
+static int image_out_write(struct image_out *out, const unsigned char *buf, unsigned long start, unsigned long len)
+{
+	if (out->holes_allowed)
+		return image_out_write_sparse(out, buf, start, len);
+	return fwrite(buf, 1, len, out->file) != len;
+}
+
+/* Writes the trailer of a sparse image of size bytes, see above. It also extends the file over trailing holes. */
+static int image_out_write_trailer(struct image_out *out, unsigned long size)
+{
+	unsigned long len;
+	unsigned int i;
+
+	if (out->holes_allowed && fseek(out->file, size, SEEK_SET))
+		return 1;
+	if (fprintf(out->file, "fill 0x%02x\n", SPARSE_FILL) < 0)
+		return 1;
+	for (i = 0; i < out->hole_count && out->holes[i].start < size; i++) {
+		len = out->holes[i].len;
+		if (len > size - out->holes[i].start)
+			len = size - out->holes[i].start;
+		if (fprintf(out->file, "hole 0x%lx 0x%lx\n", out->holes[i].start, len) < 0)
+			return 1;
+	}
+	return fprintf(out->file, SPARSE_FOOTER_FMT, size) < 0;
+}
+
+/* Finishes an image of size bytes (which may be less than planned if something failed) and closes it. */
+static int image_out_close(struct image_out *out, unsigned long size)
+{
+	const char *filename = out->name;
+	int ret = 0;
+
+	if (out->sparse && image_out_write_trailer(out, size)) {
+		msg_gerr("Error: writing the sparse trailer of \"%s\" failed: %s\n", filename, strerror(errno));
 		ret = 1;
-		goto out;
 	}
-	if (fflush(image)) {
+	free(out->holes);
+	if (fflush(out->file)) {
 		msg_gerr("Error: flushing file \"%s\" failed: %s\n", filename, strerror(errno));
 		ret = 1;
 	}
 	// Try to fsync() only regular files and if that function is available at all (e.g. not on MinGW).
 #if defined(_POSIX_FSYNC) && (_POSIX_FSYNC != -1)
 	struct stat image_stat;
-	if (fstat(fileno(image), &image_stat) != 0) {
+	if (fstat(fileno(out->file), &image_stat) != 0) {
 		msg_gerr("Error: getting metadata of file \"%s\" failed: %s\n", filename, strerror(errno));
 		ret = 1;
 		goto out;
 	}
 	if (S_ISREG(image_stat.st_mode)) {
-		if (fsync(fileno(image))) {
+		if (fsync(fileno(out->file))) {
 			msg_gerr("Error: fsyncing file \"%s\" failed: %s\n", filename, strerror(errno));
 			ret = 1;
 		}
 	}
-#endif
 out:
-	if (fclose(image)) {
+#endif
+	if (fclose(out->file)) {
 		msg_gerr("Error: closing file \"%s\" failed: %s\n", filename, strerror(errno));
 		ret = 1;
 	}
 	return ret;
-#endif
 }
+#endif
 
-int read_flash_to_file(struct flashctx *flash, const char *filename)
+static int write_file(const unsigned char *buf, unsigned long size, const char *filename, bool sparse)
 {
-	unsigned long size = flash->chip->total_size * 1024;
-	unsigned char *buf = calloc(size, sizeof(char));
+#ifdef __LIBPAYLOAD__
+	msg_gerr("Error: No file I/O support in libpayload\n");
+	return 1;
+#else
+	struct image_out out;
 	int ret = 0;
 
-	msg_cinfo("Reading flash... ");
-	if (!buf) {
-		msg_gerr("Memory allocation failed!\n");
-		msg_cinfo("FAILED.\n");
+	if (image_out_open(&out, filename, sparse))
 		return 1;
-	}
-	if (!flash->chip->read) {
-		msg_cerr("No read function available for this flash chip.\n");
-		ret = 1;
-		goto out_free;
-	}
-	if (flash->chip->read(flash, buf, 0, size)) {
-		msg_cerr("Read operation failed!\n");
+	if (image_out_write(&out, buf, 0, size)) {
+		msg_gerr("Error: file %s could not be written completely.\n", filename);
 		ret = 1;
-		goto out_free;
 	}
-
-	ret = write_buf_to_file(buf, size, filename);
-out_free:
-	free(buf);
-	msg_cinfo("%s.\n", ret ? "FAILED" : "done");
+	ret |= image_out_close(&out, size);
 	return ret;
+#endif
 }
 
-/* Even if an error is found, the function will keep going and check the rest. */
-static int selfcheck_eraseblocks(const struct flashchip *chip)
+int read_buf_from_file(unsigned char *buf, unsigned long size, const char *filename)
 {
-	int i, j, k;
+	return read_file(buf, size, filename, sparse_images);
+}
+
+int write_buf_to_file(const unsigned char *buf, unsigned long size, const char *filename)
+{
+	return write_file(buf, size, filename, sparse_images);
+}
+
+/* Like read_buf_from_file() and write_buf_to_file(), but never sparse. For files which are not images handled by
+ * the user, e.g. the persistent image of the dummy programmer.
+ */
+int read_buf_from_raw_file(unsigned char *buf, unsigned long size, const char *filename)
+{
+	return read_file(buf, size, filename, false);
+}
+
+int write_buf_to_raw_file(const unsigned char *buf, unsigned long size, const char *filename)
+{
+	return write_file(buf, size, filename, false);
+}
+
+/* Reads the image to be written or verified into newcontents. A region-only file is spread over the included
+ * regions and leaves the rest of newcontents alone.
+ */
+int read_image_file(struct flashctx *flash, uint8_t *newcontents, const char *filename)
+{
+	const struct flashrom_layout *layout = flash->ctx->layout;
+	unsigned int size = flash->chip->total_size * 1024;
+	unsigned int filesize, start = 0, pos = 0, rstart, rlen;
+	uint8_t *buf;
+
+	if (!flash->ctx->regions_only)
+		return read_buf_from_file(newcontents, size, filename);
+
+	filesize = included_regions_size(layout, size);
+	buf = malloc(filesize ? filesize : 1);
+	if (!buf) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	if (read_buf_from_file(buf, filesize, filename)) {
+		msg_gerr("A region-only file has to contain exactly the included regions (%u B).\n", filesize);
+		free(buf);
+		return 1;
+	}
+	while (next_included_range(layout, size, start, &rstart, &rlen)) {
+		memcpy(newcontents + rstart, buf + pos, rlen);
+		pos += rlen;
+		start = rstart + rlen;
+	}
+	free(buf);
+	return 0;
+}
+
+/* Reads the included regions of the chip (the whole chip if there are none) into the same offsets of buf. */
+static int read_included_regions(struct flashctx *flash, uint8_t *buf)
+{
+	unsigned int size = flash->chip->total_size * 1024;
+	unsigned int start = 0, rstart, rlen;
+
+	while (next_included_range(flash->ctx->layout, size, start, &rstart, &rlen)) {
+		if (flash->chip->read(flash, buf + rstart, rstart, rlen)) {
+			msg_cerr("Reading 0x%06x-0x%06x failed!\n", rstart, rstart + rlen - 1);
+			return 1;
+		}
+		start = rstart + rlen;
+	}
+	return 0;
+}
+
+/* Chunk size of streamed dumps. */
+#define STREAM_CHUNK_SIZE	(64 * 1024)
+
+/* A chunk read of a streamed dump. If the master queues asynchronous transfers natively, chips read with the
+ * generic SPI read are read with them, so that writing the previous chunk to the file overlaps with the transfer.
+ */
+struct stream_read {
+	struct spi_xfer xfer;
+	bool async;
+	bool pending;
+	int result;
+};
+
+static bool stream_read_async(const struct flashctx *flash)
+{
+	return flash->chip->read == spi_chip_read && flash->mst->spi.submit;
+}
+
+static int stream_read_start(struct flashctx *flash, struct stream_read *r, uint8_t *buf, unsigned int start,
+			     unsigned int len)
+{
+	r->pending = true;
+	r->async = stream_read_async(flash);
+	if (r->async)
+		return r->result = spi_chip_read_submit(flash, &r->xfer, buf, start, len);
+	return r->result = flash->chip->read(flash, buf, start, len);
+}
+
+static int stream_read_finish(struct flashctx *flash, struct stream_read *r)
+{
+	if (!r->pending)
+		return 0;
+	r->pending = false;
+	if (r->async && !r->result)
+		return spi_xfer_wait(flash, &r->xfer);
+	return r->result;
+}
+
+/* A chunk of a streamed dump: len bytes at addr are either read from the chip or filled as erased. */
+struct dump_chunk {
+	unsigned int addr;
+	unsigned int len;
+	bool read;
+};
+
+/* Plans the next chunk of a dump starting at *addr and advances *addr past it. Only included regions are read;
+ * the gaps between them are either filled as erased or, in a region-only file, skipped. Returns false at the end.
+ */
+static bool next_dump_chunk(const struct flashctx *flash, unsigned int chunk, unsigned int *addr,
+			    struct dump_chunk *c)
+{
+	const struct flashrom_layout *layout = flash->ctx->layout;
+	unsigned int size = flash->chip->total_size * 1024;
+	unsigned int rstart, rlen;
+
+	if (!next_included_range(layout, size, *addr, &rstart, &rlen)) {
+		if (flash->ctx->regions_only || *addr >= size)
+			return false;
+		rstart = size;
+	}
+	if (rstart > *addr && !flash->ctx->regions_only) {
+		c->addr = *addr;
+		c->len = min(chunk, rstart - *addr);
+		c->read = false;
+	} else {
+		c->addr = rstart;
+		c->len = min(chunk, rlen);
+		c->read = true;
+	}
+	*addr = c->addr + c->len;
+	return true;
+}
+
+static int stream_chunk_start(struct flashctx *flash, struct stream_read *r, uint8_t *buf,
+			      const struct dump_chunk *c)
+{
+	if (!c->read) {
+		memset(buf, 0xff, c->len);
+		r->pending = false;
+		return 0;
+	}
+	return stream_read_start(flash, r, buf, c->addr, c->len);
+}
+
+/* Reads the chip into filename one chunk at a time. If the master queues transfers natively, each chunk is
+ * written while the next one is being read into a second buffer, otherwise one buffer is read and written in
+ * turn. If reading fails, everything read so far is kept in the file.
+ */
+int read_flash_to_file(struct flashctx *flash, const char *filename)
+{
+#ifdef __LIBPAYLOAD__
+	msg_gerr("Error: No file I/O support in libpayload\n");
+	return 1;
+#else
+	unsigned long size = flash->chip->total_size * 1024;
+	unsigned int chunk = min(size, STREAM_CHUNK_SIZE);
+	struct manifest_stream *ms = NULL;
+	struct stream_read reads[2] = {{{0}}};
+	struct dump_chunk chunks[2];
+	unsigned long written = 0;
+	unsigned int addr = 0;
+	struct image_out out;
+	uint8_t *bufs[2];
+	bool async, more;
+	int cur, ret = 0;
+
+	msg_cinfo("Reading flash... ");
+	if (!flash->chip->read) {
+		msg_cerr("No read function available for this flash chip.\n");
+		msg_cinfo("FAILED.\n");
+		return 1;
+	}
+	async = stream_read_async(flash);
+	bufs[0] = malloc(chunk);
+	bufs[1] = async ? malloc(chunk) : bufs[0];
+	if (!bufs[0] || !bufs[1]) {
+		msg_gerr("Memory allocation failed!\n");
+		exit(1);
+	}
+	if (image_out_open(&out, filename, sparse_images)) {
+		ret = 1;
+		goto out_free;
+	}
+	if (flash->ctx->manifest) {
+		ms = manifest_stream_open(flash, flash->ctx->manifest, flash->ctx->manifest_sha256);
+		if (!ms)
+			ret = 1;
+	}
+
+	cur = 0;
+	more = next_dump_chunk(flash, chunk, &addr, &chunks[cur]);
+	if (!ret && more && stream_chunk_start(flash, &reads[cur], bufs[cur], &chunks[cur]))
+		ret = 1;
+	while (!ret && more) {
+		const struct dump_chunk *c = &chunks[cur];
+
+		if (stream_read_finish(flash, &reads[cur])) {
+			msg_cerr("Read operation failed at 0x%06x!\n", c->addr);
+			ret = 1;
+			break;
+		}
+		more = next_dump_chunk(flash, chunk, &addr, &chunks[!cur]);
+		if (async && more && stream_chunk_start(flash, &reads[!cur], bufs[!cur], &chunks[!cur])) {
+			msg_cerr("Read operation failed at 0x%06x!\n", chunks[!cur].addr);
+			ret = 1;
+		}
+		/* The chunk which is complete is saved even if reading the next one failed. */
+		if (image_out_write(&out, bufs[cur], written, c->len)) {
+			msg_gerr("Error: file %s could not be written completely.\n", filename);
+			ret = 1;
+			break;
+		}
+		written += c->len;
+		if (ms)
+			manifest_stream_feed(ms, bufs[cur], c->len);
+		/* Without a second buffer, the next chunk is read once this one is saved. */
+		if (!async && more && stream_chunk_start(flash, &reads[!cur], bufs[!cur], &chunks[!cur])) {
+			msg_cerr("Read operation failed at 0x%06x!\n", chunks[!cur].addr);
+			ret = 1;
+		}
+		cur = !cur;
+	}
+	/* Never leave a transfer into one of the buffers behind. */
+	stream_read_finish(flash, &reads[0]);
+	stream_read_finish(flash, &reads[1]);
+
+	if (ms && manifest_stream_close(ms))
+		ret = 1;
+	if (image_out_close(&out, written))
+		ret = 1;
+	if (ret && written)
+		msg_cerr("Saved the first %lu bytes read to %s.\n", written, filename);
+out_free:
+	if (bufs[1] != bufs[0])
+		free(bufs[1]);
+	free(bufs[0]);
+	msg_cinfo("%s.\n", ret ? "FAILED" : "done");
+	return ret;
+#endif
+}
+
+/* Even if an error is found, the function will keep going and check the rest. */
+static int selfcheck_eraseblocks(const struct flashchip *chip)
+{
+	int i, j, k;
 	int ret = 0;
 
 	for (k = 0; k < NUM_ERASEFUNCTIONS; k++) {
@@ -1470,24 +2124,36 @@ static int erase_and_write_block_helper(struct flashctx *flash,
 	unsigned int starthere = 0, lenhere = 0;
 	int ret = 0, skip = 1, writecount = 0;
 	enum write_granularity gran = flash->chip->gran;
+	enum block_state dummy_state, *state = &dummy_state;
 
+	if (flash->ctx->block_state)
+		state = &flash->ctx->block_state[flash->ctx->block_state_next++];
 	/* curcontents and newcontents are opaque to walk_eraseregions, and
 	 * need to be adjusted here to keep the impression of proper abstraction
 	 */
 	curcontents += start;
 	newcontents += start;
 	msg_cdbg(":");
-	if (need_erase(curcontents, newcontents, len, gran)) {
+	/* Blocks whose contents are unknown after an interrupted write have to be erased in any case. */
+	if (need_erase(curcontents, newcontents, len, gran) || journal_block_unknown(flash, start, len)) {
 		msg_cdbg("E");
+		journal_block_busy(flash, start, len);
+		*state = BLOCK_UNKNOWN;
 		ret = erasefn(flash, start, len);
 		if (ret)
 			return ret;
-		if (check_erased_range(flash, start, len)) {
+		while ((ret = check_erased_range(flash, start, len))) {
+			/* Maybe only the check read too fast. */
+			if (spi_speed_step_down(flash))
+				break;
+		}
+		if (ret) {
 			msg_cerr("ERASE FAILED!\n");
 			return -1;
 		}
 		/* Erase was successful. Adjust curcontents. */
 		memset(curcontents, 0xff, len);
+		*state = BLOCK_ERASED;
 		skip = 0;
 	}
 	/* get_next_write() sets starthere to a new value after the call. */
@@ -1496,6 +2162,9 @@ static int erase_and_write_block_helper(struct flashctx *flash,
 					 len - starthere, &starthere, gran))) {
 		if (!writecount++)
 			msg_cdbg("W");
+		if (skip)
+			journal_block_busy(flash, start, len);
+		*state = BLOCK_UNKNOWN;
 		/* Needs the partial write function signature. */
 		ret = flash->chip->write(flash, newcontents + starthere,
 				   start + starthere, lenhere);
@@ -1504,10 +2173,17 @@ static int erase_and_write_block_helper(struct flashctx *flash,
 		starthere += lenhere;
 		skip = 0;
 	}
-	if (skip)
+	if (writecount) {
+		/* Everything that differed has been written. Adjust curcontents. */
+		memcpy(curcontents, newcontents, len);
+		*state = BLOCK_WRITTEN;
+	}
+	if (skip) {
 		msg_cdbg("S");
-	else
-		all_skipped = false;
+	} else {
+		flash->ctx->all_skipped = false;
+		journal_block_done(flash, start, len);
+	}
 	return ret;
 }
 
@@ -1550,7 +2226,7 @@ static int walk_eraseregions(struct flashctx *flash, int erasefunction,
 	return 0;
 }
 
-static int check_block_eraser(const struct flashctx *flash, int k, int log)
+int check_block_eraser(const struct flashctx *flash, int k, int log)
 {
 	struct block_eraser eraser = flash->chip->block_erasers[k];
 
@@ -1575,6 +2251,171 @@ static int check_block_eraser(const struct flashctx *flash, int k, int log)
 	return 0;
 }
 
+/* Returns the index of the block eraser erase_and_write_flash() tries first or -1 if there is none. */
+int first_block_eraser(const struct flashctx *flash)
+{
+	int k;
+
+	for (k = 0; k < NUM_ERASEFUNCTIONS; k++) {
+		if (!check_block_eraser(flash, k, 0))
+			return k;
+	}
+	return -1;
+}
+
+/* Returns the index of the usable block eraser with the smallest erase blocks or -1 if there is none. */
+int finest_block_eraser(const struct flashctx *flash)
+{
+	unsigned int i, blocksize, bestsize = 0;
+	int k, best = -1;
+
+	for (k = 0; k < NUM_ERASEFUNCTIONS; k++) {
+		if (check_block_eraser(flash, k, 0))
+			continue;
+		blocksize = 0;
+		for (i = 0; i < NUM_ERASEREGIONS; i++)
+			blocksize = max(blocksize, flash->chip->block_erasers[k].eraseblocks[i].size);
+		if (best < 0 || blocksize < bestsize) {
+			best = k;
+			bestsize = blocksize;
+		}
+	}
+	return best;
+}
+
+unsigned int count_eraseblocks(const struct flashctx *flash, int k)
+{
+	unsigned int i, blocks = 0;
+
+	for (i = 0; i < NUM_ERASEREGIONS; i++)
+		blocks += flash->chip->block_erasers[k].eraseblocks[i].count;
+	return blocks;
+}
+
+/* Reads back the erase blocks of block eraser k which were left in an unknown state into curcontents. */
+static int reread_unknown_blocks(struct flashctx *flash, int k, uint8_t *curcontents)
+{
+	const struct block_eraser *eraser = &flash->chip->block_erasers[k];
+	unsigned int i, j, start = 0, len, block = 0;
+
+	msg_cinfo("Reading back blocks in an unknown state... ");
+	for (i = 0; i < NUM_ERASEREGIONS; i++) {
+		len = eraser->eraseblocks[i].size;
+		for (j = 0; j < eraser->eraseblocks[i].count; j++, block++, start += len) {
+			if (flash->ctx->block_state[block] != BLOCK_UNKNOWN)
+				continue;
+			msg_cdbg("0x%06x-0x%06x ", start, start + len - 1);
+			if (flash->chip->read(flash, curcontents + start, start, len))
+				return 1;
+		}
+	}
+	msg_cinfo("done. ");
+	return 0;
+}
+
+/* Start offsets of the blocks of block eraser k in ascending order, followed by the chip size. */
+static unsigned int *eraseblock_starts(const struct flashctx *flash, int k)
+{
+	const struct block_eraser *eraser = &flash->chip->block_erasers[k];
+	unsigned int i, j, start = 0, block = 0;
+	unsigned int *starts;
+
+	starts = malloc((count_eraseblocks(flash, k) + 1) * sizeof(*starts));
+	if (!starts) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	for (i = 0; i < NUM_ERASEREGIONS; i++) {
+		for (j = 0; j < eraser->eraseblocks[i].count; j++, block++) {
+			starts[block] = start;
+			start += eraser->eraseblocks[i].size;
+		}
+	}
+	starts[block] = start;
+	return starts;
+}
+
+/* Marks the erase blocks of block eraser k which overlap an included region. */
+static void map_included_blocks(const struct flashctx *flash, int k, bool *map)
+{
+	const struct block_eraser *eraser = &flash->chip->block_erasers[k];
+	unsigned int i, j, start = 0, len, block = 0;
+
+	for (i = 0; i < NUM_ERASEREGIONS; i++) {
+		len = eraser->eraseblocks[i].size;
+		for (j = 0; j < eraser->eraseblocks[i].count; j++, block++, start += len)
+			map[block] = range_is_included(flash->ctx->layout, start, len);
+	}
+}
+
+/* Returns true if every block of block eraser e which overlaps an included region lies within the blocks of
+ * block eraser k marked in map, i.e. erasing with e does not destroy anything that was not read.
+ */
+static bool eraser_within_blocks(const struct flashctx *flash, int e, int k, const bool *map)
+{
+	const struct block_eraser *eraser = &flash->chip->block_erasers[e];
+	unsigned int blocks = count_eraseblocks(flash, k), *starts = eraseblock_starts(flash, k);
+	unsigned int i, j, start = 0, len, lo, hi, mid;
+	bool fits = true;
+
+	for (i = 0; i < NUM_ERASEREGIONS && fits; i++) {
+		len = eraser->eraseblocks[i].size;
+		for (j = 0; j < eraser->eraseblocks[i].count && fits; j++, start += len) {
+			if (!range_is_included(flash->ctx->layout, start, len))
+				continue;
+			/* Find the first block of eraser k which ends after start. */
+			for (lo = 0, hi = blocks; lo < hi; ) {
+				mid = lo + (hi - lo) / 2;
+				if (starts[mid + 1] <= start)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			for (; lo < blocks && starts[lo] < start + len && fits; lo++)
+				fits = map[lo];
+		}
+	}
+	free(starts);
+	return fits;
+}
+
+/* Reads the erase blocks of block eraser k marked in map into buf, which spans the whole chip. Adjacent marked
+ * blocks are read at once.
+ */
+static int read_marked_blocks(struct flashctx *flash, int k, uint8_t *buf, const bool *map)
+{
+	unsigned int blocks = count_eraseblocks(flash, k), *starts = eraseblock_starts(flash, k);
+	unsigned int block, end;
+	int ret = 0;
+
+	for (block = 0; block < blocks && !ret; block = end) {
+		if (!map[block]) {
+			end = block + 1;
+			continue;
+		}
+		for (end = block + 1; end < blocks && map[end]; end++)
+			;
+		ret = flash->chip->read(flash, buf + starts[block], starts[block], starts[end] - starts[block]);
+		if (ret)
+			msg_cerr("Reading 0x%06x-0x%06x failed!\n", starts[block], starts[end] - 1);
+	}
+	free(starts);
+	return ret;
+}
+
+/* Reads what verify_and_repair() has to look at into buf: the whole chip or, for a write of only the included
+ * regions, the blocks of the finest block eraser k it may have touched. newcontents is taken for the rest.
+ */
+static int read_for_verify(struct flashctx *flash, int k, uint8_t *buf, const uint8_t *newcontents)
+{
+	unsigned long size = flash->chip->total_size * 1024;
+
+	if (!flash->ctx->included_blocks)
+		return flash->chip->read(flash, buf, 0, size);
+	memcpy(buf, newcontents, size);
+	return read_marked_blocks(flash, k, buf, flash->ctx->included_blocks);
+}
+
 int erase_and_write_flash(struct flashctx *flash, uint8_t *oldcontents, uint8_t *newcontents)
 {
 	int k, ret = 1;
@@ -1582,6 +2423,7 @@ int erase_and_write_flash(struct flashctx *flash, uint8_t *oldcontents, uint8_t
 	unsigned long size = flash->chip->total_size * 1024;
 	unsigned int usable_erasefunctions = count_usable_erasers(flash);
 
+	flash->ctx->all_skipped = true;
 	msg_cinfo("Erasing and writing flash chip... ");
 	curcontents = malloc(size);
 	if (!curcontents) {
@@ -1602,30 +2444,44 @@ int erase_and_write_flash(struct flashctx *flash, uint8_t *oldcontents, uint8_t
 		if (check_block_eraser(flash, k, 1))
 			continue;
 		usable_erasefunctions--;
+		/* If only the blocks around the included regions were read, erasing beyond them would destroy the
+		 * rest of the chip.
+		 */
+		if (flash->ctx->included_blocks &&
+		    !eraser_within_blocks(flash, k, finest_block_eraser(flash), flash->ctx->included_blocks)) {
+			msg_cdbg("its blocks reach beyond the blocks read, skipping.\n");
+			continue;
+		}
+		flash->ctx->block_state = calloc(count_eraseblocks(flash, k), sizeof(*flash->ctx->block_state));
+		if (!flash->ctx->block_state) {
+			msg_gerr("Out of memory!\n");
+			exit(1);
+		}
+		flash->ctx->block_state_next = 0;
 		ret = walk_eraseregions(flash, k, &erase_and_write_block_helper,
 					curcontents, newcontents);
-		/* If everything is OK, don't try another erase function. */
-		if (!ret)
-			break;
 		/* Write/erase failed, so try to find out what the current chip
 		 * contents are. If no usable erase functions remain, we can
 		 * skip this: the next iteration will break immediately anyway.
+		 * Only the blocks in an unknown state have to be read back,
+		 * curcontents is accurate for all others and the next erase
+		 * function will skip the blocks which are already correct.
 		 */
-		if (!usable_erasefunctions)
-			continue;
-		/* Reading the whole chip may take a while, inform the user even
-		 * in non-verbose mode.
-		 */
-		msg_cinfo("Reading current flash chip contents... ");
-		if (flash->chip->read(flash, curcontents, 0, size)) {
+		if (ret && usable_erasefunctions && reread_unknown_blocks(flash, k, curcontents)) {
 			/* Now we are truly screwed. Read failed as well. */
 			msg_cerr("Can't read anymore! Aborting.\n");
 			/* We have no idea about the flash chip contents, so
 			 * retrying with another erase function is pointless.
 			 */
+			free(flash->ctx->block_state);
+			flash->ctx->block_state = NULL;
 			break;
 		}
-		msg_cinfo("done. ");
+		free(flash->ctx->block_state);
+		flash->ctx->block_state = NULL;
+		/* If everything is OK, don't try another erase function. */
+		if (!ret)
+			break;
 	}
 	/* Free the scratchpad. */
 	free(curcontents);
@@ -1633,18 +2489,142 @@ int erase_and_write_flash(struct flashctx *flash, uint8_t *oldcontents, uint8_t
 	if (ret) {
 		msg_cerr("FAILED!\n");
 	} else {
-		if (all_skipped)
+		if (flash->ctx->all_skipped)
 			msg_cinfo("\nWarning: Chip content is identical to the requested image.\n");
 		msg_cinfo("Erase/write done.\n");
 	}
 	return ret;
 }
 
-static void nonfatal_help_message(void)
+/* Compares wantbuf and havebuf erase block by erase block using the layout of the finest block eraser k and sets
+ * map[n] if block n differs. Blocks outside flash->ctx->included_blocks are not compared, a write of the included
+ * regions does not touch them. Returns the number of mismatching blocks.
+ */
+static unsigned int map_mismatches(const struct flashctx *flash, int k, const uint8_t *wantbuf,
+				   const uint8_t *havebuf, bool *map)
+{
+	const struct block_eraser *eraser = &flash->chip->block_erasers[k];
+	const bool *included = flash->ctx->included_blocks;
+	unsigned int i, j, start = 0, len, block = 0, bad = 0;
+
+	for (i = 0; i < NUM_ERASEREGIONS; i++) {
+		len = eraser->eraseblocks[i].size;
+		for (j = 0; j < eraser->eraseblocks[i].count; j++, block++) {
+			map[block] = (!included || included[block]) &&
+				     memcmp(wantbuf + start, havebuf + start, len) != 0;
+			if (map[block])
+				bad++;
+			start += len;
+		}
+	}
+	return bad;
+}
+
+/* Erases and writes the blocks of block eraser k marked in map again and re-reads them into curcontents.
+ * Returns -1 if reading failed, 1 if an erase or write failed and 0 otherwise.
+ */
+static int repair_blocks(struct flashctx *flash, int k, uint8_t *curcontents, uint8_t *newcontents,
+			 const bool *map)
+{
+	const struct block_eraser *eraser = &flash->chip->block_erasers[k];
+	unsigned int i, j, start = 0, len, block = 0;
+	int ret = 0;
+
+	for (i = 0; i < NUM_ERASEREGIONS; i++) {
+		len = eraser->eraseblocks[i].size;
+		for (j = 0; j < eraser->eraseblocks[i].count; j++, block++, start += len) {
+			if (!map[block])
+				continue;
+			msg_cdbg("0x%06x-0x%06x", start, start + len - 1);
+			/* A failed erase or write leaves the block marked, the next round will try it again. */
+			if (erase_and_write_block_helper(flash, start, len, curcontents, newcontents,
+							 eraser->block_erase))
+				ret = 1;
+			msg_cdbg(" ");
+			if (flash->chip->read(flash, curcontents + start, start, len)) {
+				msg_cerr("Can't read anymore!\n");
+				return -1;
+			}
+		}
+	}
+	msg_cdbg("\n");
+	return ret;
+}
+
+/* Verifies the whole chip, or only the blocks in flash->ctx->included_blocks, against newcontents. Erase blocks
+ * which differ are erased and written again up to REPAIR_RETRIES times, after each round only the repaired
+ * blocks are verified again.
+ */
+static int verify_and_repair(struct flashctx *flash, uint8_t *newcontents)
+{
+	unsigned long size = flash->chip->total_size * 1024;
+	unsigned int bad, blocks;
+	int i, k, mismatch, failed = 0, ret = 1;
+	uint8_t *curcontents;
+	bool *map;
+
+	curcontents = malloc(size);
+	if (!curcontents) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	k = finest_block_eraser(flash);
+	if (read_for_verify(flash, k, curcontents, newcontents)) {
+		msg_cerr("Verification impossible because read failed.\n");
+		goto out_free;
+	}
+	/* A mismatch may come from reading with a tuned SPI clock which is too fast rather than from the write
+	 * itself, hence the clock is lowered and the chip read again first.
+	 */
+	while ((mismatch = memcmp(newcontents, curcontents, size) != 0) && !spi_speed_step_down(flash)) {
+		msg_cinfo("Verifying again... ");
+		if (read_for_verify(flash, k, curcontents, newcontents)) {
+			msg_cerr("Verification impossible because read failed.\n");
+			goto out_free;
+		}
+	}
+	if (!mismatch) {
+		ret = 0;
+		goto out_free;
+	}
+
+	if (k < 0) {
+		compare_range(newcontents, curcontents, 0, size);
+		goto out_free;
+	}
+	blocks = count_eraseblocks(flash, k);
+	map = calloc(blocks, sizeof(*map));
+	if (!map) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	bad = map_mismatches(flash, k, newcontents, curcontents, map);
+	for (i = 1; i <= REPAIR_RETRIES && bad; i++) {
+		msg_cinfo("Repairing %u erase block%s (attempt %i of %i)... ", bad, bad == 1 ? "" : "s",
+			  i, REPAIR_RETRIES);
+		failed = repair_blocks(flash, k, curcontents, newcontents, map);
+		if (failed < 0)
+			break;
+		/* Only the repaired blocks were read again, the others are known to be good. */
+		bad = map_mismatches(flash, k, newcontents, curcontents, map);
+		msg_cinfo("%s\n", bad || failed ? "FAILED." : "done.");
+	}
+	if (!bad && !failed)
+		ret = 0;
+	else if (failed >= 0)
+		/* Show what is still wrong. */
+		compare_range(newcontents, curcontents, 0, size);
+	free(map);
+out_free:
+	free(curcontents);
+	return ret;
+}
+
+static void nonfatal_help_message(const struct flashctx *flash)
 {
 	msg_gerr("Good, writing to the flash chip apparently didn't do anything.\n");
 #if CONFIG_INTERNAL == 1
-	if (programmer == PROGRAMMER_INTERNAL)
+	if (flash->ctx->programmer == PROGRAMMER_INTERNAL)
 		msg_gerr("This means we have to add special support for your board, programmer or flash\n"
 			 "chip. Please report this on IRC at chat.freenode.net (channel #flashrom) or\n"
 			 "mail flashrom@flashrom.org, thanks!\n"
@@ -1658,11 +2638,11 @@ static void nonfatal_help_message(void)
 			 "mail flashrom@flashrom.org, thanks!\n");
 }
 
-static void emergency_help_message(void)
+static void emergency_help_message(const struct flashctx *flash)
 {
 	msg_gerr("Your flash chip is in an unknown state.\n");
 #if CONFIG_INTERNAL == 1
-	if (programmer == PROGRAMMER_INTERNAL)
+	if (flash->ctx->programmer == PROGRAMMER_INTERNAL)
 		msg_gerr("Get help on IRC at chat.freenode.net (channel #flashrom) or\n"
 			"mail flashrom@flashrom.org with the subject \"FAILED: <your board name>\"!\n"
 			"-------------------------------------------------------------------------------\n"
@@ -1972,11 +2952,133 @@ int chip_safety_check(const struct flashctx *flash, int force, int read_it, int
 	return 0;
 }
 
+/* Checks that an image meant for the internal programmer fits the mainboard. Returns 0 if it may be used. */
+int check_board_image(const struct flashctx *flash, uint8_t *buf, unsigned long size)
+{
+#if CONFIG_INTERNAL == 1
+	if (flash->ctx->programmer == PROGRAMMER_INTERNAL && cb_check_image(buf, size) < 0) {
+		if (force_boardmismatch) {
+			msg_pinfo("Proceeding anyway because user forced us to.\n");
+		} else {
+			msg_perr("Aborting. You can override this with "
+				 "-p internal:boardmismatch=force.\n");
+			return 1;
+		}
+	}
+#endif
+	return 0;
+}
+
+/* Builds the image to be written from newcontents and the layout, then erases/writes it if write_it is set
+ * and verifies the chip against it if verify_it is set. If read_all_first is set, oldcontents must hold the
+ * current chip contents. On success newcontents holds the full image that is now expected on the chip.
+ */
+int update_flash(struct flashctx *flash, int read_all_first, uint8_t *oldcontents, uint8_t *newcontents,
+		 int write_it, int verify_it)
+{
+	unsigned long size = flash->chip->total_size * 1024;
+	int ret = 0;
+
+	/* Build a new image taking the given layout into account. */
+	if (build_new_image(flash->ctx->layout, flash, read_all_first, oldcontents, newcontents)) {
+		msg_gerr("Could not prepare the data to be written, aborting.\n");
+		return 1;
+	}
+
+	// ////////////////////////////////////////////////////////////
+
+	if (write_it && erase_and_write_flash(flash, oldcontents, newcontents)) {
+		msg_cerr("Uh oh. Erase/write failed. ");
+		/* After reading only the included blocks, oldcontents does not show what the rest holds. */
+		if (read_all_first && !flash->ctx->included_blocks) {
+			msg_cerr("Checking if anything has changed.\n");
+			msg_cinfo("Reading current flash chip contents... ");
+			if (!flash->chip->read(flash, newcontents, 0, size)) {
+				msg_cinfo("done.\n");
+				if (!memcmp(oldcontents, newcontents, size)) {
+					nonfatal_help_message(flash);
+					return 1;
+				}
+				msg_cerr("Apparently at least some data has changed.\n");
+			} else
+				msg_cerr("Can't even read anymore!\n");
+			emergency_help_message(flash);
+			return 1;
+		} else
+			msg_cerr("\n");
+		emergency_help_message(flash);
+		return 1;
+	}
+
+	/* Verify only if we either did not try to write (verify operation) or actually changed something. A resumed
+	 * write may have changed everything in the interrupted run already, hence journaled writes are always
+	 * verified.
+	 */
+	if (verify_it && (!write_it || !flash->ctx->all_skipped || flash->ctx->journal)) {
+		msg_cinfo("Verifying flash... ");
+
+		if (write_it) {
+			/* Work around chips which need some time to calm down. */
+			programmer_delay(1000*1000);
+			ret = verify_and_repair(flash, newcontents);
+			/* If we tried to write, and verification now fails, we
+			 * might have an emergency situation.
+			 */
+			if (ret)
+				emergency_help_message(flash);
+		} else {
+			ret = compare_range(newcontents, oldcontents, 0, size);
+		}
+		if (!ret)
+			msg_cinfo("VERIFIED.\n");
+	}
+
+	return ret;
+}
+
+/* Loads the presumed chip contents from a reference image and checks a sample of the chip against it. Returns 0
+ * if the reference image can be used instead of reading the whole chip. A verify-only run has to look at the
+ * real chip, hence this is used for writes only.
+ */
+static int read_reference_image(struct flashctx *flash, const char *referencefile, uint8_t *oldcontents)
+{
+	unsigned long size = flash->chip->total_size * 1024;
+
+	msg_cinfo("Reading reference image... ");
+	if (read_buf_from_file(oldcontents, size, referencefile)) {
+		msg_cinfo("FAILED.\n");
+		return 1;
+	}
+	msg_cinfo("done.\nComparing a sample of the flash chip against it... ");
+	if (sample_range(flash, oldcontents, REFERENCE_SAMPLE_COUNT, REFERENCE_SAMPLE_SIZE)) {
+		msg_cinfo("mismatch!\nThe flash chip does not contain the reference image.\n");
+		return 1;
+	}
+	msg_cinfo("matches.\n");
+	return 0;
+}
+
+/* Reads the erase blocks a write of only the included regions may touch into oldcontents and records them in
+ * flash->ctx->included_blocks for the verification. Returns 0 on success.
+ */
+static int read_included_blocks(struct flashctx *flash, uint8_t *oldcontents)
+{
+	int k = finest_block_eraser(flash);
+
+	flash->ctx->included_blocks = malloc(count_eraseblocks(flash, k) * sizeof(bool));
+	if (!flash->ctx->included_blocks) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	map_included_blocks(flash, k, flash->ctx->included_blocks);
+	return read_marked_blocks(flash, k, oldcontents, flash->ctx->included_blocks);
+}
+
 /* This function signature is horrible. We need to design a better interface,
  * but right now it allows us to split off the CLI code.
  * Besides that, the function itself is a textbook example of abysmal code flow.
  */
-int doit(struct flashctx *flash, int force, const char *filename, int read_it,
+int doit(struct flashctx *flash, int force, const char *filename, const char *referencefile, int read_it,
 	 int write_it, int erase_it, int verify_it)
 {
 	uint8_t *oldcontents;
@@ -1984,13 +3086,16 @@ int doit(struct flashctx *flash, int force, const char *filename, int read_it,
 	int ret = 0;
 	unsigned long size = flash->chip->total_size * 1024;
 	int read_all_first = 1; /* FIXME: Make this configurable. */
+	const char *journal = write_it ? flash->ctx->journal : NULL;
+	int resumed = 0;
+	bool preloaded;
 
 	if (chip_safety_check(flash, force, read_it, write_it, erase_it, verify_it)) {
 		msg_cerr("Aborting.\n");
 		return 1;
 	}
 
-	if (normalize_romentries(flash)) {
+	if (normalize_romentries(flash->ctx->layout, flash)) {
 		msg_cerr("Requested regions can not be handled. Aborting.\n");
 		return 1;
 	}
@@ -2012,13 +3117,20 @@ int doit(struct flashctx *flash, int force, const char *filename, int read_it,
 	}
 	/* Assume worst case: All bits are 0. */
 	memset(oldcontents, 0x00, size);
-	newcontents = malloc(size);
+	/* A full image preloaded before forking the gang is used in place, without copying it. */
+	newcontents = NULL;
+	if ((write_it || verify_it) && !flash->ctx->regions_only)
+		newcontents = take_preloaded_image(filename, size);
+	preloaded = newcontents != NULL;
 	if (!newcontents) {
-		msg_gerr("Out of memory!\n");
-		exit(1);
+		newcontents = malloc(size);
+		if (!newcontents) {
+			msg_gerr("Out of memory!\n");
+			exit(1);
+		}
+		/* Assume best case: All bits should be 1. */
+		memset(newcontents, 0xff, size);
 	}
-	/* Assume best case: All bits should be 1. */
-	memset(newcontents, 0xff, size);
 	/* Side effect of the assumptions above: Default write action is erase
 	 * because newcontents looks like a completely erased chip, and
 	 * oldcontents being completely 0x00 means we have to erase everything
@@ -2033,30 +3145,41 @@ int doit(struct flashctx *flash, int force, const char *filename, int read_it,
 		 * knows very well that booting won't work.
 		 */
 		if (erase_and_write_flash(flash, oldcontents, newcontents)) {
-			emergency_help_message();
+			emergency_help_message(flash);
 			ret = 1;
 		}
 		goto out;
 	}
 
 	if (write_it || verify_it) {
-		if (read_buf_from_file(newcontents, size, filename)) {
+		if (!preloaded && read_image_file(flash, newcontents, filename)) {
 			ret = 1;
 			goto out;
 		}
 
-#if CONFIG_INTERNAL == 1
-		if (programmer == PROGRAMMER_INTERNAL && cb_check_image(newcontents, size) < 0) {
-			if (force_boardmismatch) {
-				msg_pinfo("Proceeding anyway because user forced us to.\n");
-			} else {
-				msg_perr("Aborting. You can override this with "
-					 "-p internal:boardmismatch=force.\n");
-				ret = 1;
-				goto out;
-			}
+		if (check_board_image(flash, newcontents, size)) {
+			ret = 1;
+			goto out;
 		}
-#endif
+	}
+
+	if (write_it && flash->ctx->run_plan) {
+		/* The plan knows what has to be done, there is no need to look at the chip first. */
+		ret = run_plan(flash, newcontents, flash->ctx->run_plan);
+		if (ret > 0)
+			goto out;
+		if (!ret && verify_it) {
+			msg_cinfo("Verifying flash... ");
+			programmer_delay(1000*1000);
+			ret = verify_and_repair(flash, newcontents);
+			if (!ret)
+				msg_cinfo("VERIFIED.\n");
+		}
+		if (ret) {
+			emergency_help_message(flash);
+			ret = 1;
+		}
+		goto out;
 	}
 
 	/* Read the whole chip to be able to check whether regions need to be
@@ -2065,71 +3188,78 @@ int doit(struct flashctx *flash, int force, const char *filename, int read_it,
 	 * preserved, but in that case we might perform unneeded erase which
 	 * takes time as well.
 	 */
-	if (read_all_first) {
-		msg_cinfo("Reading old flash chip contents... ");
-		if (flash->chip->read(flash, oldcontents, 0, size)) {
+	if (journal) {
+		ret = journal_resume(flash, journal, newcontents, oldcontents);
+		if (ret < 0) {
+			ret = 1;
+			goto out;
+		}
+		resumed = !ret;
+		ret = 0;
+	}
+	if (resumed) {
+		msg_cinfo("Resuming the interrupted write.\n");
+	} else if (referencefile && flash->ctx->plan) {
+		/* Nothing is written in a dry run, hence the reference image is taken as it is. */
+		msg_cinfo("Reading reference image... ");
+		if (read_buf_from_file(oldcontents, size, referencefile)) {
 			ret = 1;
 			msg_cinfo("FAILED.\n");
 			goto out;
 		}
+		msg_cinfo("done.\n");
+	} else if (referencefile && write_it && !read_reference_image(flash, referencefile, oldcontents)) {
+		msg_cinfo("Using the reference image as old flash chip contents.\n");
+	} else if (write_it && !journal && layout_has_included_regions(flash->ctx->layout) &&
+		   finest_block_eraser(flash) >= 0) {
+		/* Outside the blocks read, oldcontents stays zeroed and build_new_image() copies it into newcontents
+		 * as well. Both being equal there, erase_and_write_flash() leaves the rest of the chip alone.
+		 */
+		msg_cinfo("Reading the erase blocks of the included regions... ");
+		if (read_included_blocks(flash, oldcontents)) {
+			ret = 1;
+			msg_cinfo("FAILED.\n");
+			goto out;
+		}
+		msg_cinfo("done.\n");
+	} else if (!write_it && layout_has_included_regions(flash->ctx->layout)) {
+		/* Only the included regions are compared, there is no need to read anything else. */
+		msg_cinfo("Reading included regions of the flash chip... ");
+		if (read_included_regions(flash, oldcontents)) {
+			ret = 1;
+			msg_cinfo("FAILED.\n");
+			goto out;
+		}
+		msg_cinfo("done.\n");
+	} else {
+		if (read_all_first) {
+			msg_cinfo("Reading old flash chip contents... ");
+			if (flash->chip->read(flash, oldcontents, 0, size)) {
+				ret = 1;
+				msg_cinfo("FAILED.\n");
+				goto out;
+			}
+		}
+		msg_cinfo("done.\n");
 	}
-	msg_cinfo("done.\n");
 
-	/* Build a new image taking the given layout into account. */
-	if (build_new_image(flash, read_all_first, oldcontents, newcontents)) {
-		msg_gerr("Could not prepare the data to be written, aborting.\n");
-		ret = 1;
+	if (write_it && flash->ctx->plan) {
+		ret = write_plan(flash, oldcontents, newcontents, flash->ctx->plan);
 		goto out;
 	}
 
-	// ////////////////////////////////////////////////////////////
-
-	if (write_it && erase_and_write_flash(flash, oldcontents, newcontents)) {
-		msg_cerr("Uh oh. Erase/write failed. ");
-		if (read_all_first) {
-			msg_cerr("Checking if anything has changed.\n");
-			msg_cinfo("Reading current flash chip contents... ");
-			if (!flash->chip->read(flash, newcontents, 0, size)) {
-				msg_cinfo("done.\n");
-				if (!memcmp(oldcontents, newcontents, size)) {
-					nonfatal_help_message();
-					ret = 1;
-					goto out;
-				}
-				msg_cerr("Apparently at least some data has changed.\n");
-			} else
-				msg_cerr("Can't even read anymore!\n");
-			emergency_help_message();
-			ret = 1;
-			goto out;
-		} else
-			msg_cerr("\n");
-		emergency_help_message();
+	if (journal && !resumed && journal_create(flash, journal, oldcontents, newcontents)) {
 		ret = 1;
 		goto out;
 	}
 
-	/* Verify only if we either did not try to write (verify operation) or actually changed something. */
-	if (verify_it && (!write_it || !all_skipped)) {
-		msg_cinfo("Verifying flash... ");
-
-		if (write_it) {
-			/* Work around chips which need some time to calm down. */
-			programmer_delay(1000*1000);
-			ret = verify_range(flash, newcontents, 0, size);
-			/* If we tried to write, and verification now fails, we
-			 * might have an emergency situation.
-			 */
-			if (ret)
-				emergency_help_message();
-		} else {
-			ret = compare_range(newcontents, oldcontents, 0, size);
-		}
-		if (!ret)
-			msg_cinfo("VERIFIED.\n");
-	}
+	ret = update_flash(flash, read_all_first, oldcontents, newcontents, write_it, verify_it);
+	if (journal)
+		journal_close(flash, !ret);
 
 out:
+	free(flash->ctx->included_blocks);
+	flash->ctx->included_blocks = NULL;
 	free(oldcontents);
 	free(newcontents);
 	return ret;
@@ -0,0 +1,213 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * FMAP support: coreboot and other firmware images describe their layout in a flash map structure embedded in
+ * the image. Its areas are turned into layout regions, so that they can be selected with -i without a layout
+ * file. The structure (all fields little endian, packed) is
+ *
+ *   header: "__FMAP__", u8 ver_major, u8 ver_minor, u64 base, u32 size, char name[32], u16 nareas
+ *   area:   u32 offset, u32 size, char name[32], u16 flags
+ *
+ * with nareas areas following the header. The FMAP is usually placed at a well aligned offset, so candidate
+ * offsets are tried in order of decreasing alignment.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flash.h"
+
+#define FMAP_SIGNATURE		"__FMAP__"
+#define FMAP_SIGNATURE_LEN	8
+#define FMAP_VER_MAJOR		1
+#define FMAP_NAME_LEN		32
+#define FMAP_HEADER_LEN		56
+#define FMAP_AREA_LEN		42
+/* Smallest alignment tried when searching a chip before reading it completely. */
+#define FMAP_CHIP_MIN_STRIDE	4096
+
+static uint32_t fmap_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* Checks the header at hdr and returns the number of areas, or 0 if it is not a usable FMAP header. */
+static unsigned int fmap_check_header(const uint8_t *hdr)
+{
+	if (memcmp(hdr, FMAP_SIGNATURE, FMAP_SIGNATURE_LEN))
+		return 0;
+	if (hdr[8] != FMAP_VER_MAJOR) {
+		msg_gdbg("Ignoring FMAP with unsupported version %u.%u.\n", hdr[8], hdr[9]);
+		return 0;
+	}
+	return hdr[54] | hdr[55] << 8;
+}
+
+/* Adds the areas at areas to the layout. */
+static int fmap_add_areas(struct flashrom_layout *layout, const uint8_t *areas, unsigned int nareas)
+{
+	char name[FMAP_NAME_LEN + 1];
+	uint32_t offset, size;
+	unsigned int i;
+
+	for (i = 0; i < nareas; i++, areas += FMAP_AREA_LEN) {
+		offset = fmap_le32(areas);
+		size = fmap_le32(areas + 4);
+		memcpy(name, areas + 8, FMAP_NAME_LEN);
+		name[FMAP_NAME_LEN] = '\0';
+		if (!size || !name[0]) {
+			msg_gdbg("Skipping empty FMAP area \"%s\" at 0x%08x.\n", name, offset);
+			continue;
+		}
+		if (offset > FL_MAX_CHIPOFF - (size - 1)) {
+			msg_gerr("FMAP area \"%s\" exceeds the address space.\n", name);
+			return 1;
+		}
+		msg_gdbg("fmap %08x - %08x named %s\n", offset, offset + size - 1, name);
+		layout_add_entry(layout, offset, offset + size - 1, name);
+	}
+	return 0;
+}
+
+/* Returns the offset of a complete FMAP in buf or -1. */
+static long fmap_search_buffer(const uint8_t *buf, unsigned long len)
+{
+	unsigned long stride, offset;
+	unsigned int nareas;
+
+	if (len < FMAP_HEADER_LEN)
+		return -1;
+	for (stride = 1; stride < len; stride *= 2)
+		;
+	/* Offset 0 first, then the odd multiples of every stride, from the coarsest to single bytes. */
+	for (offset = 0; stride; stride /= 2, offset = stride) {
+		for (; offset <= len - FMAP_HEADER_LEN; offset += 2 * stride) {
+			if (buf[offset] != '_')
+				continue;
+			nareas = fmap_check_header(buf + offset);
+			if (nareas && (len - offset - FMAP_HEADER_LEN) / FMAP_AREA_LEN >= nareas)
+				return offset;
+		}
+	}
+	return -1;
+}
+
+static int fmap_read_from_buffer(struct flashrom_layout *layout, const uint8_t *buf, unsigned long len)
+{
+	long offset = fmap_search_buffer(buf, len);
+
+	if (offset < 0) {
+		msg_gerr("No FMAP found.\n");
+		return 1;
+	}
+	msg_gdbg("Found FMAP at 0x%06lx.\n", offset);
+	return fmap_add_areas(layout, buf + offset + FMAP_HEADER_LEN, fmap_check_header(buf + offset));
+}
+
+/* Builds layout regions from the FMAP in the image file filename. */
+int fmap_read_from_file(struct flashrom_layout *layout, const char *filename)
+{
+	unsigned long size;
+	uint8_t *buf;
+	int ret;
+
+	if (get_image_file_size(filename, &size))
+		return 1;
+	buf = malloc(size ? size : 1);
+	if (!buf) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	ret = read_buf_from_file(buf, size, filename);
+	if (!ret)
+		ret = fmap_read_from_buffer(layout, buf, size);
+	free(buf);
+	return ret;
+}
+
+/* Reads the areas of the FMAP header at offset if there is one. Returns 0 if found, -1 if not, 1 on error. */
+static int fmap_try_chip(struct flashrom_layout *layout, struct flashctx *flash, unsigned int offset)
+{
+	unsigned int size = flash->chip->total_size * 1024;
+	uint8_t hdr[FMAP_HEADER_LEN];
+	unsigned int nareas;
+	uint8_t *areas;
+	int ret;
+
+	if (flash->chip->read(flash, hdr, offset, sizeof(hdr)))
+		return 1;
+	nareas = fmap_check_header(hdr);
+	if (!nareas || (size - offset - FMAP_HEADER_LEN) / FMAP_AREA_LEN < nareas)
+		return -1;
+	msg_gdbg("Found FMAP at 0x%06x.\n", offset);
+	areas = malloc(nareas * FMAP_AREA_LEN);
+	if (!areas) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	ret = flash->chip->read(flash, areas, offset + FMAP_HEADER_LEN, nareas * FMAP_AREA_LEN);
+	if (!ret)
+		ret = fmap_add_areas(layout, areas, nareas);
+	free(areas);
+	return ret;
+}
+
+/**
+ * @brief build layout regions from the FMAP on the chip
+ *
+ * Only the headers at offsets aligned to FMAP_CHIP_MIN_STRIDE or more are read first. If none of them is an
+ * FMAP, the whole chip is read and searched.
+ *
+ * @return	0 on success
+ */
+int fmap_read_from_flash(struct flashrom_layout *layout, struct flashctx *flash)
+{
+	unsigned int size = flash->chip->total_size * 1024;
+	unsigned int stride, offset;
+	uint8_t *buf;
+	int ret;
+
+	if (!flash->chip->read) {
+		msg_cerr("No read function available for this flash chip.\n");
+		return 1;
+	}
+	msg_cinfo("Searching the chip for an FMAP... ");
+	for (stride = size, offset = 0; stride >= FMAP_CHIP_MIN_STRIDE; stride /= 2, offset = stride) {
+		for (; offset + FMAP_HEADER_LEN <= size; offset += 2 * stride) {
+			ret = fmap_try_chip(layout, flash, offset);
+			if (ret >= 0) {
+				msg_cinfo("%s.\n", ret ? "FAILED" : "done");
+				return ret;
+			}
+		}
+	}
+
+	msg_cinfo("not at an aligned offset, reading the whole chip... ");
+	buf = malloc(size);
+	if (!buf) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	ret = flash->chip->read(flash, buf, 0, size);
+	msg_cinfo("%s.\n", ret ? "FAILED" : "done");
+	if (!ret)
+		ret = fmap_read_from_buffer(layout, buf, size);
+	free(buf);
+	return ret;
+}
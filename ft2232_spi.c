@@ -156,6 +156,8 @@ static int ft2232_spi_send_command(struct flashctx *flash,
 				   unsigned int writecnt, unsigned int readcnt,
 				   const unsigned char *writearr,
 				   unsigned char *readarr);
+static int ft2232_spi_send_command_sg(struct flashctx *flash, const struct spi_command *cmd);
+static int ft2232_spi_poll_status(struct flashctx *flash, uint8_t mask, uint8_t value, unsigned int delay);
 
 static const struct spi_master spi_master_ft2232 = {
 	.type		= SPI_CONTROLLER_FT2232,
@@ -163,6 +165,8 @@ static const struct spi_master spi_master_ft2232 = {
 	.max_data_write	= 256,
 	.command	= ft2232_spi_send_command,
 	.multicommand	= default_spi_send_multicommand,
+	.command_sg	= ft2232_spi_send_command_sg,
+	.poll_status	= ft2232_spi_poll_status,
 	.read		= default_spi_read,
 	.write_256	= default_spi_write_256,
 	.write_aai	= default_spi_write_aai,
@@ -435,6 +439,22 @@ static int ft2232_spi_send_command(struct flashctx *flash,
 				   const unsigned char *writearr,
 				   unsigned char *readarr)
 {
+	const struct spi_command cmd = {
+		.writecnt	= writecnt,
+		.readcnt	= readcnt,
+		.writearr	= writearr,
+		.readarr	= readarr,
+	};
+
+	return ft2232_spi_send_command_sg(flash, &cmd);
+}
+
+/* Returns 0 upon success, a negative number upon errors. */
+static int ft2232_spi_send_command_sg(struct flashctx *flash, const struct spi_command *cmd)
+{
+	const unsigned int writecnt = spi_command_writecnt(cmd);
+	const unsigned int readcnt = cmd->readcnt;
+	unsigned char *readarr = cmd->readarr;
 	struct ftdi_context *ftdic = &ftdic_context;
 	static unsigned char *buf = NULL;
 	/* failed is special. We use bitwise ops, but it is essentially bool. */
@@ -473,7 +493,8 @@ static int ft2232_spi_send_command(struct flashctx *flash,
 		buf[i++] = MPSSE_DO_WRITE | MPSSE_WRITE_NEG;
 		buf[i++] = (writecnt - 1) & 0xff;
 		buf[i++] = ((writecnt - 1) >> 8) & 0xff;
-		memcpy(buf + i, writearr, writecnt);
+		/* Header and payload segments are gathered straight into the MPSSE buffer. */
+		spi_command_gather(cmd, buf + i);
 		i += writecnt;
 	}
 
@@ -517,4 +538,11 @@ static int ft2232_spi_send_command(struct flashctx *flash,
 	return failed ? -1 : 0;
 }
 
+/* Status reads are clocked out back to back by the MPSSE within one transaction, which avoids a USB round
+ * trip for every single status byte. */
+static int ft2232_spi_poll_status(struct flashctx *flash, uint8_t mask, uint8_t value, unsigned int delay)
+{
+	return spi_poll_status_streamed(flash, mask, value, delay, 256);
+}
+
 #endif
@@ -175,9 +175,22 @@ static int ichspi_lock = 0;
 
 static enum ich_chipset ich_generation = CHIPSET_ICH_UNKNOWN;
 uint32_t ichspi_bbar = 0;
+/* Bytes below 4 GiB decoded to the chip as set up by the chipset, 0 if unknown. */
+uint32_t ichspi_bios_decode = 0;
 
 static void *ich_spibar = NULL;
 
+/* The BIOS region, which the chipset decodes below 4 GiB if the descriptor is valid. */
+static bool ich_bios_region_valid = false;
+static uint32_t ich_bios_base, ich_bios_limit;
+
+/* Ranges of the PR registers with read protection enabled. */
+static unsigned int ich_num_read_protected;
+static struct {
+	uint32_t base;
+	uint32_t limit;
+} ich_read_protected[5];
+
 typedef struct _OPCODE {
 	uint8_t opcode;		//This commands spi opcode
 	uint8_t spi_type;	//This commands spi type
@@ -1004,6 +1017,8 @@ static int ich_spi_send_command(struct flashctx *flash, unsigned int writecnt,
 	uint8_t *data;
 	int count;
 
+	internal_mmap_note_opcode(cmd);
+
 	/* find cmd in opcodes-table */
 	opcode_index = find_opcode(curopcodes, cmd);
 	if (opcode_index == -1) {
@@ -1248,6 +1263,8 @@ static int ich_hwseq_block_erase(struct flashctx *flash, unsigned int addr,
 	uint16_t hsfc;
 	uint32_t timeout = 5000 * 1000; /* 5 s for max 64 kB */
 
+	internal_mmap_invalidate();
+
 	erase_block = ich_hwseq_get_erase_block_size(addr);
 	if (len != erase_block) {
 		msg_cerr("Erase block size for address 0x%06x is %d B, "
@@ -1339,6 +1356,8 @@ static int ich_hwseq_write(struct flashctx *flash, const uint8_t *buf, unsigned
 	uint16_t timeout = 100 * 60;
 	uint8_t block_len;
 
+	internal_mmap_invalidate();
+
 	if (addr + len > flash->chip->total_size * 1024) {
 		msg_perr("Request to write to an inaccessible memory address "
 			 "(addr=0x%x, len=%d).\n", addr, len);
@@ -1530,13 +1549,56 @@ static void ich9_set_pr(int i, int read_prot, int write_prot)
 	msg_gspew("resulted in 0x%08x.\n", mmio_readl(addr));
 }
 
+/* Returns true if [start, start + len) overlaps a read protected range. */
+static bool ich_read_is_protected(unsigned int start, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < ich_num_read_protected; i++) {
+		if (start <= ich_read_protected[i].limit &&
+		    (ich_read_protected[i].base <= start || ich_read_protected[i].base - start < len))
+			return true;
+	}
+	return false;
+}
+
+/* Reads through the memory mapped BIOS region, or the top of the chip if there is no descriptor, where possible.
+ * Only the part within the BIOS decode range of the chipset is mapped.
+ */
+static int ich_mmap_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len,
+			 int (*read)(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len))
+{
+	unsigned int size = flash->chip->total_size * 1024;
+	unsigned int bottom = 0, top = size;
+
+	if (ich_read_is_protected(start, len))
+		return read(flash, buf, start, len);
+	if (ich_bios_region_valid) {
+		bottom = min(ich_bios_base, size);
+		top = min(ich_bios_limit + 1, size);
+	}
+	if (top - bottom > ichspi_bios_decode)
+		bottom = top - ichspi_bios_decode;
+	return internal_mmap_read(flash, buf, start, len, bottom, top, read);
+}
+
+static int ich_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	return ich_mmap_read(flash, buf, start, len, default_spi_read);
+}
+
+static int ich_hwseq_mmap_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	return ich_mmap_read(flash, buf, start, len, ich_hwseq_read);
+}
+
 static const struct spi_master spi_master_ich7 = {
 	.type = SPI_CONTROLLER_ICH7,
 	.max_data_read = 64,
 	.max_data_write = 64,
 	.command = ich_spi_send_command,
 	.multicommand = ich_spi_send_multicommand,
-	.read = default_spi_read,
+	.read = ich_spi_read,
 	.write_256 = default_spi_write_256,
 	.write_aai = default_spi_write_aai,
 };
@@ -1547,7 +1609,7 @@ static const struct spi_master spi_master_ich9 = {
 	.max_data_write = 64,
 	.command = ich_spi_send_command,
 	.multicommand = ich_spi_send_multicommand,
-	.read = default_spi_read,
+	.read = ich_spi_read,
 	.write_256 = default_spi_write_256,
 	.write_aai = default_spi_write_aai,
 };
@@ -1556,7 +1618,7 @@ static const struct opaque_master opaque_master_ich_hwseq = {
 	.max_data_read = 64,
 	.max_data_write = 64,
 	.probe = ich_hwseq_probe,
-	.read = ich_hwseq_read,
+	.read = ich_hwseq_mmap_read,
 	.write = ich_hwseq_write,
 	.erase = ich_hwseq_block_erase,
 };
@@ -1579,6 +1641,8 @@ int ich_init_spi(struct pci_dev *dev, void *spibar, enum ich_chipset ich_gen)
 
 	ich_generation = ich_gen;
 	ich_spibar = spibar;
+	ich_bios_region_valid = false;
+	ich_num_read_protected = 0;
 
 	switch (ich_generation) {
 	case CHIPSET_ICH7:
@@ -1690,6 +1754,14 @@ int ich_init_spi(struct pci_dev *dev, void *spibar, enum ich_chipset ich_gen)
 			/* Handle FREGx and FRAP registers */
 			for (i = 0; i < 5; i++)
 				ich_spi_rw_restricted |= ich9_handle_frap(tmp, i);
+
+			/* The BIOS region is decoded below 4 GiB. Remember it for reading if the host may. */
+			if (ICH_BRRA(tmp) & (1 << 1)) {
+				uint32_t freg = mmio_readl(ich_spibar + ICH9_REG_FREG0 + 4);
+				ich_bios_base = ICH_FREG_BASE(freg);
+				ich_bios_limit = ICH_FREG_LIMIT(freg) | 0x0fff;
+				ich_bios_region_valid = ich_bios_base < ich_bios_limit;
+			}
 			if (ich_spi_rw_restricted)
 				msg_pwarn("Not all flash regions are freely accessible by flashrom. This is "
 					  "most likely\ndue to an active ME. Please see "
@@ -1702,6 +1774,12 @@ int ich_init_spi(struct pci_dev *dev, void *spibar, enum ich_chipset ich_gen)
 			if (!ichspi_lock)
 				ich9_set_pr(i, 0, 0);
 			ich_spi_rw_restricted |= ich9_handle_pr(i);
+			tmp = mmio_readl(ich_spibar + ICH9_REG_PR0 + i * 4);
+			if ((tmp >> PR_RP_OFF) & 1) {
+				ich_read_protected[ich_num_read_protected].base = ICH_FREG_BASE(tmp);
+				ich_read_protected[ich_num_read_protected].limit = ICH_FREG_LIMIT(tmp) | 0x0fff;
+				ich_num_read_protected++;
+			}
 		}
 
 		if (ich_spi_rw_restricted) {
@@ -1823,7 +1901,7 @@ static const struct spi_master spi_master_via = {
 	.max_data_write = 16,
 	.command = ich_spi_send_command,
 	.multicommand = ich_spi_send_multicommand,
-	.read = default_spi_read,
+	.read = ich_spi_read,
 	.write_256 = default_spi_write_256,
 	.write_aai = default_spi_write_aai,
 };
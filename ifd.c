@@ -0,0 +1,130 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Layout regions from the Intel flash descriptor (IFD) at the start of a chip or image. Only the region section
+ * is decoded, which lies within the first 4 kB, so nothing else has to be read. This is independent of
+ * ich_descriptors.c, which is only built for the internal programmer on x86, because the chip of an Intel
+ * board may just as well be written with an external programmer.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "flash.h"
+
+#define IFD_SIZE			4096
+#define IFD_SIGNATURE			0x0ff0a55a
+#define IFD_NUM_REGIONS			5
+/* Fields of FLMAP0 and FLREGx, as in ich_descriptors.h. */
+#define IFD_FRBA(flmap0)		(((flmap0) >> 12) & 0x00000ff0)
+#define IFD_FREG_BASE(flreg)		(((flreg) << 12) & 0x01fff000)
+#define IFD_FREG_LIMIT(flreg)		((((flreg) >> 4) & 0x01fff000) | 0x00000fff)
+
+/* The names used by Intel's and coreboot's tools. */
+static const char *const ifd_region_names[IFD_NUM_REGIONS] = {
+	"fd", "bios", "me", "gbe", "pd"
+};
+
+static uint32_t ifd_le32(const uint8_t *buf, unsigned int offset)
+{
+	return buf[offset] | buf[offset + 1] << 8 | buf[offset + 2] << 16 | (uint32_t)buf[offset + 3] << 24;
+}
+
+/* Adds the regions of the descriptor in the first IFD_SIZE bytes of an image held in buf to the layout. */
+static int ifd_add_regions(struct flashrom_layout *layout, const uint8_t *buf)
+{
+	unsigned int sig_offset, frba, i, found = 0;
+	uint32_t flreg, base, limit;
+
+	/* ICH8 has the signature at the very start, all later chipsets 16 bytes in. */
+	if (ifd_le32(buf, 16) == IFD_SIGNATURE)
+		sig_offset = 16;
+	else if (ifd_le32(buf, 0) == IFD_SIGNATURE)
+		sig_offset = 0;
+	else {
+		msg_gerr("No Intel flash descriptor found.\n");
+		return 1;
+	}
+	frba = IFD_FRBA(ifd_le32(buf, sig_offset + 4));
+	if (frba + IFD_NUM_REGIONS * 4 > IFD_SIZE) {
+		msg_gerr("The region section of the flash descriptor is out of bounds.\n");
+		return 1;
+	}
+
+	for (i = 0; i < IFD_NUM_REGIONS; i++) {
+		flreg = ifd_le32(buf, frba + i * 4);
+		base = IFD_FREG_BASE(flreg);
+		limit = IFD_FREG_LIMIT(flreg);
+		if (base > limit) {
+			msg_gdbg("IFD region %s is unused.\n", ifd_region_names[i]);
+			continue;
+		}
+		msg_gdbg("ifd %08x - %08x named %s\n", base, limit, ifd_region_names[i]);
+		layout_add_entry(layout, base, limit, ifd_region_names[i]);
+		found++;
+	}
+	if (!found) {
+		msg_gerr("The flash descriptor does not define any regions.\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* Builds layout regions from the flash descriptor at the start of the image file filename. */
+int ifd_read_from_file(struct flashrom_layout *layout, const char *filename)
+{
+	uint8_t buf[IFD_SIZE];
+	FILE *file;
+	size_t len;
+
+	file = fopen(filename, "rb");
+	if (!file) {
+		msg_gerr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
+		return 1;
+	}
+	len = fread(buf, 1, sizeof(buf), file);
+	fclose(file);
+	if (len != sizeof(buf)) {
+		msg_gerr("Error: \"%s\" is too small to contain a flash descriptor.\n", filename);
+		return 1;
+	}
+	return ifd_add_regions(layout, buf);
+}
+
+/* Builds layout regions from the flash descriptor on the chip. Only its first 4 kB are read. */
+int ifd_read_from_flash(struct flashrom_layout *layout, struct flashctx *flash)
+{
+	uint8_t buf[IFD_SIZE];
+
+	if (!flash->chip->read) {
+		msg_cerr("No read function available for this flash chip.\n");
+		return 1;
+	}
+	if (flash->chip->total_size * 1024 < IFD_SIZE) {
+		msg_cerr("The chip is too small to contain a flash descriptor.\n");
+		return 1;
+	}
+	msg_cinfo("Reading the flash descriptor... ");
+	if (flash->chip->read(flash, buf, 0, sizeof(buf))) {
+		msg_cinfo("FAILED.\n");
+		return 1;
+	}
+	msg_cinfo("done.\n");
+	return ifd_add_regions(layout, buf);
+}
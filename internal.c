@@ -18,12 +18,18 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#include <stdbool.h>
 #include <strings.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/time.h>
+#if HAVE_PTHREAD == 1
+#include <pthread.h>
+#endif
 #include "flash.h"
 #include "programmer.h"
 #include "hwaccess.h"
+#include "spi.h"
 
 #if NEED_PCI == 1
 struct pci_dev *pci_dev_find_filter(struct pci_filter filter)
@@ -158,6 +164,170 @@ static const struct par_master par_master_internal = {
 
 enum chipbustype internal_buses_supported = BUS_NONE;
 
+/* Logs how long the initialization step which started at *start took and restarts the clock. */
+static void internal_step_done(const char *step, struct timeval *start)
+{
+	struct timeval end;
+
+	gettimeofday(&end, NULL);
+	msg_pdbg("Internal init: %s took %ld ms.\n", step,
+		 (long)(end.tv_sec - start->tv_sec) * 1000 + (long)(end.tv_usec - start->tv_usec) / 1000);
+	*start = end;
+}
+
+/* The chipset decodes at most this much of the top of the chip just below 4 GiB. */
+#define MMAP_WINDOW_MAX		(16 * 1024 * 1024)
+
+/* Optional fast read path of the internal SPI masters, see internal_mmap_read(). */
+static struct {
+	bool enabled;		/* requested with mmap_read=yes */
+	bool stale;		/* the chip was modified, the cached mapping may hold old data */
+	const uint8_t *virt;
+	unsigned int start;	/* chip offset of the mapped window */
+	unsigned int len;
+} mmap_window;
+
+static void mmap_window_unmap(void)
+{
+	if (!mmap_window.virt)
+		return;
+	physunmap((void *)mmap_window.virt, mmap_window.len);
+	mmap_window.virt = NULL;
+}
+
+static int mmap_window_shutdown(void *data)
+{
+	mmap_window_unmap();
+	return 0;
+}
+
+/* Called by the internal SPI masters for every command sent. A program, erase or status register write makes
+ * the mapping unusable for the rest of the session, since it is cached. Probing sends all sorts of vendor
+ * specific ID opcodes, these leave it alone.
+ */
+void internal_mmap_note_opcode(uint8_t opcode)
+{
+	switch (opcode) {
+	case JEDEC_WRSR:
+	case JEDEC_BYTE_PROGRAM:
+	case JEDEC_AAI_WORD_PROGRAM:
+	case JEDEC_CE_60:
+	case JEDEC_CE_62:
+	case JEDEC_CE_C7:
+	case JEDEC_BE_50:	/* also JEDEC_EWSR */
+	case JEDEC_BE_52:
+	case JEDEC_BE_81:
+	case JEDEC_BE_C4:
+	case JEDEC_BE_D7:
+	case JEDEC_BE_D8:
+	case JEDEC_SE:
+	case JEDEC_PE:
+		internal_mmap_invalidate();
+		break;
+	default:
+		break;
+	}
+}
+
+void internal_mmap_invalidate(void)
+{
+	if (mmap_window.enabled && !mmap_window.stale)
+		msg_pdbg2("Not reading through the memory mapping anymore, the chip is being modified.\n");
+	mmap_window.stale = true;
+}
+
+/**
+ * @brief read with plain memory copies from the part of the chip the chipset decodes below 4 GiB
+ *
+ * The chip range [bottom, top) is decoded so that top - 1 lies at 4 GiB - 1, at most its upper 16 MB are
+ * mapped. It is mapped cached and read-only on first use. The parts of the request outside that window are
+ * read with read, as is everything unless mmap_read=yes was given or after the chip was modified.
+ *
+ * @return	0 on success
+ */
+int internal_mmap_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len,
+		       unsigned int bottom, unsigned int top,
+		       int (*read)(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len))
+{
+	unsigned int win_start, win_end, end = start + len, s, e;
+	void *virt;
+
+	if (!mmap_window.enabled || mmap_window.stale || bottom >= top)
+		return read(flash, buf, start, len);
+
+	win_start = top - bottom > MMAP_WINDOW_MAX ? top - MMAP_WINDOW_MAX : bottom;
+	if (!mmap_window.virt || mmap_window.start != win_start || mmap_window.len != top - win_start) {
+		mmap_window_unmap();
+		virt = physmap_ro("flash read window", (uintptr_t)(0x100000000ULL - (top - win_start)),
+				  top - win_start);
+		if (virt == ERROR_PTR) {
+			msg_pwarn("Mapping the flash chip failed, reading through the controller.\n");
+			mmap_window.enabled = false;
+			return read(flash, buf, start, len);
+		}
+		mmap_window.virt = virt;
+		mmap_window.start = win_start;
+		mmap_window.len = top - win_start;
+		msg_pdbg("Reading 0x%06x-0x%06x of the chip through the memory mapping.\n", win_start, top - 1);
+	}
+	win_end = mmap_window.start + mmap_window.len;
+
+	if (start < win_start && read(flash, buf, start, min(end, win_start) - start))
+		return 1;
+	s = max(start, win_start);
+	e = min(end, win_end);
+	if (s < e)
+		memcpy(buf + (s - start), mmap_window.virt + (s - win_start), e - s);
+	if (end > win_end) {
+		s = max(start, win_end);
+		return read(flash, buf + (s - start), s, end - s);
+	}
+	return 0;
+}
+
+struct internal_pci_scan {
+	struct timeval start;
+#if HAVE_PTHREAD == 1
+	pthread_t thread;
+	bool threaded;
+#endif
+};
+
+#if HAVE_PTHREAD == 1
+static void *internal_pci_scan_thread(void *data)
+{
+	pci_scan_bus(pacc);
+	return NULL;
+}
+#endif
+
+/* Scans the PCI bus, in the background if possible. pacc->devices must not be used before
+ * internal_pci_scan_finish() returns.
+ */
+static void internal_pci_scan_start(struct internal_pci_scan *scan)
+{
+	gettimeofday(&scan->start, NULL);
+#if HAVE_PTHREAD == 1
+	if (!pthread_create(&scan->thread, NULL, internal_pci_scan_thread, NULL)) {
+		scan->threaded = true;
+		return;
+	}
+	msg_pdbg("Could not scan the PCI bus in the background.\n");
+	scan->threaded = false;
+#endif
+	pci_scan_bus(pacc);
+}
+
+static void internal_pci_scan_finish(struct internal_pci_scan *scan)
+{
+#if HAVE_PTHREAD == 1
+	if (scan->threaded)
+		pthread_join(scan->thread, NULL);
+	scan->threaded = false;
+#endif
+	internal_step_done("PCI bus scan", &scan->start);
+}
+
 int internal_init(void)
 {
 #if defined __FLASHROM_LITTLE_ENDIAN__
@@ -170,7 +340,12 @@ int internal_init(void)
 #if IS_X86 || IS_ARM
 	const char *cb_vendor = NULL;
 	const char *cb_model = NULL;
+	int cb_ret;
 #endif
+	struct internal_pci_scan scan;
+	struct timeval start;
+	int dmi_ret = 0;
+	char *dmi_dir;
 	char *arg;
 
 	arg = extract_programmer_param("boardenable");
@@ -217,6 +392,20 @@ int internal_init(void)
 	}
 	free(arg);
 
+	arg = extract_programmer_param("mmap_read");
+	mmap_window.enabled = false;
+	if (arg && !strcmp(arg, "yes"))
+		mmap_window.enabled = true;
+	else if (arg && strcmp(arg, "no")) {
+		msg_perr("Unknown argument for mmap_read: %s\n", arg);
+		free(arg);
+		return 1;
+	}
+	free(arg);
+	mmap_window.stale = false;
+	if (mmap_window.enabled && register_shutdown(mmap_window_shutdown, NULL))
+		return 1;
+
 	arg = extract_programmer_param("mainboard");
 	if (arg && strlen(arg)) {
 		if (board_parse_parameter(arg, &board_vendor, &board_model)) {
@@ -230,8 +419,25 @@ int internal_init(void)
 	}
 	free(arg);
 
-	if (rget_io_perms())
+	dmi_dir = extract_programmer_param("dmi");
+	if (dmi_dir && !strlen(dmi_dir)) {
+		msg_perr("Missing argument for dmi.\n");
+		free(dmi_dir);
+		return 1;
+	}
+#if !IS_X86
+	/* DMI is only decoded on x86. */
+	if (dmi_dir) {
+		msg_perr("Error: The dmi parameter is only supported on x86.\n");
+		free(dmi_dir);
 		return 1;
+	}
+#endif
+
+	if (rget_io_perms()) {
+		free(dmi_dir);
+		return 1;
+	}
 
 	/* Default to Parallel/LPC/FWH flash devices. If a known host controller
 	 * is found, the host controller init routine sets the
@@ -240,8 +446,31 @@ int internal_init(void)
 	internal_buses_supported = BUS_NONSPI;
 
 	/* Initialize PCI access for flash enables */
-	if (pci_init_common() != 0)
+	if (pci_init_common_noscan() != 0) {
+		free(dmi_dir);
+		return 1;
+	}
+
+	/* The PCI bus scan and the decoding of the coreboot table and of DMI only gather information and do not
+	 * depend on each other. The bus scan is the slowest of them on machines with many devices, hence it runs
+	 * in the background while the tables are decoded. Everything below needs the results of all of them.
+	 */
+	internal_pci_scan_start(&scan);
+	gettimeofday(&start, NULL);
+#if IS_X86 || IS_ARM
+	cb_ret = cb_parse_table(&cb_vendor, &cb_model);
+	internal_step_done("coreboot table", &start);
+#endif
+#if IS_X86
+	dmi_ret = dmi_init(dmi_dir);
+	internal_step_done("DMI", &start);
+#endif
+	free(dmi_dir);
+	internal_pci_scan_finish(&scan);
+	if (dmi_ret) {
+		msg_perr("Aborting.\n");
 		return 1;
+	}
 
 	if (processor_flash_enable()) {
 		msg_perr("Processor detection/init failed.\n"
@@ -250,7 +479,7 @@ int internal_init(void)
 	}
 
 #if IS_X86 || IS_ARM
-	if ((cb_parse_table(&cb_vendor, &cb_model) == 0) && (board_vendor != NULL) && (board_model != NULL)) {
+	if ((cb_ret == 0) && (board_vendor != NULL) && (board_model != NULL)) {
 		if (strcasecmp(board_vendor, cb_vendor) || strcasecmp(board_model, cb_model)) {
 			msg_pwarn("Warning: The mainboard IDs set by -p internal:mainboard (%s:%s) do not\n"
 				  "         match the current coreboot IDs of the mainboard (%s:%s).\n",
@@ -262,14 +491,14 @@ int internal_init(void)
 	}
 #endif
 
+	gettimeofday(&start, NULL);
 #if IS_X86
-	dmi_init();
-
 	/* In case Super I/O probing would cause pretty explosions. */
 	board_handle_before_superio();
 
 	/* Probe for the Super I/O chip and fill global struct superio. */
 	probe_superio();
+	internal_step_done("Super I/O probing", &start);
 #else
 	/* FIXME: Enable cbtable searching on all non-x86 platforms supported
 	 *        by coreboot.
@@ -322,6 +551,7 @@ int internal_init(void)
 			 "will most likely fail.\n");
 	} else if (ret == ERROR_FATAL)
 		return ret;
+	internal_step_done("chipset enable", &start);
 
 #if IS_X86
 	/* Probe unconditionally for ITE Super I/O chips. This enables LPC->SPI translation on IT87* and
@@ -332,6 +562,7 @@ int internal_init(void)
 		msg_perr("Aborting to be safe.\n");
 		return 1;
 	}
+	internal_step_done("board enable", &start);
 #endif
 
 #if IS_X86 || IS_MIPS
@@ -288,6 +288,7 @@ static int it8716f_spi_send_command(struct flashctx *flash,
 	uint8_t busy, writeenc;
 	int i;
 
+	internal_mmap_note_opcode(writearr[0]);
 	do {
 		busy = INB(it8716f_flashport) & 0x80;
 	} while (busy);
@@ -370,6 +371,11 @@ static int it8716f_spi_page_program(struct flashctx *flash, const uint8_t *buf,
 	return 0;
 }
 
+static int it8716f_spi_read_chunked(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	return spi_read_chunked(flash, buf, start, len, 3);
+}
+
 /*
  * IT8716F only allows maximum of 512 kb SPI mapped to LPC memory cycles
  * Need to read this big flash using firmware cycles 3 byte at a time.
@@ -384,7 +390,9 @@ static int it8716f_spi_chip_read(struct flashctx *flash, uint8_t *buf,
 	 * via a programmer parameter for the internal programmer.
 	 */
 	if ((flash->chip->total_size * 1024 > 512 * 1024)) {
-		spi_read_chunked(flash, buf, start, len, 3);
+		unsigned int size = flash->chip->total_size * 1024;
+		/* Only the top 512 kB are decoded, they can be read through the memory mapping. */
+		return internal_mmap_read(flash, buf, start, len, size - 512 * 1024, size, it8716f_spi_read_chunked);
 	} else {
 		mmio_readn((void *)(flash->virtual_memory + start), buf, len);
 	}
@@ -0,0 +1,402 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Write journals: a text file which records the progress of a write so that an interrupted write can be
+ * resumed without reading the whole chip again. The format is
+ *
+ *   flashrom-journal 1
+ *   size <chip size in bytes>
+ *   sha256 <64 hex digits>
+ *   plan <start> <length>
+ *   ...
+ *   busy <start> <length>
+ *   done <start> <length>
+ *   ...
+ *
+ * The header identifies the image being written. The plan lists every block (of the finest usable block
+ * eraser) in which the image differs from the old chip contents. Before an erase block is erased or written it
+ * is announced with a busy line, once it is complete a done line follows. Every line is synced to disk before
+ * the chip is touched, hence after an interruption only the blocks of busy lines without a matching done line
+ * are in an unknown state. The journal is removed after a successful write.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "flash.h"
+#include "programmer.h"
+#if IS_WINDOWS
+#include <io.h>
+#define fsync _commit
+#else
+#include <unistd.h>
+#endif
+
+#define JOURNAL_MAGIC		"flashrom-journal 1"
+/* Block size of the plan if the chip has no usable block eraser. */
+#define JOURNAL_DEFAULT_BLOCK	4096
+
+struct journal_range {
+	unsigned int start;
+	unsigned int len;
+};
+
+struct journal_ranges {
+	struct journal_range *range;
+	unsigned int count;
+	unsigned int alloc;
+};
+
+/* The journal of the write in progress, kept in the context of the chip while it is open. */
+struct journal_state {
+	FILE *file;
+	const char *name;
+	int error;
+	/* Blocks which were planned but not written yet and whose contents are not known. */
+	struct journal_ranges unknown;
+};
+
+static void ranges_add(struct journal_ranges *r, unsigned int start, unsigned int len)
+{
+	if (r->count == r->alloc) {
+		r->alloc = r->alloc ? r->alloc * 2 : 64;
+		r->range = realloc(r->range, r->alloc * sizeof(*r->range));
+		if (!r->range) {
+			msg_gerr("Out of memory!\n");
+			exit(1);
+		}
+	}
+	r->range[r->count].start = start;
+	r->range[r->count].len = len;
+	r->count++;
+}
+
+static void ranges_free(struct journal_ranges *r)
+{
+	free(r->range);
+	memset(r, 0, sizeof(*r));
+}
+
+static int compare_ranges(const void *a, const void *b)
+{
+	const struct journal_range *ra = a, *rb = b;
+
+	return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+/* Sorts r and merges overlapping and adjacent ranges. */
+static void ranges_merge(struct journal_ranges *r)
+{
+	unsigned int i, n = 0;
+
+	if (!r->count)
+		return;
+	qsort(r->range, r->count, sizeof(*r->range), compare_ranges);
+	for (i = 1; i < r->count; i++) {
+		if (r->range[i].start <= r->range[n].start + r->range[n].len) {
+			r->range[n].len = max(r->range[n].start + r->range[n].len,
+					      r->range[i].start + r->range[i].len) - r->range[n].start;
+		} else {
+			r->range[++n] = r->range[i];
+		}
+	}
+	r->count = n + 1;
+}
+
+/* Returns true if [start, start + len) is covered completely by the merged ranges r. */
+static bool ranges_cover(const struct journal_ranges *r, unsigned int start, unsigned int len)
+{
+	unsigned int lo = 0, hi = r->count, mid;
+
+	/* Find the last range starting at or before start. */
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (r->range[mid].start <= start)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return r->count && r->range[lo].start <= start &&
+	       r->range[lo].start + r->range[lo].len >= start + len;
+}
+
+static bool ranges_overlap(unsigned int start1, unsigned int len1, unsigned int start2, unsigned int len2)
+{
+	return start1 < start2 + len2 && start2 < start1 + len1;
+}
+
+/* Returns the length of the block at start in the plan. */
+static unsigned int journal_block_len(const struct flashctx *flash, int eraser, unsigned int start)
+{
+	unsigned int size = flash->chip->total_size * 1024;
+	unsigned int i, j, addr = 0, len;
+
+	if (eraser < 0)
+		return min(JOURNAL_DEFAULT_BLOCK, size - start);
+	for (i = 0; i < NUM_ERASEREGIONS; i++) {
+		len = flash->chip->block_erasers[eraser].eraseblocks[i].size;
+		for (j = 0; j < flash->chip->block_erasers[eraser].eraseblocks[i].count; j++) {
+			if (start < addr + len)
+				return addr + len - start;
+			addr += len;
+		}
+	}
+	return size - start;
+}
+
+static struct journal_state *journal_alloc(void)
+{
+	struct journal_state *journal = calloc(1, sizeof(*journal));
+
+	if (!journal) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	return journal;
+}
+
+/* Appends a line to the journal and makes sure it is on disk before the chip is touched. */
+static void journal_append(struct journal_state *journal, const char *what, unsigned int start, unsigned int len)
+{
+	if (!journal || !journal->file || journal->error)
+		return;
+	if (fprintf(journal->file, "%s 0x%06x 0x%x\n", what, start, len) < 0 || fflush(journal->file) ||
+	    fsync(fileno(journal->file))) {
+		msg_gerr("Error: writing journal \"%s\" failed: %s\n", journal->name, strerror(errno));
+		msg_gerr("Continuing without a journal.\n");
+		journal->error = 1;
+	}
+}
+
+/**
+ * @brief resume an interrupted write from its journal
+ *
+ * If filename is the journal of an interrupted write of newcontents, oldcontents is set up from it instead of
+ * reading the whole chip: blocks which were already written or did not have to be written at all are assumed
+ * to hold newcontents, the blocks which were in flight are read from the chip and all other planned blocks are
+ * marked unknown, i.e. they will be erased unconditionally.
+ *
+ * @return	0 if the write is resumed, 1 if there is no matching journal and -1 if the chip could not be read
+ */
+int journal_resume(struct flashctx *flash, const char *filename, const uint8_t *newcontents, uint8_t *oldcontents)
+{
+#ifdef __LIBPAYLOAD__
+	return 1;
+#else
+	unsigned int size = flash->chip->total_size * 1024;
+	unsigned int i, j, start, len, filesize, pending = 0;
+	bool in_flight;
+	struct journal_ranges plan = {0}, done = {0}, busy = {0};
+	struct journal_state *journal;
+	char line[256], what[8], hex[65], digest[65];
+	int ret = 1;
+	FILE *file;
+
+	file = fopen(filename, "r");
+	if (!file) {
+		if (errno != ENOENT)
+			msg_gerr("Error: opening journal \"%s\" failed: %s\n", filename, strerror(errno));
+		return 1;
+	}
+	sha256_hex(newcontents, size, digest);
+	if (!fgets(line, sizeof(line), file) || strncmp(line, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC)) ||
+	    !fgets(line, sizeof(line), file) || sscanf(line, "size %u", &filesize) != 1 ||
+	    !fgets(line, sizeof(line), file) || sscanf(line, "sha256 %64s", hex) != 1 ||
+	    filesize != size || strcmp(hex, digest)) {
+		msg_cinfo("Journal \"%s\" does not belong to this image, starting over.\n", filename);
+		fclose(file);
+		return 1;
+	}
+	journal = journal_alloc();
+	/* A line cut short by the interruption simply does not parse and is ignored. */
+	while (fgets(line, sizeof(line), file)) {
+		if (!strchr(line, '\n') || sscanf(line, "%7s %x %x", what, &start, &len) != 3 || !len ||
+		    start > size || len > size - start)
+			continue;
+		if (!strcmp(what, "plan")) {
+			ranges_add(&plan, start, len);
+		} else if (!strcmp(what, "busy")) {
+			ranges_add(&busy, start, len);
+		} else if (!strcmp(what, "done")) {
+			ranges_add(&done, start, len);
+			/* Usually the block announced last, search from the end. */
+			for (i = busy.count; i-- > 0;) {
+				if (busy.range[i].start == start && busy.range[i].len == len) {
+					busy.range[i].len = 0;
+					if (i == busy.count - 1)
+						busy.count--;
+					break;
+				}
+			}
+		}
+	}
+	fclose(file);
+	ranges_merge(&done);
+
+	/* Everything not planned was equal to the image before, everything done has been written. */
+	memcpy(oldcontents, newcontents, size);
+	for (i = 0; i < plan.count; i++) {
+		start = plan.range[i].start;
+		len = plan.range[i].len;
+		if (ranges_cover(&done, start, len))
+			continue;
+		pending++;
+		in_flight = false;
+		for (j = 0; j < busy.count; j++)
+			in_flight |= busy.range[j].len && ranges_overlap(start, len, busy.range[j].start,
+									 busy.range[j].len);
+		if (!in_flight) {
+			ranges_add(&journal->unknown, start, len);
+			memset(oldcontents + start, 0xff, len);
+		}
+	}
+	msg_cinfo("Journal \"%s\": %u of %u planned blocks still to be written.\n", filename, pending, plan.count);
+	for (i = 0; i < busy.count; i++) {
+		start = busy.range[i].start;
+		len = busy.range[i].len;
+		if (!len)
+			continue;
+		msg_cinfo("Reading the block which was in flight (0x%06x-0x%06x)... ", start, start + len - 1);
+		if (flash->chip->read(flash, oldcontents + start, start, len)) {
+			msg_cinfo("FAILED.\n");
+			ret = -1;
+			goto out;
+		}
+		msg_cinfo("done.\n");
+	}
+
+	journal->file = fopen(filename, "a");
+	if (!journal->file) {
+		msg_gerr("Error: opening journal \"%s\" failed: %s\n", filename, strerror(errno));
+		ret = -1;
+		goto out;
+	}
+	journal->name = filename;
+	flash->ctx->journal_state = journal;
+	journal = NULL;
+	ret = 0;
+out:
+	if (journal) {
+		ranges_free(&journal->unknown);
+		free(journal);
+	}
+	ranges_free(&plan);
+	ranges_free(&done);
+	ranges_free(&busy);
+	return ret;
+#endif
+}
+
+/* Starts a new journal for writing newcontents over oldcontents. */
+int journal_create(struct flashctx *flash, const char *filename, const uint8_t *oldcontents,
+		   const uint8_t *newcontents)
+{
+#ifdef __LIBPAYLOAD__
+	msg_gerr("Error: No file I/O support in libpayload\n");
+	return 1;
+#else
+	unsigned int size = flash->chip->total_size * 1024;
+	int eraser = finest_block_eraser(flash);
+	struct journal_state *journal;
+	unsigned int start, len;
+	char digest[65];
+	FILE *file;
+
+	file = fopen(filename, "w");
+	if (!file) {
+		msg_gerr("Error: opening journal \"%s\" failed: %s\n", filename, strerror(errno));
+		return 1;
+	}
+	sha256_hex(newcontents, size, digest);
+	if (fprintf(file, "%s\nsize %u\nsha256 %s\n", JOURNAL_MAGIC, size, digest) < 0)
+		goto err;
+	for (start = 0; start < size; start += len) {
+		len = journal_block_len(flash, eraser, start);
+		if (memcmp(oldcontents + start, newcontents + start, len) &&
+		    fprintf(file, "plan 0x%06x 0x%x\n", start, len) < 0)
+			goto err;
+	}
+	if (fflush(file) || fsync(fileno(file)))
+		goto err;
+	journal = journal_alloc();
+	journal->file = file;
+	journal->name = filename;
+	flash->ctx->journal_state = journal;
+	return 0;
+err:
+	msg_gerr("Error: writing journal \"%s\" failed: %s\n", filename, strerror(errno));
+	fclose(file);
+	return 1;
+#endif
+}
+
+/* Called before the erase block at start is erased or written. */
+void journal_block_busy(struct flashctx *flash, unsigned int start, unsigned int len)
+{
+	journal_append(flash->ctx->journal_state, "busy", start, len);
+}
+
+/* Called after the erase block at start has been erased and written successfully. */
+void journal_block_done(struct flashctx *flash, unsigned int start, unsigned int len)
+{
+	struct journal_state *journal = flash->ctx->journal_state;
+	unsigned int i;
+
+	if (!journal)
+		return;
+	journal_append(journal, "done", start, len);
+	for (i = 0; i < journal->unknown.count; i++) {
+		if (start <= journal->unknown.range[i].start &&
+		    start + len >= journal->unknown.range[i].start + journal->unknown.range[i].len)
+			journal->unknown.range[i].len = 0;
+	}
+}
+
+/* Returns true if the contents of the erase block at start are unknown, i.e. it has to be erased. */
+bool journal_block_unknown(struct flashctx *flash, unsigned int start, unsigned int len)
+{
+	const struct journal_state *journal = flash->ctx->journal_state;
+	unsigned int i;
+
+	if (!journal)
+		return false;
+	for (i = 0; i < journal->unknown.count; i++) {
+		if (journal->unknown.range[i].len &&
+		    ranges_overlap(start, len, journal->unknown.range[i].start, journal->unknown.range[i].len))
+			return true;
+	}
+	return false;
+}
+
+/* Closes the journal. It is removed if the write completed, otherwise it is kept for resuming. */
+void journal_close(struct flashctx *flash, bool complete)
+{
+	struct journal_state *journal = flash->ctx->journal_state;
+
+	if (!journal)
+		return;
+	flash->ctx->journal_state = NULL;
+	ranges_free(&journal->unknown);
+	fclose(journal->file);
+	if (complete && remove(journal->name))
+		msg_gerr("Error: removing journal \"%s\" failed: %s\n", journal->name, strerror(errno));
+	free(journal);
+}
@@ -26,29 +26,179 @@
 #include "flash.h"
 #include "programmer.h"
 
-#define MAX_ROMLAYOUT	32
-
 typedef struct {
 	chipoff_t start;
 	chipoff_t end;
 	unsigned int included;
-	char name[256];
+	char *name;
 } romentry_t;
 
-/* rom_entries store the entries specified in a layout file and associated run-time data */
-static romentry_t rom_entries[MAX_ROMLAYOUT];
-static int num_rom_entries = 0; /* the number of successfully parsed rom_entries */
+/* A range of the chip covered by included regions. */
+struct coverage_range {
+	chipoff_t start;
+	chipoff_t end;
+};
+
+/* Open addressing hash table from names to indices. The names are owned by whoever added them. */
+struct name_slot {
+	const char *name;
+	int index;
+};
+
+struct name_index {
+	struct name_slot *slots;
+	unsigned int size; /* the number of slots, a power of two or 0 */
+	unsigned int count; /* the number of used slots */
+};
+
+struct flashrom_layout {
+	/* rom_entries store the entries specified in a layout file or FMAP and associated run-time data */
+	romentry_t *rom_entries;
+	int num_rom_entries; /* the number of successfully parsed rom_entries */
+	int alloc_rom_entries; /* the number of rom_entries allocated */
+	struct name_index entry_names; /* the first entry of every name */
+
+	/* include_args holds the arguments specified at the command line with -i. They must be processed at
+	 * some point so that desired regions are marked as "included" in the rom_entries list. */
+	char **include_args;
+	int num_include_args; /* the number of valid include_args. */
+	int alloc_include_args; /* the number of include_args allocated */
+	struct name_index include_names;
+
+	/* The union of the included regions as sorted, disjoint and non-adjacent ranges, computed once by
+	 * process_include_args() so that it can be searched in O(log n). */
+	struct coverage_range *coverage;
+	int num_coverage;
+};
+
+/* FNV-1a */
+static unsigned int name_hash(const char *name)
+{
+	unsigned int hash = 2166136261u;
 
-/* include_args holds the arguments specified at the command line with -i. They must be processed at some point
- * so that desired regions are marked as "included" in the rom_entries list. */
-static char *include_args[MAX_ROMLAYOUT];
-static int num_include_args = 0; /* the number of valid include_args. */
+	while (*name)
+		hash = (hash ^ (unsigned char)*name++) * 16777619u;
+	return hash;
+}
+
+/* Returns the index stored for name or -1. */
+static int name_index_find(const struct name_index *idx, const char *name)
+{
+	unsigned int i;
+
+	if (!idx->size)
+		return -1;
+	for (i = name_hash(name) & (idx->size - 1); idx->slots[i].name; i = (i + 1) & (idx->size - 1)) {
+		if (!strcmp(idx->slots[i].name, name))
+			return idx->slots[i].index;
+	}
+	return -1;
+}
+
+static void name_index_insert(struct name_slot *slots, unsigned int size, const char *name, int index)
+{
+	unsigned int i;
+
+	for (i = name_hash(name) & (size - 1); slots[i].name; i = (i + 1) & (size - 1))
+		;
+	slots[i].name = name;
+	slots[i].index = index;
+}
+
+/* Stores index for name, which must not be in the table yet. The table is kept at most half full. */
+static void name_index_add(struct name_index *idx, const char *name, int index)
+{
+	struct name_slot *slots;
+	unsigned int i, size;
+
+	if (2 * (idx->count + 1) > idx->size) {
+		size = idx->size ? idx->size * 2 : 64;
+		slots = calloc(size, sizeof(*slots));
+		if (!slots) {
+			msg_gerr("Out of memory!\n");
+			exit(1);
+		}
+		for (i = 0; i < idx->size; i++) {
+			if (idx->slots[i].name)
+				name_index_insert(slots, size, idx->slots[i].name, idx->slots[i].index);
+		}
+		free(idx->slots);
+		idx->slots = slots;
+		idx->size = size;
+	}
+	name_index_insert(idx->slots, idx->size, name, index);
+	idx->count++;
+}
+
+static void name_index_clear(struct name_index *idx)
+{
+	free(idx->slots);
+	idx->slots = NULL;
+	idx->size = 0;
+	idx->count = 0;
+}
+
+struct flashrom_layout *layout_new(void)
+{
+	return calloc(1, sizeof(struct flashrom_layout));
+}
+
+void layout_free(struct flashrom_layout *layout)
+{
+	if (!layout)
+		return;
+	layout_cleanup(layout);
+	free(layout->rom_entries);
+	free(layout->include_args);
+	free(layout);
+}
+
+/* Grows the array at *array holding *alloc elements of elemsize bytes so that it can hold at least count. */
+static void layout_grow(void *array, int *alloc, int count, size_t elemsize)
+{
+	void *tmp;
+	int newalloc;
+
+	if (count <= *alloc)
+		return;
+	newalloc = *alloc ? *alloc * 2 : 32;
+	tmp = realloc(*(void **)array, newalloc * elemsize);
+	if (!tmp) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	*(void **)array = tmp;
+	*alloc = newalloc;
+}
+
+/* Adds a region covering start to end (inclusive) to the layout. The name is copied. */
+void layout_add_entry(struct flashrom_layout *layout, chipoff_t start, chipoff_t end, const char *name)
+{
+	romentry_t *entry;
+
+	layout_grow(&layout->rom_entries, &layout->alloc_rom_entries, layout->num_rom_entries + 1,
+		    sizeof(*layout->rom_entries));
+	entry = &layout->rom_entries[layout->num_rom_entries];
+	entry->start = start;
+	entry->end = end;
+	entry->included = 0;
+	entry->name = strdup(name);
+	if (!entry->name) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	/* The first of several entries with the same name is the one selected with -i. */
+	if (name_index_find(&layout->entry_names, entry->name) < 0)
+		name_index_add(&layout->entry_names, entry->name, layout->num_rom_entries);
+	layout->num_rom_entries++;
+}
 
 #ifndef __LIBPAYLOAD__
-int read_romlayout(const char *name)
+int read_romlayout(struct flashrom_layout *layout, const char *name)
 {
 	FILE *romlayout;
 	char tempstr[256];
+	char namestr[256];
 	int i;
 
 	romlayout = fopen(name, "r");
@@ -62,13 +212,7 @@ int read_romlayout(const char *name)
 	while (!feof(romlayout)) {
 		char *tstr1, *tstr2;
 
-		if (num_rom_entries >= MAX_ROMLAYOUT) {
-			msg_gerr("Maximum number of ROM images (%i) in layout "
-				 "file reached.\n", MAX_ROMLAYOUT);
-			(void)fclose(romlayout);
-			return 1;
-		}
-		if (2 != fscanf(romlayout, "%255s %255s\n", tempstr, rom_entries[num_rom_entries].name))
+		if (2 != fscanf(romlayout, "%255s %255s\n", tempstr, namestr))
 			continue;
 #if 0
 		// fscanf does not like arbitrary comments like that :( later
@@ -83,16 +227,14 @@ int read_romlayout(const char *name)
 			(void)fclose(romlayout);
 			return 1;
 		}
-		rom_entries[num_rom_entries].start = strtol(tstr1, (char **)NULL, 16);
-		rom_entries[num_rom_entries].end = strtol(tstr2, (char **)NULL, 16);
-		rom_entries[num_rom_entries].included = 0;
-		num_rom_entries++;
+		layout_add_entry(layout, strtol(tstr1, (char **)NULL, 16), strtol(tstr2, (char **)NULL, 16),
+				 namestr);
 	}
 
-	for (i = 0; i < num_rom_entries; i++) {
+	for (i = 0; i < layout->num_rom_entries; i++) {
 		msg_gdbg("romlayout %08x - %08x named %s\n",
-			     rom_entries[i].start,
-			     rom_entries[i].end, rom_entries[i].name);
+			     layout->rom_entries[i].start,
+			     layout->rom_entries[i].end, layout->rom_entries[i].name);
 	}
 
 	(void)fclose(romlayout);
@@ -101,155 +243,239 @@ int read_romlayout(const char *name)
 }
 #endif
 
-/* returns the index of the entry (or a negative value if it is not found) */
-static int find_include_arg(const char *const name)
-{
-	unsigned int i;
-	for (i = 0; i < num_include_args; i++) {
-		if (!strcmp(include_args[i], name))
-			return i;
-	}
-	return -1;
-}
-
 /* register an include argument (-i) for later processing */
-int register_include_arg(char *name)
+int register_include_arg(struct flashrom_layout *layout, char *name)
 {
-	if (num_include_args >= MAX_ROMLAYOUT) {
-		msg_gerr("Too many regions included (%i).\n", num_include_args);
-		return 1;
-	}
-
 	if (name == NULL) {
 		msg_gerr("<NULL> is a bad region name.\n");
 		return 1;
 	}
 
-	if (find_include_arg(name) != -1) {
+	if (name_index_find(&layout->include_names, name) != -1) {
 		msg_gerr("Duplicate region name: \"%s\".\n", name);
 		return 1;
 	}
 
-	include_args[num_include_args] = name;
-	num_include_args++;
+	layout_grow(&layout->include_args, &layout->alloc_include_args, layout->num_include_args + 1,
+		    sizeof(*layout->include_args));
+	layout->include_args[layout->num_include_args] = name;
+	name_index_add(&layout->include_names, name, layout->num_include_args);
+	layout->num_include_args++;
 	return 0;
 }
 
 /* returns the index of the entry (or a negative value if it is not found) */
-static int find_romentry(char *name)
+static int find_romentry(struct flashrom_layout *layout, char *name)
 {
 	int i;
 
-	if (num_rom_entries == 0)
+	msg_gspew("Looking for region \"%s\"... ", name);
+	i = name_index_find(&layout->entry_names, name);
+	if (i < 0) {
+		msg_gspew("not found.\n");
 		return -1;
+	}
+	layout->rom_entries[i].included = 1;
+	msg_gspew("found.\n");
+	return i;
+}
 
-	msg_gspew("Looking for region \"%s\"... ", name);
-	for (i = 0; i < num_rom_entries; i++) {
-		if (!strcmp(rom_entries[i].name, name)) {
-			rom_entries[i].included = 1;
-			msg_gspew("found.\n");
-			return i;
+static int compare_coverage(const void *a, const void *b)
+{
+	const struct coverage_range *ra = a, *rb = b;
+
+	return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+/* Computes the union of the included regions, merging overlapping and adjacent ones. */
+static void build_coverage(struct flashrom_layout *layout)
+{
+	struct coverage_range *cov;
+	int i, n = 0;
+
+	free(layout->coverage);
+	cov = malloc((layout->num_rom_entries ? layout->num_rom_entries : 1) * sizeof(*cov));
+	if (!cov) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	for (i = 0; i < layout->num_rom_entries; i++) {
+		if (!layout->rom_entries[i].included || layout->rom_entries[i].start > layout->rom_entries[i].end)
+			continue;
+		cov[n].start = layout->rom_entries[i].start;
+		cov[n].end = layout->rom_entries[i].end;
+		n++;
+	}
+	qsort(cov, n, sizeof(*cov), compare_coverage);
+	layout->num_coverage = 0;
+	for (i = 0; i < n; i++) {
+		if (layout->num_coverage) {
+			struct coverage_range *last = &cov[layout->num_coverage - 1];
+			if (last->end == FL_MAX_CHIPOFF || cov[i].start <= last->end + 1) {
+				if (cov[i].end > last->end)
+					last->end = cov[i].end;
+				continue;
+			}
 		}
+		cov[layout->num_coverage++] = cov[i];
 	}
-	msg_gspew("not found.\n");
-	return -1;
+	layout->coverage = cov;
+	msg_gspew("The included regions cover %i range%s.\n", layout->num_coverage,
+		  layout->num_coverage == 1 ? "" : "s");
+}
+
+/* Returns the index of the first coverage range which ends at or after addr, or num_coverage if none does. */
+static int find_coverage(const struct flashrom_layout *layout, chipoff_t addr)
+{
+	int lo = 0, hi = layout->num_coverage, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (layout->coverage[mid].end < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
 }
 
 /* process -i arguments
  * returns 0 to indicate success, >0 to indicate failure
  */
-int process_include_args(void)
+int process_include_args(struct flashrom_layout *layout)
 {
 	int i;
 	unsigned int found = 0;
 
-	if (num_include_args == 0)
+	if (layout->num_include_args == 0)
 		return 0;
 
 	/* User has specified an area, but no layout file is loaded. */
-	if (num_rom_entries == 0) {
+	if (layout->num_rom_entries == 0) {
 		msg_gerr("Region requested (with -i \"%s\"), "
 			 "but no layout data is available.\n",
-			 include_args[0]);
+			 layout->include_args[0]);
 		return 1;
 	}
 
-	for (i = 0; i < num_include_args; i++) {
-		if (find_romentry(include_args[i]) < 0) {
+	for (i = 0; i < layout->num_include_args; i++) {
+		if (find_romentry(layout, layout->include_args[i]) < 0) {
 			msg_gerr("Invalid region specified: \"%s\".\n",
-				 include_args[i]);
+				 layout->include_args[i]);
 			return 1;
 		}
 		found++;
 	}
+	build_coverage(layout);
 
-	msg_ginfo("Using region%s: \"%s\"", num_include_args > 1 ? "s" : "",
-		  include_args[0]);
-	for (i = 1; i < num_include_args; i++)
-		msg_ginfo(", \"%s\"", include_args[i]);
+	msg_ginfo("Using region%s: \"%s\"", layout->num_include_args > 1 ? "s" : "",
+		  layout->include_args[0]);
+	for (i = 1; i < layout->num_include_args; i++)
+		msg_ginfo(", \"%s\"", layout->include_args[i]);
 	msg_ginfo(".\n");
 	return 0;
 }
 
-void layout_cleanup(void)
+void layout_cleanup(struct flashrom_layout *layout)
 {
 	int i;
-	for (i = 0; i < num_include_args; i++) {
-		free(include_args[i]);
-		include_args[i] = NULL;
+	for (i = 0; i < layout->num_include_args; i++) {
+		free(layout->include_args[i]);
+		layout->include_args[i] = NULL;
 	}
-	num_include_args = 0;
+	layout->num_include_args = 0;
+	name_index_clear(&layout->include_names);
 
-	for (i = 0; i < num_rom_entries; i++) {
-		rom_entries[i].included = 0;
+	for (i = 0; i < layout->num_rom_entries; i++) {
+		free(layout->rom_entries[i].name);
+		layout->rom_entries[i].name = NULL;
 	}
-	num_rom_entries = 0;
+	layout->num_rom_entries = 0;
+	name_index_clear(&layout->entry_names);
+
+	free(layout->coverage);
+	layout->coverage = NULL;
+	layout->num_coverage = 0;
 }
 
-romentry_t *get_next_included_romentry(unsigned int start)
+/* Returns true if the user asked for specific regions with -i. */
+bool layout_has_included_regions(const struct flashrom_layout *layout)
 {
+	return layout->num_include_args > 0;
+}
+
+/**
+ * Finds the first range at or after @start which is covered by included regions, merging overlapping and
+ * adjacent regions. If no regions are included, the whole chip is covered. Returns false if there is no such
+ * range, otherwise the range is returned in @rstart and @rlen.
+ */
+bool next_included_range(const struct flashrom_layout *layout, unsigned int size, unsigned int start,
+			 unsigned int *rstart, unsigned int *rlen)
+{
+	const struct coverage_range *range;
+	unsigned int end;
 	int i;
-	unsigned int best_start = UINT_MAX;
-	romentry_t *best_entry = NULL;
-	romentry_t *cur;
-
-	/* First come, first serve for overlapping regions. */
-	for (i = 0; i < num_rom_entries; i++) {
-		cur = &rom_entries[i];
-		if (!cur->included)
-			continue;
-		/* Already past the current entry? */
-		if (start > cur->end)
-			continue;
-		/* Inside the current entry? */
-		if (start >= cur->start)
-			return cur;
-		/* Entry begins after start. */
-		if (best_start > cur->start) {
-			best_start = cur->start;
-			best_entry = cur;
-		}
+
+	if (start >= size)
+		return false;
+	if (!layout_has_included_regions(layout)) {
+		*rstart = start;
+		*rlen = size - start;
+		return true;
+	}
+	i = find_coverage(layout, start);
+	if (i == layout->num_coverage || layout->coverage[i].start >= size)
+		return false;
+	range = &layout->coverage[i];
+	*rstart = max(start, range->start);
+	end = min(range->end, size - 1);
+	*rlen = end - *rstart + 1;
+	return true;
+}
+
+/* Returns true if [@start, @start + @len) overlaps an included region, or if no regions are included. Meant to
+ * be asked per erase block, it takes O(log n) for n regions.
+ */
+bool range_is_included(const struct flashrom_layout *layout, unsigned int start, unsigned int len)
+{
+	int i;
+
+	if (!layout_has_included_regions(layout))
+		return true;
+	i = find_coverage(layout, start);
+	return i < layout->num_coverage &&
+	       (layout->coverage[i].start <= start || layout->coverage[i].start - start < len);
+}
+
+/* Returns the number of bytes covered by included regions, i.e. the size of a file holding only them. */
+unsigned int included_regions_size(const struct flashrom_layout *layout, unsigned int size)
+{
+	unsigned int start = 0, rstart, rlen, total = 0;
+
+	while (next_included_range(layout, size, start, &rstart, &rlen)) {
+		total += rlen;
+		start = rstart + rlen;
 	}
-	return best_entry;
+	return total;
 }
 
 /* Validate and - if needed - normalize layout entries. */
-int normalize_romentries(const struct flashctx *flash)
+int normalize_romentries(const struct flashrom_layout *layout, const struct flashctx *flash)
 {
 	chipsize_t total_size = flash->chip->total_size * 1024;
 	int ret = 0;
 
 	int i;
-	for (i = 0; i < num_rom_entries; i++) {
-		if (rom_entries[i].start >= total_size || rom_entries[i].end >= total_size) {
+	for (i = 0; i < layout->num_rom_entries; i++) {
+		if (layout->rom_entries[i].start >= total_size || layout->rom_entries[i].end >= total_size) {
 			msg_gwarn("Warning: Address range of region \"%s\" exceeds the current chip's "
-				  "address space.\n", rom_entries[i].name);
-			if (rom_entries[i].included)
+				  "address space.\n", layout->rom_entries[i].name);
+			if (layout->rom_entries[i].included)
 				ret = 1;
 		}
-		if (rom_entries[i].start > rom_entries[i].end) {
+		if (layout->rom_entries[i].start > layout->rom_entries[i].end) {
 			msg_gerr("Error: Size of the address range of region \"%s\" is not positive.\n",
-				  rom_entries[i].name);
+				  layout->rom_entries[i].name);
 			ret = 1;
 		}
 	}
@@ -278,38 +504,29 @@ static int copy_old_content(struct flashctx *flash, int oldcontents_valid, uint8
  * wants to update only parts of it, copy the chunks to be preserved from @oldcontents to @newcontents. If
  * @oldcontents is not valid, we need to fetch the current data from the chip first.
  */
-int build_new_image(struct flashctx *flash, bool oldcontents_valid, uint8_t *oldcontents, uint8_t *newcontents)
+int build_new_image(const struct flashrom_layout *layout, struct flashctx *flash, bool oldcontents_valid, uint8_t *oldcontents, uint8_t *newcontents)
 {
-	unsigned int start = 0;
-	romentry_t *entry;
+	unsigned int start = 0, rstart, rlen;
 	unsigned int size = flash->chip->total_size * 1024;
 
 	/* If no regions were specified for inclusion, assume
 	 * that the user wants to write the complete new image.
 	 */
-	if (num_include_args == 0)
+	if (layout->num_include_args == 0)
 		return 0;
 
 	/* Non-included romentries are ignored.
-	 * The union of all included romentries is used from the new image.
+	 * The union of all included romentries is used from the new image,
+	 * everything in between is copied from old content.
 	 */
-	while (start < size) {
-		entry = get_next_included_romentry(start);
-		/* No more romentries for remaining region? */
-		if (!entry) {
-			copy_old_content(flash, oldcontents_valid, oldcontents, newcontents, start,
-					 size - start);
-			break;
-		}
-		/* For non-included region, copy from old content. */
-		if (entry->start > start)
-			copy_old_content(flash, oldcontents_valid, oldcontents, newcontents, start,
-					 entry->start - start);
-		/* Skip to location after current romentry. */
-		start = entry->end + 1;
-		/* Catch overflow. */
-		if (!start)
-			break;
+	while (next_included_range(layout, size, start, &rstart, &rlen)) {
+		if (rstart > start && copy_old_content(flash, oldcontents_valid, oldcontents, newcontents, start,
+						       rstart - start))
+			return 1;
+		start = rstart + rlen;
 	}
+	if (start < size && copy_old_content(flash, oldcontents_valid, oldcontents, newcontents, start,
+					     size - start))
+		return 1;
 	return 0;
 }
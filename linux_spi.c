@@ -48,10 +48,12 @@ static int linux_spi_send_command(struct flashctx *flash, unsigned int writecnt,
 				  unsigned int readcnt,
 				  const unsigned char *txbuf,
 				  unsigned char *rxbuf);
+static int linux_spi_send_command_sg(struct flashctx *flash, const struct spi_command *cmd);
 static int linux_spi_read(struct flashctx *flash, uint8_t *buf,
 			  unsigned int start, unsigned int len);
 static int linux_spi_write_256(struct flashctx *flash, const uint8_t *buf,
 			       unsigned int start, unsigned int len);
+static int linux_spi_set_speed(const struct flashctx *flash, unsigned int *hz);
 
 static const struct spi_master spi_master_linux = {
 	.type		= SPI_CONTROLLER_LINUX,
@@ -59,9 +61,11 @@ static const struct spi_master spi_master_linux = {
 	.max_data_write	= MAX_DATA_UNSPECIFIED, /* TODO? */
 	.command	= linux_spi_send_command,
 	.multicommand	= default_spi_send_multicommand,
+	.command_sg	= linux_spi_send_command_sg,
 	.read		= linux_spi_read,
 	.write_256	= linux_spi_write_256,
 	.write_aai	= default_spi_write_aai,
+	.set_speed	= linux_spi_set_speed,
 };
 
 int linux_spi_init(void)
@@ -141,6 +145,19 @@ static int linux_spi_shutdown(void *data)
 	return 0;
 }
 
+static int linux_spi_set_speed(const struct flashctx *flash, unsigned int *hz)
+{
+	uint32_t speed_hz = *hz;
+
+	if (ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) == -1 ||
+	    ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed_hz) == -1) {
+		msg_perr("%s: failed to set speed to %u Hz: %s\n", __func__, *hz, strerror(errno));
+		return 1;
+	}
+	*hz = speed_hz;
+	return 0;
+}
+
 static int linux_spi_send_command(struct flashctx *flash, unsigned int writecnt,
 				  unsigned int readcnt,
 				  const unsigned char *txbuf,
@@ -179,6 +196,42 @@ static int linux_spi_send_command(struct flashctx *flash, unsigned int writecnt,
 	return 0;
 }
 
+/* Maximum number of write segments (in addition to writearr) that are submitted in one ioctl. */
+#define LINUX_SPI_MAX_SEGS 4
+
+static int linux_spi_send_command_sg(struct flashctx *flash, const struct spi_command *cmd)
+{
+	/* One transfer for writearr, one per write segment and one for the read. The kernel keeps CS#
+	   asserted between the transfers of a single message, so segments are sent without copying. */
+	struct spi_ioc_transfer msg[LINUX_SPI_MAX_SEGS + 2];
+	unsigned int i, n = 0;
+
+	if (fd == -1)
+		return -1;
+	if (cmd->writecnt == 0 || cmd->writesegcnt > LINUX_SPI_MAX_SEGS)
+		return spi_send_flattened_command(flash, cmd);
+
+	memset(msg, 0, sizeof(msg));
+	msg[n].tx_buf = (uint64_t)(uintptr_t)cmd->writearr;
+	msg[n++].len = cmd->writecnt;
+	for (i = 0; i < cmd->writesegcnt; i++) {
+		if (cmd->writesegs[i].len == 0)
+			continue;
+		msg[n].tx_buf = (uint64_t)(uintptr_t)cmd->writesegs[i].buf;
+		msg[n++].len = cmd->writesegs[i].len;
+	}
+	if (cmd->readcnt) {
+		msg[n].rx_buf = (uint64_t)(uintptr_t)cmd->readarr;
+		msg[n++].len = cmd->readcnt;
+	}
+
+	if (ioctl(fd, SPI_IOC_MESSAGE(n), msg) == -1) {
+		msg_cerr("%s: ioctl: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
 static int linux_spi_read(struct flashctx *flash, uint8_t *buf,
 			  unsigned int start, unsigned int len)
 {
@@ -0,0 +1,452 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Block-hash manifests: a text file listing a CRC32C (and optionally a SHA-256) hash of every erase block of a
+ * chip. A manifest is much smaller than the image it describes and can be checked against a chip one block at a
+ * time, i.e. with constant memory. The format is
+ *
+ *   flashrom-manifest 1
+ *   size <chip size in bytes>
+ *   <start> <length> crc32c=<8 hex digits> [sha256=<64 hex digits>]
+ *   ...
+ *
+ * with one line per erase block of the finest usable block eraser of the chip.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "flash.h"
+#include "programmer.h"
+
+#define MANIFEST_MAGIC		"flashrom-manifest 1"
+/* Block size used if the chip has no usable block eraser. */
+#define MANIFEST_DEFAULT_BLOCK	4096
+
+/* CRC32C (Castagnoli), reflected polynomial 0x82F63B78. */
+static uint32_t crc32c_table[256];
+
+static void crc32c_init_table(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+		crc32c_table[i] = crc;
+	}
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	if (!crc32c_table[1])
+		crc32c_init_table();
+	while (len--)
+		crc = (crc >> 8) ^ crc32c_table[(crc ^ *buf++) & 0xff];
+	return crc;
+}
+
+#if (defined(__i386__) || defined(__x86_64__)) && (__GNUC__ >= 5 || defined(__clang__))
+#define HAVE_CRC32C_SSE42 1
+/* The SSE4.2 crc32 instruction implements exactly CRC32C. */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	uint32_t val32;
+#if defined(__x86_64__)
+	uint64_t val64;
+
+	while (len >= 8) {
+		memcpy(&val64, buf, 8);
+		crc = __builtin_ia32_crc32di(crc, val64);
+		buf += 8;
+		len -= 8;
+	}
+#endif
+	while (len >= 4) {
+		memcpy(&val32, buf, 4);
+		crc = __builtin_ia32_crc32si(crc, val32);
+		buf += 4;
+		len -= 4;
+	}
+	while (len--)
+		crc = __builtin_ia32_crc32qi(crc, *buf++);
+	return crc;
+}
+#endif
+
+/* Returns the CRC32C of buf. Pass 0 as crc for the first chunk and the previous result for further chunks. */
+uint32_t crc32c(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	crc = ~crc;
+#if HAVE_CRC32C_SSE42
+	static int have_sse42 = -1;
+	if (have_sse42 < 0)
+		have_sse42 = __builtin_cpu_supports("sse4.2");
+	if (have_sse42)
+		return ~crc32c_sse42(crc, buf, len);
+#endif
+	return ~crc32c_sw(crc, buf, len);
+}
+
+/* SHA-256 as specified in FIPS 180-4. */
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t state[8], const uint8_t *p)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t)p[4 * i] << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+	for (i = 16; i < 64; i++)
+		w[i] = w[i - 16] + (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+		       w[i - 7] + (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+struct sha256_ctx {
+	uint32_t state[8];
+	uint8_t buf[64];
+	uint64_t len;
+};
+
+static void sha256_init(struct sha256_ctx *ctx)
+{
+	static const uint32_t init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->state, init, sizeof(init));
+	ctx->len = 0;
+}
+
+static void sha256_update(struct sha256_ctx *ctx, const uint8_t *buf, size_t len)
+{
+	size_t fill = ctx->len % 64, take;
+
+	ctx->len += len;
+	if (fill) {
+		take = min(64 - fill, len);
+		memcpy(ctx->buf + fill, buf, take);
+		buf += take;
+		len -= take;
+		if (fill + take < 64)
+			return;
+		sha256_block(ctx->state, ctx->buf);
+	}
+	for (; len >= 64; buf += 64, len -= 64)
+		sha256_block(ctx->state, buf);
+	memcpy(ctx->buf, buf, len);
+}
+
+static void sha256_final(struct sha256_ctx *ctx, uint8_t digest[32])
+{
+	uint8_t pad[72] = { 0x80 };
+	uint64_t bits = ctx->len * 8;
+	size_t padlen = 64 - (ctx->len + 8) % 64;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		pad[padlen + 7 - i] = bits >> (8 * i);
+	sha256_update(ctx, pad, padlen + 8);
+	for (i = 0; i < 32; i++)
+		digest[i] = ctx->state[i / 4] >> (24 - 8 * (i % 4));
+}
+
+/* Computes the SHA-256 digest of buf. */
+void sha256(const uint8_t *buf, size_t len, uint8_t digest[32])
+{
+	struct sha256_ctx ctx;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, buf, len);
+	sha256_final(&ctx, digest);
+}
+
+/* Hashes buf and formats the SHA-256 as 64 lower case hex digits. */
+void sha256_hex(const uint8_t *buf, size_t len, char hex[65])
+{
+	uint8_t digest[32];
+	int i;
+
+	sha256(buf, len, digest);
+	for (i = 0; i < 32; i++)
+		sprintf(hex + 2 * i, "%02x", digest[i]);
+}
+
+/* Formats the manifest line of a block. digest is NULL if no SHA-256 is wanted. */
+static void manifest_format_line(char *line, size_t linelen, unsigned int start, unsigned int len, uint32_t crc,
+				 const uint8_t *digest)
+{
+	int i, n;
+
+	n = snprintf(line, linelen, "0x%06x 0x%x crc32c=%08x", start, len, crc);
+	if (digest) {
+		n += snprintf(line + n, linelen - n, " sha256=");
+		for (i = 0; i < 32; i++)
+			n += snprintf(line + n, linelen - n, "%02x", digest[i]);
+	}
+}
+
+/* Returns the length of the manifest block starting at start, i.e. of the erase block of block eraser k there. */
+static unsigned int manifest_block_len(const struct flashctx *flash, int k, unsigned int start)
+{
+	unsigned int size = flash->chip->total_size * 1024;
+	unsigned int pos = 0, regionlen, i;
+
+	if (k < 0)
+		return min(MANIFEST_DEFAULT_BLOCK, size - start);
+	const struct block_eraser *eraser = &flash->chip->block_erasers[k];
+	for (i = 0; i < NUM_ERASEREGIONS; i++) {
+		regionlen = eraser->eraseblocks[i].size * eraser->eraseblocks[i].count;
+		if (start < pos + regionlen)
+			return eraser->eraseblocks[i].size;
+		pos += regionlen;
+	}
+	return 0;
+}
+
+/* A manifest written while the chip contents stream by, see manifest_stream_open(). */
+struct manifest_stream {
+	const struct flashctx *flash;
+	FILE *file;
+	const char *name;
+	bool with_sha256;
+	int eraser;
+	unsigned int blockstart;
+	unsigned int blocklen;	/* 0 if no block has been started yet. */
+	unsigned int fill;
+	uint32_t crc;
+	struct sha256_ctx sha;
+	int error;
+};
+
+/* Creates a manifest to which the contents of the chip are fed in order with manifest_stream_feed(). Returns NULL
+ * on failure. */
+struct manifest_stream *manifest_stream_open(const struct flashctx *flash, const char *filename, bool with_sha256)
+{
+#ifdef __LIBPAYLOAD__
+	msg_gerr("Error: No file I/O support in libpayload\n");
+	return NULL;
+#else
+	struct manifest_stream *ms = calloc(1, sizeof(*ms));
+	if (!ms) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	ms->file = fopen(filename, "w");
+	if (!ms->file) {
+		msg_gerr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
+		free(ms);
+		return NULL;
+	}
+	ms->flash = flash;
+	ms->name = filename;
+	ms->with_sha256 = with_sha256;
+	ms->eraser = finest_block_eraser(flash);
+	if (fprintf(ms->file, "%s\nsize %u\n", MANIFEST_MAGIC, flash->chip->total_size * 1024) < 0)
+		ms->error = 1;
+	return ms;
+#endif
+}
+
+/* Hashes the next len bytes of the chip contents. */
+void manifest_stream_feed(struct manifest_stream *ms, const uint8_t *buf, unsigned int len)
+{
+	uint8_t digest[32];
+	char line[128];
+	unsigned int take;
+
+	while (len) {
+		if (!ms->blocklen) {
+			ms->blocklen = manifest_block_len(ms->flash, ms->eraser, ms->blockstart);
+			if (!ms->blocklen)
+				return;
+			ms->fill = 0;
+			ms->crc = 0;
+			sha256_init(&ms->sha);
+		}
+		take = min(len, ms->blocklen - ms->fill);
+		ms->crc = crc32c(ms->crc, buf, take);
+		if (ms->with_sha256)
+			sha256_update(&ms->sha, buf, take);
+		ms->fill += take;
+		buf += take;
+		len -= take;
+		if (ms->fill < ms->blocklen)
+			continue;
+
+		if (ms->with_sha256)
+			sha256_final(&ms->sha, digest);
+		manifest_format_line(line, sizeof(line), ms->blockstart, ms->blocklen, ms->crc,
+				     ms->with_sha256 ? digest : NULL);
+		if (fprintf(ms->file, "%s\n", line) < 0)
+			ms->error = 1;
+		ms->blockstart += ms->blocklen;
+		ms->blocklen = 0;
+	}
+}
+
+/* Closes the manifest. Only completely fed blocks are listed. Returns 0 on success. */
+int manifest_stream_close(struct manifest_stream *ms)
+{
+	int ret = ms->error;
+
+	if (fclose(ms->file))
+		ret = 1;
+	if (ret)
+		msg_gerr("Error: writing file \"%s\" failed: %s\n", ms->name, strerror(errno));
+	free(ms);
+	return ret;
+}
+
+/* Writes the manifest of image, which holds the contents of the whole chip, to filename. */
+int write_manifest(struct flashctx *flash, const uint8_t *image, const char *filename, bool with_sha256)
+{
+	struct manifest_stream *ms = manifest_stream_open(flash, filename, with_sha256);
+
+	if (!ms)
+		return 1;
+	manifest_stream_feed(ms, image, flash->chip->total_size * 1024);
+	return manifest_stream_close(ms);
+}
+
+/**
+ * @brief check the chip against a manifest one block at a time
+ *
+ * Every block listed in the manifest is read from the chip and hashed with the algorithms the manifest lists
+ * for it. Blocks which differ are reported, hence this can also be used to find out which blocks changed since
+ * the manifest was created.
+ *
+ * @flash	the flash chip to be checked
+ * @force	passed to chip_safety_check()
+ * @filename	manifest file
+ * @return	0 if all blocks match, 1 otherwise
+ */
+int check_manifest(struct flashctx *flash, int force, const char *filename)
+{
+#ifdef __LIBPAYLOAD__
+	msg_gerr("Error: No file I/O support in libpayload\n");
+	return 1;
+#else
+	unsigned int size = flash->chip->total_size * 1024;
+	unsigned int start, len, filesize, bufsize = 0;
+	unsigned int checked = 0, changed = 0, lineno = 2;
+	char line[256], expected[256];
+	uint8_t digest[32];
+	const char *hashes;
+	uint8_t *buf = NULL;
+	FILE *file;
+	int ret = 1;
+
+	if (chip_safety_check(flash, force, 1, 0, 0, 0)) {
+		msg_cerr("Aborting.\n");
+		return 1;
+	}
+	if (flash->chip->unlock)
+		flash->chip->unlock(flash);
+
+	file = fopen(filename, "r");
+	if (!file) {
+		msg_gerr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
+		return 1;
+	}
+	if (!fgets(line, sizeof(line), file) || strncmp(line, MANIFEST_MAGIC, strlen(MANIFEST_MAGIC)) ||
+	    !fgets(line, sizeof(line), file) || sscanf(line, "size %u", &filesize) != 1) {
+		msg_gerr("Error: \"%s\" is not a flashrom manifest.\n", filename);
+		goto out;
+	}
+	if (filesize != size) {
+		msg_gerr("Error: Manifest size (%u B) doesn't match the flash chip's size (%u B)!\n",
+			 filesize, size);
+		goto out;
+	}
+
+	msg_cinfo("Checking flash chip against manifest...\n");
+	while (fgets(line, sizeof(line), file)) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!strlen(line))
+			continue;
+		hashes = strstr(line, "crc32c=");
+		if (sscanf(line, "%x %x", &start, &len) != 2 || !hashes || !len || start > size ||
+		    len > size - start) {
+			msg_gerr("Error: Invalid line %u in manifest: %s\n", lineno, line);
+			goto out;
+		}
+		if (len > bufsize) {
+			free(buf);
+			buf = malloc(len);
+			if (!buf) {
+				msg_gerr("Out of memory!\n");
+				exit(1);
+			}
+			bufsize = len;
+		}
+		if (flash->chip->read(flash, buf, start, len)) {
+			msg_cerr("Reading 0x%06x-0x%06x failed!\n", start, start + len - 1);
+			goto out;
+		}
+		if (strstr(hashes, "sha256="))
+			sha256(buf, len, digest);
+		manifest_format_line(expected, sizeof(expected), start, len, crc32c(0, buf, len),
+				     strstr(hashes, "sha256=") ? digest : NULL);
+		/* Only the hashes are compared, the offsets may be written in another format. */
+		if (strcmp(strstr(expected, "crc32c="), hashes)) {
+			msg_cinfo("Block 0x%06x-0x%06x changed.\n", start, start + len - 1);
+			changed++;
+		}
+		checked++;
+	}
+	msg_cinfo("%u of %u blocks changed.\n", changed, checked);
+	if (!changed)
+		msg_cinfo("VERIFIED.\n");
+	ret = !!changed;
+out:
+	free(buf);
+	fclose(file);
+	return ret;
+#endif
+}
@@ -163,7 +163,10 @@ static int pcidev_shutdown(void *data)
 	return 0;
 }
 
-int pci_init_common(void)
+/* Sets up the PCI context without scanning the bus. pci_scan_bus(pacc) has to follow before pacc->devices is
+ * used, possibly in another thread.
+ */
+int pci_init_common_noscan(void)
 {
 	if (pacc != NULL) {
 		msg_perr("%s: Tried to allocate a new PCI context, but there is still an old one!\n"
@@ -174,6 +177,13 @@ int pci_init_common(void)
 	pci_init(pacc);         /* Initialize the PCI library */
 	if (register_shutdown(pcidev_shutdown, NULL))
 		return 1;
+	return 0;
+}
+
+int pci_init_common(void)
+{
+	if (pci_init_common_noscan())
+		return 1;
 	pci_scan_bus(pacc);     /* We want to get the list of devices */
 	return 0;
 }
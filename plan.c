@@ -0,0 +1,462 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Erase/write plans: the list of erase and write operations a write would issue, computed with the same
+ * need_erase()/get_next_write() logic as erase_and_write_flash() but without touching the chip. A plan can be
+ * executed later without reading the chip or computing anything again. The format is
+ *
+ *   flashrom-plan 2
+ *   chip <chip name>
+ *   size <chip size in bytes>
+ *   sha256 <64 hex digits of the image to be written>
+ *   eraser <block eraser index>
+ *   plan-sha256 <64 hex digits of the eraser line and all operation lines>
+ *   erase <start> <length> [opcode=<SPI opcode>]
+ *   write <start> <length>
+ *   ...
+ *
+ * in execution order. Lines starting with # are comments, the summary and the time estimate are written as
+ * such. The plan hash covers the eraser line and the operation lines, each with its trailing newline, so that
+ * an edited or damaged plan is not executed.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include "flash.h"
+#include "chipdrivers.h"
+#include "programmer.h"
+
+#define PLAN_MAGIC		"flashrom-plan 2"
+
+/* flashchips.c has no erase or program timings, hence the estimate uses typical values of SPI NOR datasheets
+ * unless a profile measured by --benchmark is given: every erase takes a fixed setup time plus a time
+ * proportional to its size, every page program a fixed time.
+ */
+#define PLAN_ERASE_BASE_US	30000
+#define PLAN_ERASE_KB_US	4000
+#define PLAN_PROGRAM_PAGE_US	700
+#define PLAN_DEFAULT_PAGE	256
+/* Amount of data read to measure the throughput of the programmer. */
+#define PLAN_SAMPLE_SIZE	(64 * 1024)
+
+enum plan_op_type {
+	PLAN_ERASE,
+	PLAN_WRITE,
+};
+
+struct plan_op {
+	enum plan_op_type type;
+	unsigned int start;
+	unsigned int len;
+};
+
+struct plan {
+	struct plan_op *op;
+	unsigned int count;
+	unsigned int alloc;
+};
+
+/* The lines covered by the plan hash. */
+struct plan_text {
+	char *buf;
+	size_t len;
+	size_t alloc;
+};
+
+static void plan_text_add(struct plan_text *text, const char *line)
+{
+	size_t len = strlen(line);
+
+	if (text->len + len + 2 > text->alloc) {
+		text->alloc = (text->len + len + 2) * 2;
+		text->buf = realloc(text->buf, text->alloc);
+		if (!text->buf) {
+			msg_gerr("Out of memory!\n");
+			exit(1);
+		}
+	}
+	memcpy(text->buf + text->len, line, len);
+	text->len += len;
+	text->buf[text->len++] = '\n';
+	text->buf[text->len] = '\0';
+}
+
+/* Finds the erase block of block eraser k which contains addr. */
+static void plan_eraseblock(const struct flashctx *flash, int k, unsigned int addr, unsigned int *bstart,
+			    unsigned int *blen)
+{
+	const struct block_eraser *eraser = &flash->chip->block_erasers[k];
+	unsigned int i, start = 0, len;
+
+	for (i = 0; i < NUM_ERASEREGIONS; i++) {
+		len = eraser->eraseblocks[i].size;
+		if (len && addr < start + eraser->eraseblocks[i].count * len) {
+			*bstart = start + (addr - start) / len * len;
+			*blen = len;
+			return;
+		}
+		start += eraser->eraseblocks[i].count * len;
+	}
+	*bstart = addr;
+	*blen = 0;
+}
+
+static void plan_add(struct plan *plan, enum plan_op_type type, unsigned int start, unsigned int len)
+{
+	if (plan->count == plan->alloc) {
+		plan->alloc = plan->alloc ? plan->alloc * 2 : 256;
+		plan->op = realloc(plan->op, plan->alloc * sizeof(*plan->op));
+		if (!plan->op) {
+			msg_gerr("Out of memory!\n");
+			exit(1);
+		}
+	}
+	plan->op[plan->count].type = type;
+	plan->op[plan->count].start = start;
+	plan->op[plan->count].len = len;
+	plan->count++;
+}
+
+/* Computes the operations erase_and_write_flash() would issue with block eraser k. */
+static void plan_compute(const struct flashctx *flash, int k, const uint8_t *oldcontents,
+			 const uint8_t *newcontents, struct plan *plan)
+{
+	const struct block_eraser *eraser = &flash->chip->block_erasers[k];
+	enum write_granularity gran = flash->chip->gran;
+	unsigned int i, j, start = 0, len, starthere, lenhere;
+	uint8_t *cur = NULL;
+
+	for (i = 0; i < NUM_ERASEREGIONS; i++) {
+		len = eraser->eraseblocks[i].size;
+		if (eraser->eraseblocks[i].count) {
+			cur = realloc(cur, len);
+			if (!cur) {
+				msg_gerr("Out of memory!\n");
+				exit(1);
+			}
+		}
+		for (j = 0; j < eraser->eraseblocks[i].count; j++, start += len) {
+			memcpy(cur, oldcontents + start, len);
+			if (need_erase(cur, newcontents + start, len, gran)) {
+				plan_add(plan, PLAN_ERASE, start, len);
+				memset(cur, 0xff, len);
+			}
+			starthere = 0;
+			while ((lenhere = get_next_write(cur + starthere, newcontents + start + starthere,
+							 len - starthere, &starthere, gran))) {
+				plan_add(plan, PLAN_WRITE, start + starthere, lenhere);
+				starthere += lenhere;
+			}
+		}
+	}
+	free(cur);
+}
+
+/* Returns the read throughput of the programmer in bytes per second, 0 if it is too fast to be measured. */
+static double measure_throughput(struct flashctx *flash)
+{
+	unsigned int len = min(PLAN_SAMPLE_SIZE, flash->chip->total_size * 1024);
+	struct timeval start, end;
+	uint8_t *buf = malloc(len);
+	double us;
+
+	if (!buf) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	gettimeofday(&start, NULL);
+	if (flash->chip->read(flash, buf, 0, len)) {
+		free(buf);
+		return 0;
+	}
+	gettimeofday(&end, NULL);
+	free(buf);
+	us = (end.tv_sec - start.tv_sec) * 1000000.0 + (end.tv_usec - start.tv_usec);
+	return us > 0 ? len / us * 1000000.0 : 0;
+}
+
+/* Returns the estimated duration of erasing a block of len bytes in microseconds. */
+static double erase_us(const struct flash_profile *profile, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; profile && i < profile->erase_count; i++) {
+		if (profile->erase[i].size == len)
+			return profile->erase[i].us;
+	}
+	return PLAN_ERASE_BASE_US + len / 1024.0 * PLAN_ERASE_KB_US;
+}
+
+/**
+ * @brief compute the erase/write plan for writing newcontents over oldcontents and save it
+ *
+ * Nothing is erased or written. Besides the plan, a summary and an estimate of the duration of the write are
+ * printed. The estimate is based on the programmer profile given with --profile. Without one, or for what the
+ * profile lacks, typical chip timings and the read throughput of the programmer, measured with a short read,
+ * are used.
+ *
+ * @return	0 on success
+ */
+int write_plan(struct flashctx *flash, const uint8_t *oldcontents, const uint8_t *newcontents,
+	       const char *filename)
+{
+#ifdef __LIBPAYLOAD__
+	msg_gerr("Error: No file I/O support in libpayload\n");
+	return 1;
+#else
+	unsigned int size = flash->chip->total_size * 1024;
+	unsigned int page = flash->chip->page_size ? flash->chip->page_size : PLAN_DEFAULT_PAGE;
+	unsigned int i, erases = 0, erased = 0, writes = 0, written = 0, pages = 0;
+	int k = first_block_eraser(flash);
+	struct plan plan = {0};
+	struct plan_text text = {0};
+	size_t ops;
+	char line[64];
+	struct flash_profile profile;
+	const struct flash_profile *prof = NULL;
+	double rate, erase_s = 0, program_s, transfer_s;
+	uint8_t opcode = 0;
+	char digest[65];
+	FILE *file;
+	int ret = 0;
+
+	if (k < 0) {
+		msg_cerr("No usable erase function for this chip, can not plan a write.\n");
+		return 1;
+	}
+	if (flash->ctx->profile) {
+		if (load_profile(flash->ctx->profile, &profile))
+			return 1;
+		prof = &profile;
+	}
+	if (flash->chip->bustype == BUS_SPI)
+		opcode = spi_get_opcode_from_erasefn(flash->chip->block_erasers[k].block_erase);
+	plan_compute(flash, k, oldcontents, newcontents, &plan);
+
+	for (i = 0; i < plan.count; i++) {
+		if (plan.op[i].type == PLAN_ERASE) {
+			erases++;
+			erased += plan.op[i].len;
+			erase_s += erase_us(prof, plan.op[i].len) / 1000000.0;
+		} else {
+			writes++;
+			written += plan.op[i].len;
+			pages += (plan.op[i].start + plan.op[i].len - 1) / page - plan.op[i].start / page + 1;
+		}
+	}
+	if (prof && prof->read_rate > 0) {
+		rate = prof->read_rate;
+	} else {
+		msg_cinfo("Measuring the programmer's read throughput... ");
+		rate = measure_throughput(flash);
+		msg_cinfo("done.\n");
+	}
+	/* Data written, erased blocks read back for checking and the whole chip read back for verification. The
+	 * program time of a profile includes the transfer of the data written.
+	 */
+	if (prof && prof->program_page_us > 0) {
+		program_s = pages * prof->program_page_us / 1000000.0;
+		transfer_s = rate > 0 ? (erased + size) / rate : 0;
+	} else {
+		program_s = pages * (double)PLAN_PROGRAM_PAGE_US / 1000000.0;
+		transfer_s = rate > 0 ? (written + erased + size) / rate : 0;
+	}
+
+	file = fopen(filename, "w");
+	if (!file) {
+		msg_gerr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
+		free(plan.op);
+		return 1;
+	}
+	snprintf(line, sizeof(line), "eraser %i", k);
+	plan_text_add(&text, line);
+	ops = text.len;
+	for (i = 0; i < plan.count; i++) {
+		if (plan.op[i].type == PLAN_WRITE)
+			snprintf(line, sizeof(line), "write 0x%06x 0x%x", plan.op[i].start, plan.op[i].len);
+		else if (opcode)
+			snprintf(line, sizeof(line), "erase 0x%06x 0x%x opcode=0x%02x", plan.op[i].start,
+				 plan.op[i].len, opcode);
+		else
+			snprintf(line, sizeof(line), "erase 0x%06x 0x%x", plan.op[i].start, plan.op[i].len);
+		plan_text_add(&text, line);
+	}
+
+	sha256_hex(newcontents, size, digest);
+	fprintf(file, "%s\nchip %s\nsize %u\nsha256 %s\n", PLAN_MAGIC, flash->chip->name, size, digest);
+	fwrite(text.buf, 1, ops, file);
+	sha256_hex((const uint8_t *)text.buf, text.len, digest);
+	fprintf(file, "plan-sha256 %s\n", digest);
+	fprintf(file, "# %u erases (%u bytes), %u writes (%u bytes, %u pages)\n", erases, erased, writes, written,
+		pages);
+	fprintf(file, "# estimated duration %.1f s: erase %.1f s, program %.1f s, transfer %.1f s\n",
+		erase_s + program_s + transfer_s, erase_s, program_s, transfer_s);
+	if (prof)
+		fprintf(file, "# timings from profile %s\n", flash->ctx->profile);
+	fwrite(text.buf + ops, 1, text.len - ops, file);
+	free(text.buf);
+	if (ferror(file))
+		ret = 1;
+	if (fclose(file))
+		ret = 1;
+	if (ret)
+		msg_gerr("Error: writing file \"%s\" failed: %s\n", filename, strerror(errno));
+	free(plan.op);
+
+	msg_cinfo("Plan: %u erase%s (%u bytes), %u write%s (%u bytes in %u pages).\n", erases,
+		  erases == 1 ? "" : "s", erased, writes, writes == 1 ? "" : "s", written, pages);
+	msg_cinfo("Estimated duration: %.1f s (erase %.1f s, program %.1f s, transfer %.1f s", erase_s + program_s +
+		  transfer_s, erase_s, program_s, transfer_s);
+	if (rate > 0)
+		msg_cinfo(" at %.0f kB/s", rate / 1024);
+	msg_cinfo(").\n");
+	return ret;
+#endif
+}
+
+/**
+ * @brief execute a plan saved by write_plan()
+ *
+ * The plan has to belong to this chip and to newcontents, its hash has to match and every operation has to fit
+ * the erase blocks (and the erase opcode) of the planned block eraser of this chip. The chip is neither read nor
+ * compared before, the operations are issued as planned. Erased blocks are checked as usual.
+ *
+ * @return	0 on success, 1 if the plan can not be used (the chip was not touched) and -1 if an erase or write
+ *		failed
+ */
+int run_plan(struct flashctx *flash, const uint8_t *newcontents, const char *filename)
+{
+#ifdef __LIBPAYLOAD__
+	msg_gerr("Error: No file I/O support in libpayload\n");
+	return 1;
+#else
+	unsigned int size = flash->chip->total_size * 1024;
+	unsigned int i, start, len, bstart, blen, filesize, opcode, lineno = 6;
+	char line[256], chip[256], hex[65], planhex[65], digest[65], what[8];
+	struct plan plan = {0};
+	struct plan_text text = {0};
+	uint8_t eraser_opcode = 0;
+	erasefunc_t *erasefn;
+	int k, n, m, ret = 1;
+	FILE *file;
+
+	file = fopen(filename, "r");
+	if (!file) {
+		msg_gerr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
+		return 1;
+	}
+	if (!fgets(line, sizeof(line), file) || strncmp(line, PLAN_MAGIC, strlen(PLAN_MAGIC)) ||
+	    !fgets(line, sizeof(line), file) || sscanf(line, "chip %255[^\r\n]", chip) != 1 ||
+	    !fgets(line, sizeof(line), file) || sscanf(line, "size %u", &filesize) != 1 ||
+	    !fgets(line, sizeof(line), file) || sscanf(line, "sha256 %64s", hex) != 1 ||
+	    !fgets(line, sizeof(line), file) || sscanf(line, "eraser %i", &k) != 1) {
+		msg_gerr("Error: \"%s\" is not a flashrom plan.\n", filename);
+		goto out;
+	}
+	line[strcspn(line, "\r\n")] = '\0';
+	plan_text_add(&text, line);
+	if (!fgets(line, sizeof(line), file) || sscanf(line, "plan-sha256 %64s", planhex) != 1) {
+		msg_gerr("Error: \"%s\" is not a flashrom plan.\n", filename);
+		goto out;
+	}
+	sha256_hex(newcontents, size, digest);
+	if (strcmp(chip, flash->chip->name) || filesize != size) {
+		msg_gerr("Error: The plan was made for the chip \"%s\".\n", chip);
+		goto out;
+	}
+	if (strcmp(hex, digest)) {
+		msg_gerr("Error: The plan was made for another image.\n");
+		goto out;
+	}
+	if (k < 0 || k >= NUM_ERASEFUNCTIONS || check_block_eraser(flash, k, 0)) {
+		msg_gerr("Error: The plan uses an invalid erase function.\n");
+		goto out;
+	}
+	erasefn = flash->chip->block_erasers[k].block_erase;
+	if (flash->chip->bustype == BUS_SPI)
+		eraser_opcode = spi_get_opcode_from_erasefn(erasefn);
+
+	/* Check the whole plan before touching the chip. */
+	while (fgets(line, sizeof(line), file)) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!strlen(line) || line[0] == '#')
+			continue;
+		plan_text_add(&text, line);
+		opcode = 0;
+		if (sscanf(line, "%7s %x %x%n", what, &start, &len, &n) != 3 || !len || start > size ||
+		    len > size - start || (strcmp(what, "erase") && strcmp(what, "write")) ||
+		    (line[n] && (strcmp(what, "erase") || sscanf(line + n, " opcode=%x%n", &opcode, &m) != 1 ||
+				 line[n + m]))) {
+			msg_gerr("Error: Invalid line %u in plan: %s\n", lineno, line);
+			goto out;
+		}
+		/* Operations have to stay within one erase block, erases have to cover exactly one. */
+		plan_eraseblock(flash, k, start, &bstart, &blen);
+		if (len > bstart + blen - start || (!strcmp(what, "erase") && (start != bstart || len != blen))) {
+			msg_gerr("Error: Line %u of the plan does not match the erase blocks of this chip: %s\n",
+				 lineno, line);
+			goto out;
+		}
+		if (!strcmp(what, "erase") && opcode != eraser_opcode) {
+			msg_gerr("Error: Line %u of the plan erases with opcode 0x%02x, but the erase function uses "
+				 "0x%02x.\n", lineno, opcode, eraser_opcode);
+			goto out;
+		}
+		plan_add(&plan, strcmp(what, "erase") ? PLAN_WRITE : PLAN_ERASE, start, len);
+	}
+	sha256_hex((const uint8_t *)text.buf, text.len, digest);
+	if (strcmp(planhex, digest)) {
+		msg_gerr("Error: The plan was modified or is damaged.\n");
+		goto out;
+	}
+
+	msg_cinfo("Erasing and writing flash chip as planned... ");
+	for (i = 0; i < plan.count; i++) {
+		start = plan.op[i].start;
+		len = plan.op[i].len;
+		if (plan.op[i].type == PLAN_ERASE) {
+			msg_cdbg("E 0x%06x-0x%06x ", start, start + len - 1);
+			if (erasefn(flash, start, len) || check_erased_range(flash, start, len)) {
+				msg_cerr("ERASE FAILED at 0x%06x!\n", start);
+				ret = -1;
+				goto out;
+			}
+		} else {
+			msg_cdbg("W 0x%06x-0x%06x ", start, start + len - 1);
+			if (flash->chip->write(flash, newcontents + start, start, len)) {
+				msg_cerr("WRITE FAILED at 0x%06x!\n", start);
+				ret = -1;
+				goto out;
+			}
+		}
+	}
+	msg_cinfo("Erase/write done.\n");
+	ret = 0;
+out:
+	free(plan.op);
+	free(text.buf);
+	fclose(file);
+	return ret;
+#endif
+}
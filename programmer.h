@@ -146,8 +146,11 @@ struct programmer_entry {
 
 extern const struct programmer_entry programmer_table[];
 
-int programmer_init(enum programmer prog, const char *param);
-int programmer_shutdown(void);
+struct flashrom_context *flashrom_context_new(void);
+void flashrom_context_free(struct flashrom_context *ctx);
+struct flashrom_context *get_active_context(void);
+int programmer_init(struct flashrom_context *ctx, enum programmer prog, const char *param);
+int programmer_shutdown(struct flashrom_context *ctx);
 
 enum bitbang_spi_master_type {
 	BITBANG_SPI_INVALID	= 0, /* This must always be the first entry. */
@@ -190,6 +193,7 @@ struct pci_dev;
 /* pcidev.c */
 // FIXME: This needs to be local, not global(?)
 extern struct pci_access *pacc;
+int pci_init_common_noscan(void);
 int pci_init_common(void);
 uintptr_t pcidev_readbar(struct pci_dev *dev, int bar);
 struct pci_dev *pcidev_init(const struct dev_entry *devs, int bar);
@@ -313,7 +317,7 @@ int cb_check_image(uint8_t *bios, int size);
 /* dmi.c */
 #if defined(__i386__) || defined(__x86_64__)
 extern int has_dmi_support;
-void dmi_init(void);
+int dmi_init(const char *sysfs_dir);
 int dmi_match(const char *pattern);
 #endif // defined(__i386__) || defined(__x86_64__)
 
@@ -345,6 +349,11 @@ void probe_superio(void);
 int register_superio(struct superio s);
 extern enum chipbustype internal_buses_supported;
 int internal_init(void);
+int internal_mmap_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len,
+		       unsigned int bottom, unsigned int top,
+		       int (*read)(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len));
+void internal_mmap_note_opcode(uint8_t opcode);
+void internal_mmap_invalidate(void);
 #endif
 
 /* hwaccess.c */
@@ -602,6 +611,19 @@ enum spi_controller {
 #endif
 };
 
+/* An asynchronous bulk read of len bytes at start into readbuf, see spi_xfer_submit(). */
+struct spi_xfer {
+	uint8_t *readbuf;
+	unsigned int start;
+	unsigned int len;
+	/* Optional, called once the transfer is complete. */
+	void (*complete)(struct spi_xfer *xfer);
+	void *user_data;
+	/* Set by the transport. result is only valid once done is set. */
+	int done;
+	int result;
+};
+
 #define MAX_DATA_UNSPECIFIED 0
 #define MAX_DATA_READ_UNLIMITED 64 * 1024
 #define MAX_DATA_WRITE_UNLIMITED 256
@@ -612,6 +634,16 @@ struct spi_master {
 	int (*command)(struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
 		   const unsigned char *writearr, unsigned char *readarr);
 	int (*multicommand)(struct flashctx *flash, struct spi_command *cmds);
+	/* Optional: like command, but consumes the write segments of cmd directly. */
+	int (*command_sg)(struct flashctx *flash, const struct spi_command *cmd);
+	/* Optional: wait until (status register & mask) == value, delay is the suggested poll interval in us. */
+	int (*poll_status)(struct flashctx *flash, uint8_t mask, uint8_t value, unsigned int delay);
+	/* Optional: start an asynchronous bulk read and return as early as possible; wait for its completion.
+	 * Only dediprog implements these, all other masters run reads synchronously on submit. */
+	int (*submit)(struct flashctx *flash, struct spi_xfer *xfer);
+	int (*wait)(struct flashctx *flash, struct spi_xfer *xfer);
+	/* Optional: set the SPI clock to the fastest rate not above *hz and store the rate set in *hz. */
+	int (*set_speed)(const struct flashctx *flash, unsigned int *hz);
 
 	/* Optimized functions for this master */
 	int (*read)(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len);
@@ -626,6 +658,18 @@ int default_spi_send_multicommand(struct flashctx *flash, struct spi_command *cm
 int default_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len);
 int default_spi_write_256(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len);
 int default_spi_write_aai(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len);
+int spi_autotune(struct flashctx *flash);
+int spi_speed_step_down(struct flashctx *flash);
+int default_spi_poll_status(struct flashctx *flash, uint8_t mask, uint8_t value, unsigned int delay);
+#define SPI_POLL_STATUS_MAX_LEN 256
+int spi_poll_status_streamed(struct flashctx *flash, uint8_t mask, uint8_t value, unsigned int delay,
+			     unsigned int len);
+int spi_xfer_submit(struct flashctx *flash, struct spi_xfer *xfer);
+int spi_xfer_wait(struct flashctx *flash, struct spi_xfer *xfer);
+int spi_xfer_run(struct flashctx *flash, struct spi_xfer *xfer);
+void spi_xfer_complete(struct spi_xfer *xfer, int result);
+int spi_chip_read_submit(struct flashctx *flash, struct spi_xfer *xfer, uint8_t *buf, unsigned int start,
+			 unsigned int len);
 int register_spi_master(const struct spi_master *mst);
 
 /* The following enum is needed by ich_descriptor_tool and ich* code as well as in chipset_enable.c. */
@@ -654,6 +698,7 @@ enum ich_chipset {
 /* ichspi.c */
 #if CONFIG_INTERNAL == 1
 extern uint32_t ichspi_bbar;
+extern uint32_t ichspi_bios_decode;
 int ich_init_spi(struct pci_dev *dev, void *spibar, enum ich_chipset ich_generation);
 int via_init_spi(struct pci_dev *dev, uint32_t mmio_base);
 
@@ -723,10 +768,69 @@ struct registered_master {
 		struct opaque_master opaque;
 	};
 };
-extern struct registered_master registered_masters[];
-extern int registered_master_count;
 int register_master(const struct registered_master *mst);
 
+#define SHUTDOWN_MAXFN 32
+struct shutdown_func_data {
+	int (*func) (void *data);
+	void *data;
+};
+
+/* The limit of 4 is totally arbitrary. */
+#define MASTERS_MAX 4
+
+/* What erase_and_write_block_helper() did to an erase block of the block eraser in use. */
+enum block_state {
+	BLOCK_UNTOUCHED = 0,	/* Neither erased nor written, the chip still holds the old contents. */
+	BLOCK_ERASED,		/* Erased successfully, nothing written yet. */
+	BLOCK_WRITTEN,		/* Written successfully, the chip holds the new contents. */
+	BLOCK_UNKNOWN,		/* An erase or write failed, the contents have to be read back. */
+};
+
+struct journal_state;
+
+/* Everything a flashrom session owns: the selected programmer, the masters it registered, its shutdown
+ * functions and the layout. Drivers still keep their device state in file-scope variables, hence the
+ * programmer of only one context can be initialized at a time (the active context). */
+struct flashrom_context {
+	enum programmer programmer;
+	const char *programmer_param;
+	struct shutdown_func_data shutdown_fn[SHUTDOWN_MAXFN];
+	int shutdown_fn_count;
+	/* Initialize to 0 to make sure nobody registers a shutdown function before
+	 * programmer init.
+	 */
+	int may_register_shutdown;
+	struct registered_master registered_masters[MASTERS_MAX];
+	int registered_master_count;
+	struct flashrom_layout *layout;
+	/* Image files hold only the included regions of the layout, concatenated in address order. */
+	bool regions_only;
+	/* Block-hash manifest to be written alongside a dump. */
+	const char *manifest;
+	bool manifest_sha256;
+	/* Progress journal of a write, allows resuming it after an interruption. */
+	const char *journal;
+	/* Erase/write plan to be saved instead of writing (dry run) or to be executed. */
+	const char *plan;
+	const char *run_plan;
+	/* Programmer profile saved by --benchmark for the estimate of a plan. */
+	const char *profile;
+	/* Did the last erase_and_write_flash() change something or was every erase/write skipped (if any)? */
+	bool all_skipped;
+	/* State of every erase block visited by the current walk_eraseregions() pass of erase_and_write_flash(),
+	 * indexed in walking order. NULL outside of such a pass. */
+	enum block_state *block_state;
+	unsigned int block_state_next;
+	/* Journal of the write in progress, NULL if there is none. */
+	struct journal_state *journal_state;
+	/* Index of the SPI clock chosen by spi_autotune(), -1 if the clock has not been tuned. */
+	int spi_tune_step;
+	/* Erase blocks of the finest block eraser a write of only the included regions may touch, which are the
+	 * only ones read before and verified after it. NULL if the whole chip is read. */
+	bool *included_blocks;
+};
+
 /* serprog.c */
 #if CONFIG_SERPROG == 1
 int serprog_init(void);
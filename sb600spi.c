@@ -45,6 +45,8 @@
  */
 
 static uint8_t *sb600_spibar = NULL;
+/* Bytes of the chip decoded below 4 GiB by LPC ROM address range 2, 0 if the range does not end at 4 GiB. */
+static uint32_t sb600_rom_decode = 0;
 enum amd_chipset {
 	CHIPSET_AMD_UNKNOWN,
 	CHIPSET_SB6XX,
@@ -63,6 +65,7 @@ static int sb600_spi_send_command(struct flashctx *flash, unsigned int writecnt,
 				  const unsigned char *writearr, unsigned char *readarr);
 static int spi100_spi_send_command(struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
 				  const unsigned char *writearr, unsigned char *readarr);
+static int sb600_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len);
 
 static struct spi_master spi_master_sb600 = {
 	.type = SPI_CONTROLLER_SB600,
@@ -70,7 +73,7 @@ static struct spi_master spi_master_sb600 = {
 	.max_data_write = FIFO_SIZE_OLD - 3,
 	.command = sb600_spi_send_command,
 	.multicommand = default_spi_send_multicommand,
-	.read = default_spi_read,
+	.read = sb600_spi_read,
 	.write_256 = default_spi_write_256,
 	.write_aai = default_spi_write_aai,
 };
@@ -81,7 +84,7 @@ static struct spi_master spi_master_yangtze = {
 	.max_data_write = FIFO_SIZE_YANGTZE - 3,
 	.command = spi100_spi_send_command,
 	.multicommand = default_spi_send_multicommand,
-	.read = default_spi_read,
+	.read = sb600_spi_read,
 	.write_256 = default_spi_write_256,
 	.write_aai = default_spi_write_aai,
 };
@@ -217,6 +220,7 @@ static int sb600_spi_send_command(struct flashctx *flash, unsigned int writecnt,
 	/* First byte is cmd which can not be sent through the FIFO. */
 	unsigned char cmd = *writearr++;
 	writecnt--;
+	internal_mmap_note_opcode(cmd);
 	msg_pspew("%s, cmd=0x%02x, writecnt=%d, readcnt=%d\n", __func__, cmd, writecnt, readcnt);
 	mmio_writeb(cmd, sb600_spibar + 0);
 
@@ -303,6 +307,7 @@ static int spi100_spi_send_command(struct flashctx *flash, unsigned int writecnt
 	/* First byte is cmd which can not be sent through the buffer. */
 	unsigned char cmd = *writearr++;
 	writecnt--;
+	internal_mmap_note_opcode(cmd);
 	msg_pspew("%s, cmd=0x%02x, writecnt=%d, readcnt=%d\n", __func__, cmd, writecnt, readcnt);
 	mmio_writeb(cmd, sb600_spibar + 0);
 
@@ -334,6 +339,28 @@ static int spi100_spi_send_command(struct flashctx *flash, unsigned int writecnt
 	return 0;
 }
 
+/* The top of the chip is decoded at the very top below 4 GiB, as far as ROM range 2 reaches. Read through the
+ * mapping there where possible.
+ */
+static int sb600_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	unsigned int size = flash->chip->total_size * 1024;
+
+	return internal_mmap_read(flash, buf, start, len, size > sb600_rom_decode ? size - sb600_rom_decode : 0,
+				  size, default_spi_read);
+}
+
+/* LPC ROM address range 2 (regs 0x6c/0x6e) holds the upper 16 bits of its first and last address. */
+static void sb600_read_rom_decode(struct pci_dev *dev)
+{
+	uint32_t start = (uint32_t)pci_read_word(dev, 0x6c) << 16;
+	uint32_t end = (uint32_t)pci_read_word(dev, 0x6e) << 16 | 0xffff;
+
+	msg_pdbg("ROM address range 2 is 0x%08x-0x%08x.\n", start, end);
+	if (end == 0xffffffff && start && start <= end)
+		sb600_rom_decode = -start;
+}
+
 struct spispeed {
 	const char *const name;
 	const uint8_t speed;
@@ -550,6 +577,7 @@ int sb600_probe_spi(struct pci_dev *dev)
 	 */
 	sb600_spibar += tmp & 0xfff;
 
+	sb600_read_rom_decode(dev);
 	determine_generation(dev);
 	if (amd_gen == CHIPSET_AMD_UNKNOWN) {
 		msg_perr("Could not determine chipset generation.");
@@ -211,10 +211,14 @@ static int sp_automatic_cmdcheck(uint8_t cmd)
 	return 0;
 }
 
-static int sp_docommand(uint8_t command, uint32_t parmlen,
-			uint8_t *params, uint32_t retlen, void *retparms)
+/* Like sp_docommand, but the parameters are followed by segcnt additional segments which are written to the
+ * serial port directly, i.e. without copying them into a contiguous buffer first. */
+static int sp_docommand_sg(uint8_t command, uint32_t parmlen, uint8_t *params,
+			   unsigned int segcnt, const struct spi_segment *segs,
+			   uint32_t retlen, void *retparms)
 {
 	unsigned char c;
+	unsigned int i;
 	if (sp_automatic_cmdcheck(command))
 		return 1;
 	if (serialport_write(&command, 1) != 0) {
@@ -225,6 +229,12 @@ static int sp_docommand(uint8_t command, uint32_t parmlen,
 		msg_perr("Error: cannot write parameters: %s\n", strerror(errno));
 		return 1;
 	}
+	for (i = 0; i < segcnt; i++) {
+		if (serialport_write(segs[i].buf, segs[i].len) != 0) {
+			msg_perr("Error: cannot write parameters: %s\n", strerror(errno));
+			return 1;
+		}
+	}
 	if (serialport_read(&c, 1) != 0) {
 		msg_perr("Error: cannot read from device: %s\n", strerror(errno));
 		return 1;
@@ -244,6 +254,12 @@ static int sp_docommand(uint8_t command, uint32_t parmlen,
 	return 0;
 }
 
+static int sp_docommand(uint8_t command, uint32_t parmlen,
+			uint8_t *params, uint32_t retlen, void *retparms)
+{
+	return sp_docommand_sg(command, parmlen, params, 0, NULL, retlen, retparms);
+}
+
 static int sp_flush_stream(void)
 {
 	if (sp_streamed_transmit_ops)
@@ -303,14 +319,19 @@ static int serprog_spi_send_command(struct flashctx *flash,
 				    unsigned int writecnt, unsigned int readcnt,
 				    const unsigned char *writearr,
 				    unsigned char *readarr);
+static int serprog_spi_send_command_sg(struct flashctx *flash, const struct spi_command *cmd);
+static int serprog_spi_poll_status(struct flashctx *flash, uint8_t mask, uint8_t value, unsigned int delay);
 static int serprog_spi_read(struct flashctx *flash, uint8_t *buf,
 			    unsigned int start, unsigned int len);
+static int serprog_spi_set_speed(const struct flashctx *flash, unsigned int *hz);
 static struct spi_master spi_master_serprog = {
 	.type		= SPI_CONTROLLER_SERPROG,
 	.max_data_read	= MAX_DATA_READ_UNLIMITED,
 	.max_data_write	= MAX_DATA_WRITE_UNLIMITED,
 	.command	= serprog_spi_send_command,
 	.multicommand	= default_spi_send_multicommand,
+	.command_sg	= serprog_spi_send_command_sg,
+	.poll_status	= serprog_spi_poll_status,
 	.read		= serprog_spi_read,
 	.write_256	= default_spi_write_256,
 	.write_aai	= default_spi_write_aai,
@@ -514,8 +535,7 @@ int serprog_init(void)
 		}
 		spispeed = extract_programmer_param("spispeed");
 		if (spispeed && strlen(spispeed)) {
-			uint32_t f_spi_req, f_spi;
-			uint8_t buf[4];
+			unsigned int f_spi_req, f_spi;
 			char *f_spi_suffix;
 
 			errno = 0;
@@ -541,24 +561,18 @@ int serprog_init(void)
 				return 1;
 			}
 
-			buf[0] = (f_spi_req >> (0 * 8)) & 0xFF;
-			buf[1] = (f_spi_req >> (1 * 8)) & 0xFF;
-			buf[2] = (f_spi_req >> (2 * 8)) & 0xFF;
-			buf[3] = (f_spi_req >> (3 * 8)) & 0xFF;
-
+			f_spi = f_spi_req;
 			if (sp_check_commandavail(S_CMD_S_SPI_FREQ) == 0)
 				msg_pwarn(MSGHEADER "Warning: Setting the SPI clock rate is not supported!\n");
-			else if (sp_docommand(S_CMD_S_SPI_FREQ, 4, buf, 4, buf) == 0) {
-				f_spi = buf[0];
-				f_spi |= buf[1] << (1 * 8);
-				f_spi |= buf[2] << (2 * 8);
-				f_spi |= buf[3] << (3 * 8);
+			else if (serprog_spi_set_speed(NULL, &f_spi) == 0) {
 				msg_pdbg(MSGHEADER "Requested to set SPI clock frequency to %u Hz. "
 					 "It was actually set to %u Hz\n", f_spi_req, f_spi);
 			} else
 				msg_pwarn(MSGHEADER "Setting SPI clock rate to %u Hz failed!\n", f_spi_req);
 		}
 		free(spispeed);
+		if (sp_check_commandavail(S_CMD_S_SPI_FREQ))
+			spi_master_serprog.set_speed = serprog_spi_set_speed;
 		bt = serprog_buses_supported;
 		if (sp_docommand(S_CMD_S_BUSTYPE, 1, &bt, 0, NULL))
 			return 1;
@@ -900,11 +914,10 @@ void serprog_delay(unsigned int usecs)
 	sp_prev_was_write = 0;
 }
 
-static int serprog_spi_send_command(struct flashctx *flash,
-				    unsigned int writecnt, unsigned int readcnt,
-				    const unsigned char *writearr,
-				    unsigned char *readarr)
+static int serprog_spi_send_command_sg(struct flashctx *flash, const struct spi_command *cmd)
 {
+	const unsigned int writecnt = spi_command_writecnt(cmd);
+	const unsigned int readcnt = cmd->readcnt;
 	unsigned char *parmbuf;
 	int ret;
 	msg_pspew("%s, writecnt=%i, readcnt=%i\n", __func__, writecnt, readcnt);
@@ -915,7 +928,8 @@ static int serprog_spi_send_command(struct flashctx *flash,
 		}
 	}
 
-	parmbuf = malloc(writecnt + 6);
+	/* Only the length header and writearr are copied, write segments are sent from where they are. */
+	parmbuf = malloc(cmd->writecnt + 6);
 	if (!parmbuf) {
 		msg_perr("Error: could not allocate SPI send param buffer.\n");
 		return 1;
@@ -926,13 +940,34 @@ static int serprog_spi_send_command(struct flashctx *flash,
 	parmbuf[3] = (readcnt >> 0) & 0xFF;
 	parmbuf[4] = (readcnt >> 8) & 0xFF;
 	parmbuf[5] = (readcnt >> 16) & 0xFF;
-	memcpy(parmbuf + 6, writearr, writecnt);
-	ret = sp_docommand(S_CMD_O_SPIOP, writecnt + 6, parmbuf, readcnt,
-			   readarr);
+	memcpy(parmbuf + 6, cmd->writearr, cmd->writecnt);
+	ret = sp_docommand_sg(S_CMD_O_SPIOP, cmd->writecnt + 6, parmbuf, cmd->writesegcnt, cmd->writesegs,
+			      readcnt, cmd->readarr);
 	free(parmbuf);
 	return ret;
 }
 
+static int serprog_spi_send_command(struct flashctx *flash,
+				    unsigned int writecnt, unsigned int readcnt,
+				    const unsigned char *writearr,
+				    unsigned char *readarr)
+{
+	const struct spi_command cmd = {
+		.writecnt	= writecnt,
+		.readcnt	= readcnt,
+		.writearr	= writearr,
+		.readarr	= readarr,
+	};
+
+	return serprog_spi_send_command_sg(flash, &cmd);
+}
+
+/* Every status byte has to be sent back over the serial link, so only stream a few of them per round trip. */
+static int serprog_spi_poll_status(struct flashctx *flash, uint8_t mask, uint8_t value, unsigned int delay)
+{
+	return spi_poll_status_streamed(flash, mask, value, delay, 16);
+}
+
 /* FIXME: This function is optimized so that it does not split each transaction
  * into chip page_size long blocks unnecessarily like spi_read_chunked. This has
  * the advantage that it is much faster for most chips, but breaks those with
@@ -952,6 +987,24 @@ static int serprog_spi_read(struct flashctx *flash, uint8_t *buf,
 	return 0;
 }
 
+/* Asks the programmer for an SPI clock of at most *hz, *hz holds the clock it actually set afterwards. */
+static int serprog_spi_set_speed(const struct flashctx *flash, unsigned int *hz)
+{
+	uint8_t buf[4];
+
+	buf[0] = (*hz >> (0 * 8)) & 0xFF;
+	buf[1] = (*hz >> (1 * 8)) & 0xFF;
+	buf[2] = (*hz >> (2 * 8)) & 0xFF;
+	buf[3] = (*hz >> (3 * 8)) & 0xFF;
+	if (sp_docommand(S_CMD_S_SPI_FREQ, 4, buf, 4, buf))
+		return 1;
+	*hz = buf[0];
+	*hz |= buf[1] << (1 * 8);
+	*hz |= buf[2] << (2 * 8);
+	*hz |= buf[3] << (3 * 8);
+	return 0;
+}
+
 void *serprog_map(const char *descr, uintptr_t phys_addr, size_t len)
 {
 	/* Serprog transmits 24 bits only and assumes the underlying implementation handles any remaining bits
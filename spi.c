@@ -24,6 +24,7 @@
 
 #include <strings.h>
 #include <string.h>
+#include <stdlib.h>
 #include "flash.h"
 #include "flashchips.h"
 #include "chipdrivers.h"
@@ -38,8 +39,109 @@ int spi_send_command(struct flashctx *flash, unsigned int writecnt,
 				       readarr);
 }
 
+/* Returns the number of bytes sent in the write phase of cmd, i.e. writearr plus all write segments. */
+unsigned int spi_command_writecnt(const struct spi_command *cmd)
+{
+	unsigned int i, writecnt = cmd->writecnt;
+
+	for (i = 0; i < cmd->writesegcnt; i++)
+		writecnt += cmd->writesegs[i].len;
+	return writecnt;
+}
+
+/* Copies the complete write phase of cmd to dest which has to hold spi_command_writecnt(cmd) bytes. */
+void spi_command_gather(const struct spi_command *cmd, unsigned char *dest)
+{
+	unsigned int i;
+
+	memcpy(dest, cmd->writearr, cmd->writecnt);
+	dest += cmd->writecnt;
+	for (i = 0; i < cmd->writesegcnt; i++) {
+		memcpy(dest, cmd->writesegs[i].buf, cmd->writesegs[i].len);
+		dest += cmd->writesegs[i].len;
+	}
+}
+
+/* Sends cmd through the .command hook of the master with its write segments copied behind writearr. Used
+ * for commands a master's .command_sg hook cannot submit directly. A page program fits the stack buffer.
+ */
+int spi_send_flattened_command(struct flashctx *flash, const struct spi_command *cmd)
+{
+	unsigned char stackbuf[JEDEC_BYTE_PROGRAM_OUTSIZE - 1 + 256];
+	unsigned int writecnt = spi_command_writecnt(cmd);
+	unsigned char *buf = stackbuf;
+	int ret;
+
+	if (writecnt > sizeof(stackbuf)) {
+		buf = malloc(writecnt);
+		if (!buf) {
+			msg_gerr("Out of memory!\n");
+			return SPI_GENERIC_ERROR;
+		}
+	}
+	spi_command_gather(cmd, buf);
+	ret = flash->mst->spi.command(flash, writecnt, cmd->readcnt, buf, cmd->readarr);
+	if (buf != stackbuf)
+		free(buf);
+	return ret;
+}
+
+/* Compatibility shim for masters which expect the complete write phase of a command in writearr.
+ * Segmented commands are copied into bounce buffers, all other commands are passed through as-is.
+ */
+static int spi_send_flattened_multicommand(struct flashctx *flash, struct spi_command *cmds)
+{
+	struct spi_command *flatcmds;
+	unsigned char *buf;
+	unsigned int i, count = 0;
+	int ret = 0;
+
+	while (cmds[count].writecnt || cmds[count].readcnt)
+		count++;
+
+	flatcmds = calloc(count + 1, sizeof(*flatcmds));
+	if (!flatcmds) {
+		msg_gerr("Out of memory!\n");
+		return SPI_GENERIC_ERROR;
+	}
+	for (i = 0; i < count; i++) {
+		flatcmds[i] = cmds[i];
+		if (!cmds[i].writesegcnt)
+			continue;
+		buf = malloc(spi_command_writecnt(&cmds[i]));
+		if (!buf) {
+			msg_gerr("Out of memory!\n");
+			ret = SPI_GENERIC_ERROR;
+			goto out;
+		}
+		spi_command_gather(&cmds[i], buf);
+		flatcmds[i].writecnt = spi_command_writecnt(&cmds[i]);
+		flatcmds[i].writearr = buf;
+		flatcmds[i].writesegcnt = 0;
+		flatcmds[i].writesegs = NULL;
+	}
+
+	ret = flash->mst->spi.multicommand(flash, flatcmds);
+out:
+	/* Only free what we allocated above; i is the number of processed commands. */
+	while (i--) {
+		if (cmds[i].writesegcnt)
+			free((unsigned char *)flatcmds[i].writearr);
+	}
+	free(flatcmds);
+	return ret;
+}
+
 int spi_send_multicommand(struct flashctx *flash, struct spi_command *cmds)
 {
+	struct spi_command *cmd;
+
+	if (!flash->mst->spi.command_sg) {
+		for (cmd = cmds; cmd->writecnt || cmd->readcnt; cmd++) {
+			if (cmd->writesegcnt)
+				return spi_send_flattened_multicommand(flash, cmds);
+		}
+	}
 	return flash->mst->spi.multicommand(flash, cmds);
 }
 
@@ -69,12 +171,101 @@ int default_spi_send_multicommand(struct flashctx *flash,
 {
 	int result = 0;
 	for (; (cmds->writecnt || cmds->readcnt) && !result; cmds++) {
-		result = spi_send_command(flash, cmds->writecnt, cmds->readcnt,
-					  cmds->writearr, cmds->readarr);
+		if (flash->mst->spi.command_sg)
+			result = flash->mst->spi.command_sg(flash, cmds);
+		else
+			result = spi_send_command(flash, cmds->writecnt, cmds->readcnt,
+						  cmds->writearr, cmds->readarr);
 	}
 	return result;
 }
 
+/* Waits until (status register & mask) == value. Masters with a .poll_status hook may do this without a round
+ * trip per status read, all others get a generic RDSR loop with delay us between the reads. */
+int spi_poll_status(struct flashctx *flash, uint8_t mask, uint8_t value, unsigned int delay)
+{
+	if (flash->mst->spi.poll_status)
+		return flash->mst->spi.poll_status(flash, mask, value, delay);
+	return default_spi_poll_status(flash, mask, value, delay);
+}
+
+int default_spi_poll_status(struct flashctx *flash, uint8_t mask, uint8_t value, unsigned int delay)
+{
+	/* FIXME: We assume spi_read_status_register will never fail. */
+	while ((spi_read_status_register(flash) & mask) != value)
+		programmer_delay(delay);
+	return 0;
+}
+
+/* Polls the status register with RDSR transactions that read len status bytes each. Most SPI NOR chips
+ * keep shifting out the current status register contents for as long as CS# stays asserted after RDSR,
+ * hence a single transaction covers a much longer period than a single status read. This is meant to be
+ * used by .poll_status implementations of masters where each transaction costs a round trip. */
+int spi_poll_status_streamed(struct flashctx *flash, uint8_t mask, uint8_t value, unsigned int delay,
+			     unsigned int len)
+{
+	static const unsigned char cmd[JEDEC_RDSR_OUTSIZE] = { JEDEC_RDSR };
+	unsigned char status[SPI_POLL_STATUS_MAX_LEN];
+	unsigned int i;
+
+	len = min(max(len, 1), SPI_POLL_STATUS_MAX_LEN);
+	while (1) {
+		if (spi_send_command(flash, sizeof(cmd), len, cmd, status)) {
+			msg_cerr("RDSR failed!\n");
+			return SPI_GENERIC_ERROR;
+		}
+		for (i = 0; i < len; i++) {
+			if ((status[i] & mask) == value)
+				return 0;
+		}
+		programmer_delay(delay);
+	}
+}
+
+/* Queues xfer at the master. Masters without native support for asynchronous transfers run it right away.
+ * Returns 0 if xfer was queued (or already completed), its result is returned by spi_xfer_wait() which has to
+ * be called before any other (synchronous) access to the same master. The completion callback is not called if
+ * submitting fails. */
+int spi_xfer_submit(struct flashctx *flash, struct spi_xfer *xfer)
+{
+	xfer->done = 0;
+	xfer->result = 0;
+	if (flash->mst->spi.submit)
+		return flash->mst->spi.submit(flash, xfer);
+	spi_xfer_run(flash, xfer);
+	return 0;
+}
+
+/* Waits until xfer is complete and returns its result. */
+int spi_xfer_wait(struct flashctx *flash, struct spi_xfer *xfer)
+{
+	if (!xfer->done && flash->mst->spi.wait)
+		flash->mst->spi.wait(flash, xfer);
+	if (!xfer->done) {
+		msg_cerr("%s: transfer was never completed!\n", __func__);
+		return SPI_GENERIC_ERROR;
+	}
+	return xfer->result;
+}
+
+/* Synchronous adapter: runs xfer with the blocking read of the master and completes it. */
+int spi_xfer_run(struct flashctx *flash, struct spi_xfer *xfer)
+{
+	int ret = flash->mst->spi.read(flash, xfer->readbuf, xfer->start, xfer->len);
+
+	spi_xfer_complete(xfer, ret);
+	return ret;
+}
+
+/* Called by the transport once xfer is done. */
+void spi_xfer_complete(struct spi_xfer *xfer, int result)
+{
+	xfer->result = result;
+	xfer->done = 1;
+	if (xfer->complete)
+		xfer->complete(xfer);
+}
+
 int default_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start,
 		     unsigned int len)
 {
@@ -100,8 +291,8 @@ int default_spi_write_256(struct flashctx *flash, const uint8_t *buf, unsigned i
 	return spi_write_chunked(flash, buf, start, len, max_data);
 }
 
-int spi_chip_read(struct flashctx *flash, uint8_t *buf, unsigned int start,
-		  unsigned int len)
+/* Returns the address of the chip in the address space of the master, warns if it does not fit. */
+static unsigned int spi_chip_read_base(struct flashctx *flash, int log)
 {
 	unsigned int addrbase = 0;
 
@@ -111,20 +302,39 @@ int spi_chip_read(struct flashctx *flash, uint8_t *buf, unsigned int start,
 	 */
 	addrbase = spi_get_valid_read_addr(flash);
 	if (addrbase + flash->chip->total_size * 1024 > (1 << 24)) {
-		msg_perr("Flash chip size exceeds the allowed access window. ");
-		msg_perr("Read will probably fail.\n");
+		if (log) {
+			msg_perr("Flash chip size exceeds the allowed access window. ");
+			msg_perr("Read will probably fail.\n");
+		}
 		/* Try to get the best alignment subject to constraints. */
 		addrbase = (1 << 24) - flash->chip->total_size * 1024;
 	}
 	/* Check if alignment is native (at least the largest power of two which
 	 * is a factor of the mapped size of the chip).
 	 */
-	if (ffs(flash->chip->total_size * 1024) > (ffs(addrbase) ? : 33)) {
+	if (log && ffs(flash->chip->total_size * 1024) > (ffs(addrbase) ? : 33)) {
 		msg_perr("Flash chip is not aligned natively in the allowed "
 			 "access window.\n");
 		msg_perr("Read will probably return garbage.\n");
 	}
-	return flash->mst->spi.read(flash, buf, addrbase + start, len);
+	return addrbase;
+}
+
+int spi_chip_read(struct flashctx *flash, uint8_t *buf, unsigned int start,
+		  unsigned int len)
+{
+	return flash->mst->spi.read(flash, buf, spi_chip_read_base(flash, 1) + start, len);
+}
+
+/* Like spi_chip_read(), but only submits the read as xfer, see spi_xfer_submit(). */
+int spi_chip_read_submit(struct flashctx *flash, struct spi_xfer *xfer, uint8_t *buf, unsigned int start,
+			 unsigned int len)
+{
+	memset(xfer, 0, sizeof(*xfer));
+	xfer->readbuf = buf;
+	xfer->start = spi_chip_read_base(flash, start == 0) + start;
+	xfer->len = len;
+	return spi_xfer_submit(flash, xfer);
 }
 
 /*
@@ -165,6 +375,171 @@ int spi_aai_write(struct flashctx *flash, const uint8_t *buf, unsigned int start
 	return flash->mst->spi.write_aai(flash, buf, start, len);
 }
 
+/* SPI clock rates tried by spi_autotune(), in ascending order. */
+static const unsigned int spi_tune_speeds[] = {
+	1000000, 2000000, 4000000, 6000000, 8000000, 12000000, 16000000, 24000000, 32000000, 48000000, 64000000,
+};
+#define SPI_TUNE_STEPS	(sizeof(spi_tune_speeds) / sizeof(spi_tune_speeds[0]))
+/* Every rate has to read the tuning region SPI_TUNE_ROUNDS times like the slowest one did. */
+#define SPI_TUNE_LEN	(16 * 1024)
+#define SPI_TUNE_ROUNDS	4
+/* Number of steps kept below the fastest stable rate. */
+#define SPI_TUNE_MARGIN	1
+/* Number of places spread over the chip where a tuning region is looked for. */
+#define SPI_TUNE_PROBES	16
+/* Distinct byte values a tuning region needs, erased or zeroed areas would not show flipped bits. */
+#define SPI_TUNE_MIN_VALUES	64
+
+static int spi_set_speed_step(struct flashctx *flash, int step, unsigned int *hz)
+{
+	*hz = spi_tune_speeds[step];
+	if (flash->mst->spi.set_speed(flash, hz)) {
+		msg_perr("Setting the SPI clock to %u Hz failed.\n", spi_tune_speeds[step]);
+		return 1;
+	}
+	return 0;
+}
+
+static bool spi_tune_mixed(const uint8_t *buf, unsigned int len)
+{
+	bool seen[256] = { false };
+	unsigned int i, values = 0;
+
+	for (i = 0; i < len && values < SPI_TUNE_MIN_VALUES; i++) {
+		if (!seen[buf[i]]) {
+			seen[buf[i]] = true;
+			values++;
+		}
+	}
+	return values >= SPI_TUNE_MIN_VALUES;
+}
+
+/*
+ * Reads candidate regions at the current clock until one with mixed data is found. Returns its offset in
+ * *offset with the contents in ref, 0 if there is none, or -1 if a read failed.
+ */
+static int spi_tune_find_region(struct flashctx *flash, uint8_t *ref, unsigned int len, unsigned int *offset)
+{
+	unsigned int size = flash->chip->total_size * 1024;
+	unsigned int i, start, last = 0;
+
+	for (i = 0; i < SPI_TUNE_PROBES; i++) {
+		start = (unsigned long)size * i / SPI_TUNE_PROBES / len * len;
+		if (start + len > size)
+			break;
+		if (i && start == last)
+			continue;
+		last = start;
+		if (flash->chip->read(flash, ref, start, len))
+			return -1;
+		if (spi_tune_mixed(ref, len)) {
+			*offset = start;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Returns 0 if reading the tuning region SPI_TUNE_ROUNDS times yields ref each time. */
+static int spi_tune_check(struct flashctx *flash, const uint8_t *ref, uint8_t *buf, unsigned int offset,
+			  unsigned int len)
+{
+	int i;
+
+	for (i = 0; i < SPI_TUNE_ROUNDS; i++) {
+		if (flash->chip->read(flash, buf, offset, len) || memcmp(buf, ref, len))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Finds the fastest SPI clock which reads reliably: a region of the chip with mixed data is read at the slowest
+ * rate as reference, then at ever faster rates until a read differs from it. The clock is set SPI_TUNE_MARGIN
+ * steps below the fastest stable rate, even if all of them were. Nothing is written, so a chip without such a
+ * region (e.g. an erased one) is accessed at the slowest rate. Masters without a set_speed hook keep their clock.
+ */
+int spi_autotune(struct flashctx *flash)
+{
+	unsigned int len = min(SPI_TUNE_LEN, flash->chip->total_size * 1024);
+	unsigned int hz, last_hz = 0, offset = 0;
+	uint8_t *ref, *buf;
+	int step, stable = 0, ret = 1, found;
+
+	if (flash->chip->bustype != BUS_SPI || !flash->mst->spi.set_speed) {
+		msg_pinfo("The programmer can not change the SPI clock, not tuning it.\n");
+		return 0;
+	}
+	ref = malloc(len);
+	buf = malloc(len);
+	if (!ref || !buf) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+
+	msg_pinfo("Tuning the SPI clock... ");
+	found = -1;
+	if (spi_set_speed_step(flash, 0, &hz) || (found = spi_tune_find_region(flash, ref, len, &offset)) < 0 ||
+	    (found && spi_tune_check(flash, ref, buf, offset, len))) {
+		msg_pinfo("FAILED.\n");
+		msg_perr("Reads at the slowest SPI clock are not reliable.\n");
+		goto out;
+	}
+	if (!found) {
+		msg_pinfo("skipped.\n");
+		msg_pwarn("The chip holds no region with mixed data to tune the SPI clock with, using the "
+			  "slowest clock of %u Hz.\n", hz);
+		flash->ctx->spi_tune_step = 0;
+		ret = 0;
+		goto out;
+	}
+	msg_pdbg("\nTuning with 0x%06x-0x%06x, %u Hz is stable", offset, offset + len - 1, hz);
+	last_hz = hz;
+	for (step = 1; step < SPI_TUNE_STEPS; step++) {
+		if (spi_set_speed_step(flash, step, &hz))
+			break;
+		/* The master rounds down, the rate is not faster than the last one. */
+		if (hz <= last_hz) {
+			stable = step;
+			continue;
+		}
+		if (spi_tune_check(flash, ref, buf, offset, len)) {
+			msg_pdbg(", %u Hz is not", hz);
+			break;
+		}
+		msg_pdbg(", %u Hz is stable", hz);
+		stable = step;
+		last_hz = hz;
+	}
+	msg_pdbg(".\n");
+	flash->ctx->spi_tune_step = max(0, stable - SPI_TUNE_MARGIN);
+	if (spi_set_speed_step(flash, flash->ctx->spi_tune_step, &hz)) {
+		flash->ctx->spi_tune_step = -1;
+		goto out;
+	}
+	msg_pinfo("%u Hz.\n", hz);
+	ret = 0;
+out:
+	free(ref);
+	free(buf);
+	return ret;
+}
+
+/* Lowers a tuned SPI clock by one step after a mismatch. Returns 0 if it was lowered. */
+int spi_speed_step_down(struct flashctx *flash)
+{
+	unsigned int hz;
+
+	if (flash->ctx->spi_tune_step <= 0)
+		return 1;
+	if (spi_set_speed_step(flash, --flash->ctx->spi_tune_step, &hz)) {
+		flash->ctx->spi_tune_step = -1;
+		return 1;
+	}
+	msg_pinfo("Lowered the SPI clock to %u Hz.\n", hz);
+	return 0;
+}
+
 int register_spi_master(const struct spi_master *mst)
 {
 	struct registered_master rmst;
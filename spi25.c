@@ -351,11 +351,9 @@ int spi_chip_erase_60(struct flashctx *flash)
 	/* Wait until the Write-In-Progress bit is cleared.
 	 * This usually takes 1-85 s, so wait in 1 s steps.
 	 */
-	/* FIXME: We assume spi_read_status_register will never fail. */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(1000 * 1000);
+	result = spi_poll_status(flash, SPI_SR_WIP, 0, 1000 * 1000);
 	/* FIXME: Check the status register for errors. */
-	return 0;
+	return result;
 }
 
 int spi_chip_erase_62(struct flashctx *flash)
@@ -388,11 +386,9 @@ int spi_chip_erase_62(struct flashctx *flash)
 	/* Wait until the Write-In-Progress bit is cleared.
 	 * This usually takes 2-5 s, so wait in 100 ms steps.
 	 */
-	/* FIXME: We assume spi_read_status_register will never fail. */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(100 * 1000);
+	result = spi_poll_status(flash, SPI_SR_WIP, 0, 100 * 1000);
 	/* FIXME: Check the status register for errors. */
-	return 0;
+	return result;
 }
 
 int spi_chip_erase_c7(struct flashctx *flash)
@@ -424,11 +420,9 @@ int spi_chip_erase_c7(struct flashctx *flash)
 	/* Wait until the Write-In-Progress bit is cleared.
 	 * This usually takes 1-85 s, so wait in 1 s steps.
 	 */
-	/* FIXME: We assume spi_read_status_register will never fail. */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(1000 * 1000);
+	result = spi_poll_status(flash, SPI_SR_WIP, 0, 1000 * 1000);
 	/* FIXME: Check the status register for errors. */
-	return 0;
+	return result;
 }
 
 int spi_block_erase_52(struct flashctx *flash, unsigned int addr,
@@ -467,10 +461,9 @@ int spi_block_erase_52(struct flashctx *flash, unsigned int addr,
 	/* Wait until the Write-In-Progress bit is cleared.
 	 * This usually takes 100-4000 ms, so wait in 100 ms steps.
 	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(100 * 1000);
+	result = spi_poll_status(flash, SPI_SR_WIP, 0, 100 * 1000);
 	/* FIXME: Check the status register for errors. */
-	return 0;
+	return result;
 }
 
 /* Block size is usually
@@ -510,10 +503,9 @@ int spi_block_erase_c4(struct flashctx *flash, unsigned int addr, unsigned int b
 	/* Wait until the Write-In-Progress bit is cleared.
 	 * This usually takes 240-480 s, so wait in 500 ms steps.
 	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(500 * 1000 * 1000);
+	result = spi_poll_status(flash, SPI_SR_WIP, 0, 500 * 1000 * 1000);
 	/* FIXME: Check the status register for errors. */
-	return 0;
+	return result;
 }
 
 /* Block size is usually
@@ -557,10 +549,9 @@ int spi_block_erase_d8(struct flashctx *flash, unsigned int addr,
 	/* Wait until the Write-In-Progress bit is cleared.
 	 * This usually takes 100-4000 ms, so wait in 100 ms steps.
 	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(100 * 1000);
+	result = spi_poll_status(flash, SPI_SR_WIP, 0, 100 * 1000);
 	/* FIXME: Check the status register for errors. */
-	return 0;
+	return result;
 }
 
 /* Block size is usually
@@ -602,10 +593,9 @@ int spi_block_erase_d7(struct flashctx *flash, unsigned int addr,
 	/* Wait until the Write-In-Progress bit is cleared.
 	 * This usually takes 100-4000 ms, so wait in 100 ms steps.
 	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(100 * 1000);
+	result = spi_poll_status(flash, SPI_SR_WIP, 0, 100 * 1000);
 	/* FIXME: Check the status register for errors. */
-	return 0;
+	return result;
 }
 
 /* Page erase (usually 256B blocks) */
@@ -643,10 +633,9 @@ int spi_block_erase_db(struct flashctx *flash, unsigned int addr, unsigned int b
 
 	/* Wait until the Write-In-Progress bit is cleared.
 	 * This takes up to 20 ms usually (on worn out devices up to the 0.5s range), so wait in 1 ms steps. */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(1 * 1000);
+	result = spi_poll_status(flash, SPI_SR_WIP, 0, 1 * 1000);
 	/* FIXME: Check the status register for errors. */
-	return 0;
+	return result;
 }
 
 /* Sector size is usually 4k, though Macronix eliteflash has 64k */
@@ -686,10 +675,9 @@ int spi_block_erase_20(struct flashctx *flash, unsigned int addr,
 	/* Wait until the Write-In-Progress bit is cleared.
 	 * This usually takes 15-800 ms, so wait in 10 ms steps.
 	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(10 * 1000);
+	result = spi_poll_status(flash, SPI_SR_WIP, 0, 10 * 1000);
 	/* FIXME: Check the status register for errors. */
-	return 0;
+	return result;
 }
 
 int spi_block_erase_50(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
@@ -726,10 +714,9 @@ int spi_block_erase_50(struct flashctx *flash, unsigned int addr, unsigned int b
 	/* Wait until the Write-In-Progress bit is cleared.
 	 * This usually takes 10 ms, so wait in 1 ms steps.
 	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(1 * 1000);
+	result = spi_poll_status(flash, SPI_SR_WIP, 0, 1 * 1000);
 	/* FIXME: Check the status register for errors. */
-	return 0;
+	return result;
 }
 
 int spi_block_erase_81(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
@@ -766,10 +753,9 @@ int spi_block_erase_81(struct flashctx *flash, unsigned int addr, unsigned int b
 	/* Wait until the Write-In-Progress bit is cleared.
 	 * This usually takes 8 ms, so wait in 1 ms steps.
 	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(1 * 1000);
+	result = spi_poll_status(flash, SPI_SR_WIP, 0, 1 * 1000);
 	/* FIXME: Check the status register for errors. */
-	return 0;
+	return result;
 }
 
 int spi_block_erase_60(struct flashctx *flash, unsigned int addr,
@@ -840,6 +826,19 @@ erasefunc_t *spi_get_erasefn_from_opcode(uint8_t opcode)
 	}
 }
 
+/* Returns the opcode used by the erase function func or 0x00 if func is not a SPI erase function. */
+uint8_t spi_get_opcode_from_erasefn(erasefunc_t *func)
+{
+	static const uint8_t opcodes[] = {0x20, 0x50, 0x52, 0x60, 0x62, 0x81, 0xc4, 0xc7, 0xd7, 0xd8, 0xdb};
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(opcodes); i++) {
+		if (spi_get_erasefn_from_opcode(opcodes[i]) == func)
+			return opcodes[i];
+	}
+	return 0x00;
+}
+
 int spi_byte_program(struct flashctx *flash, unsigned int addr,
 		     uint8_t databyte)
 {
@@ -879,13 +878,19 @@ int spi_byte_program(struct flashctx *flash, unsigned int addr,
 int spi_nbyte_program(struct flashctx *flash, unsigned int addr, const uint8_t *bytes, unsigned int len)
 {
 	int result;
-	/* FIXME: Switch to malloc based on len unless that kills speed. */
 	unsigned char cmd[JEDEC_BYTE_PROGRAM_OUTSIZE - 1 + 256] = {
 		JEDEC_BYTE_PROGRAM,
 		(addr >> 16) & 0xff,
 		(addr >> 8) & 0xff,
 		(addr >> 0) & 0xff,
 	};
+	/* Masters with a .command_sg hook get the payload straight from the caller's buffer behind the
+	 * header, all others get it copied into cmd. */
+	const struct spi_segment payload = {
+		.len	= len,
+		.buf	= bytes,
+	};
+	const bool sg = flash->mst->spi.command_sg != NULL;
 	struct spi_command cmds[] = {
 	{
 		.writecnt	= JEDEC_WREN_OUTSIZE,
@@ -893,10 +898,12 @@ int spi_nbyte_program(struct flashctx *flash, unsigned int addr, const uint8_t *
 		.readcnt	= 0,
 		.readarr	= NULL,
 	}, {
-		.writecnt	= JEDEC_BYTE_PROGRAM_OUTSIZE - 1 + len,
+		.writecnt	= JEDEC_BYTE_PROGRAM_OUTSIZE - 1 + (sg ? 0 : len),
 		.writearr	= cmd,
 		.readcnt	= 0,
 		.readarr	= NULL,
+		.writesegcnt	= sg ? 1 : 0,
+		.writesegs	= sg ? &payload : NULL,
 	}, {
 		.writecnt	= 0,
 		.writearr	= NULL,
@@ -913,7 +920,8 @@ int spi_nbyte_program(struct flashctx *flash, unsigned int addr, const uint8_t *
 		return 1;
 	}
 
-	memcpy(&cmd[4], bytes, len);
+	if (!sg)
+		memcpy(&cmd[4], bytes, len);
 
 	result = spi_send_multicommand(flash, cmds);
 	if (result) {
@@ -1014,8 +1022,9 @@ int spi_write_chunked(struct flashctx *flash, const uint8_t *buf, unsigned int s
 			rc = spi_nbyte_program(flash, starthere + j, buf + starthere - start + j, towrite);
 			if (rc)
 				break;
-			while (spi_read_status_register(flash) & SPI_SR_WIP)
-				programmer_delay(10);
+			rc = spi_poll_status(flash, SPI_SR_WIP, 0, 10);
+			if (rc)
+				break;
 		}
 		if (rc)
 			break;
@@ -1040,8 +1049,8 @@ int spi_chip_write_1(struct flashctx *flash, const uint8_t *buf, unsigned int st
 		result = spi_byte_program(flash, i, buf[i - start]);
 		if (result)
 			return 1;
-		while (spi_read_status_register(flash) & SPI_SR_WIP)
-			programmer_delay(10);
+		if (spi_poll_status(flash, SPI_SR_WIP, 0, 10))
+			return 1;
 	}
 
 	return 0;
@@ -1130,8 +1139,9 @@ int default_spi_write_aai(struct flashctx *flash, const uint8_t *buf, unsigned i
 		msg_cerr("%s failed during start command execution: %d\n", __func__, result);
 		goto bailout;
 	}
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(10);
+	result = spi_poll_status(flash, SPI_SR_WIP, 0, 10);
+	if (result != 0)
+		goto bailout;
 
 	/* We already wrote 2 bytes in the multicommand step. */
 	pos += 2;
@@ -1145,8 +1155,9 @@ int default_spi_write_aai(struct flashctx *flash, const uint8_t *buf, unsigned i
 			msg_cerr("%s failed during followup AAI command execution: %d\n", __func__, result);
 			goto bailout;
 		}
-		while (spi_read_status_register(flash) & SPI_SR_WIP)
-			programmer_delay(10);
+		result = spi_poll_status(flash, SPI_SR_WIP, 0, 10);
+		if (result != 0)
+			goto bailout;
 	}
 
 	/* Use WRDI to exit AAI mode. This needs to be done before issuing any other non-AAI command. */